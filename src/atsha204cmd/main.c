@@ -60,22 +60,8 @@ bool read_challenge(char *buff) {
 
 bool get_challenge_from_input(char *buff, atsha_big_int *challenge) {
 	challenge->bytes = ATSHA_MAX_DATA_SIZE;
-	char *end = (buff + strlen(buff));
 
-	size_t i = 0;
-	while (i < challenge->bytes) {
-		if (buff[0] == ' ' || buff[0] == '\t' || buff[0] == ';' || buff[0] == ',' || buff[0] == ':') {
-			buff++;
-			continue;
-		}
-
-		challenge->data[i++] = get_number_from_hex_char(buff[0], buff[1]);
-		buff += 2;
-
-		if (buff >= end) return false;
-	}
-
-	return true;
+	return hex_decode(buff, challenge->data, challenge->bytes, NULL);
 }
 
 bool get_file_sha256(atsha_big_int *abi, FILE *stream) {
@@ -208,33 +194,28 @@ int main(int argc, char **argv) {
 			return 1;
 		}
 
-		atsha_big_int prefix;
-		atsha_big_int addr;
+		unsigned char otp[ATSHA_OTP_ZONE_SIZE];
 
-		status = atsha_raw_otp_read(handle, ATSHA204_OTP_MEMORY_MAP_MAC_PREFIX, &prefix);
+		status = atsha_otp_zone_read(handle, otp);
 		if (status != ATSHA_ERR_OK) {
-			fprintf(stderr, ": Get MAC address prefix failed: %s\n", atsha_error_name(status));
+			fprintf(stderr, "Get MAC address failed: %s\n", atsha_error_name(status));
 			atsha_close(handle);
 			return 3;
 		}
 
-		status = atsha_raw_otp_read(handle, ATSHA204_OTP_MEMORY_MAP_MAC_ADDR, &addr);
-		if (status != ATSHA_ERR_OK) {
-			fprintf(stderr, "Get MAC address suffix failed: %s\n", atsha_error_name(status));
-			atsha_close(handle);
-			return 3;
-		}
+		unsigned char *prefix = otp + (ATSHA204_OTP_MEMORY_MAP_MAC_PREFIX * ATSHA204_OTP_BYTE_LEN);
+		unsigned char *addr = otp + (ATSHA204_OTP_MEMORY_MAP_MAC_ADDR * ATSHA204_OTP_BYTE_LEN);
 
 		assert(sizeof(unsigned int) >= 4);
 
 		unsigned int mac_as_number = 0, mac_as_number_orig = 0;
 		unsigned char tmp_mac[6];
 
-		memcpy(tmp_mac, (prefix.data+1), 3);
+		memcpy(tmp_mac, (prefix+1), 3);
 
-		mac_as_number_orig |= (addr.data[1] << 8*2);
-		mac_as_number_orig |= (addr.data[2] << 8*1);
-		mac_as_number_orig |= addr.data[3];
+		mac_as_number_orig |= (addr[1] << 8*2);
+		mac_as_number_orig |= (addr[2] << 8*1);
+		mac_as_number_orig |= addr[3];
 
 		if (mac_as_number_orig > (((unsigned int)0xFFFFFF)-n)) {
 			fprintf(stderr, "MAC address count is to big!\n");
@@ -0,0 +1,492 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "../libatsha204/atsha204.h"
+#include "../libatsha204/atsha204consts.h"
+#include "../libatsha204/configuration.h"
+#include "../libatsha204/api.h"
+#include "../libatsha204/communication.h"
+#include "../libatsha204/layer_daemon.h"
+#include "../libatsha204/operations.h"
+#include "../libatsha204/tools.h"
+
+/*
+ * Daemon owns the device and serves clients one transaction at a time.
+ * Frames of other clients wait in their buffers until the transaction
+ * ends. The device isn't put to idle right after the transaction; next
+ * transaction reuses the wake period if it comes soon enough.
+ */
+
+#define LISTEN_FDS_START 3
+#define CLIENT_BUFFER (4 * (DAEMON_MSG_HEADER_LEN + ATSHA204_IO_BUFFER))
+#define MIN_PACKET_LEN 7
+#define CONFIG_OTPMODE_BYTE 18
+#define CONFIG_IMMUTABLE_WORDS 13 //SN, RevNum, I2C, OTPmode and SlotConfig don't change after lock
+#define NO_CLIENT (-1)
+
+struct client {
+	int fd;
+	unsigned char in[CLIENT_BUFFER];
+	size_t in_len;
+};
+
+struct cache_entry {
+	unsigned char key[4]; //opcode, param1, param2
+	unsigned char answer[ATSHA204_IO_BUFFER];
+};
+
+static struct atsha_handle *g_handle;
+static struct client g_clients[DAEMON_MAX_CLIENTS];
+static size_t g_client_cnt;
+static int g_owner = NO_CLIENT; //Client in transaction
+static uint64_t g_owner_active; //Last request of transaction owner
+static bool g_awake;
+static uint64_t g_woken; //Start of actual wake period
+static uint64_t g_released; //End of last transaction
+static bool g_cache_conf, g_cache_otp;
+static struct cache_entry g_cache[DAEMON_CACHE_SIZE];
+static size_t g_cache_cnt;
+static volatile sig_atomic_t g_terminate;
+
+void log_callback(const char *msg) {
+	fprintf(stderr, "Log: %s\n", msg);
+}
+
+static void on_signal(int sig) {
+	(void) sig;
+	g_terminate = 1;
+}
+
+/*
+ * Answers of reads from immutable parts of locked zones never change, they are served
+ * without waking the device
+ */
+static void cache_setup(void) {
+	unsigned char zone[ATSHA_CONFIG_ZONE_SIZE];
+
+	if (atsha_conf_zone_read(g_handle, zone) != ATSHA_ERR_OK) {
+		log_message("atsha204d: cache_setup: Couldn't read config zone; caching disabled");
+		return;
+	}
+
+	g_cache_conf = (zone[ATSHA204_CONFIG_LOCK_CONFIG] == ATSHA204_CONFIG_ZONE_LOCKED);
+	g_cache_otp = g_cache_conf && (zone[ATSHA204_CONFIG_LOCK_VALUE] == ATSHA204_CONFIG_ZONE_LOCKED) && (zone[CONFIG_OTPMODE_BYTE] == ATSHA204_CONFIG_OTPMODE_READONLY);
+}
+
+static bool cacheable(const unsigned char *packet) {
+	if (packet[1] == ATSHA204_OPCODE_DEV_REV) return true;
+	if (packet[1] != ATSHA204_OPCODE_READ) return false;
+
+	unsigned char zone = packet[2] & 0x03;
+	if (zone == IO_MEM_CONFIG) {
+		//UseFlag, UpdateCount, LastKeyUse and LockValue change even in locked config zone
+		unsigned char address = packet[3];
+		unsigned char last_word = (packet[2] & IO_RW_32_BYTES) ? (address / 8) * 8 + 7 : address;
+		if (packet[4] != 0 || last_word >= CONFIG_IMMUTABLE_WORDS) return false;
+
+		return g_cache_conf;
+	}
+	if (zone == IO_MEM_OTP) return g_cache_otp;
+
+	return false;
+}
+
+static struct cache_entry *cache_find(const unsigned char *packet) {
+	for (size_t i = 0; i < g_cache_cnt; i++) {
+		if (memcmp(g_cache[i].key, packet + 1, sizeof(g_cache[i].key)) == 0) return &g_cache[i];
+	}
+
+	return NULL;
+}
+
+static void cache_store(const unsigned char *packet, const unsigned char *answer) {
+	if (g_cache_cnt >= DAEMON_CACHE_SIZE) return;
+
+	struct cache_entry *entry = &g_cache[g_cache_cnt++];
+	memcpy(entry->key, packet + 1, sizeof(entry->key));
+	memcpy(entry->answer, answer, answer[0]);
+}
+
+static void device_idle(void) {
+	if (!g_awake) return;
+
+	idle(g_handle);
+	g_awake = false;
+}
+
+/*
+ * Device is woken by the first command that isn't served from cache
+ */
+static int device_wake(void) {
+	if (g_awake && (monotonic_time_us() - g_woken) < WAKE_PERIOD_BUDGET) return ATSHA_ERR_OK;
+
+	device_idle();
+	int status = wake(g_handle);
+	if (status != ATSHA_ERR_OK) return status;
+
+	g_awake = true;
+	g_woken = monotonic_time_us();
+
+	return ATSHA_ERR_OK;
+}
+
+static int device_command(const unsigned char *packet, unsigned char *answer) {
+	bool use_cache = cacheable(packet);
+
+	if (use_cache) {
+		struct cache_entry *entry = cache_find(packet);
+		if (entry != NULL) {
+			memcpy(answer, entry->answer, entry->answer[0]);
+			return ATSHA_ERR_OK;
+		}
+	}
+
+	int status = device_wake();
+	if (status != ATSHA_ERR_OK) return status;
+
+	status = command(g_handle, packet, answer);
+	if (status != ATSHA_ERR_OK) {
+		//Start from clean state
+		device_idle();
+		return status;
+	}
+
+	//Lock changes what is locked; forget everything learned before
+	if (packet[1] == ATSHA204_OPCODE_LOCK) {
+		g_cache_cnt = 0;
+	}
+
+	//Status packets (e.g. errors) aren't cached
+	if (use_cache && answer[0] > ATSHA204_ANSWER_STATUS_LEN) {
+		cache_store(packet, answer);
+	}
+
+	return ATSHA_ERR_OK;
+}
+
+static void client_drop(size_t idx) {
+	close(g_clients[idx].fd);
+
+	if (g_owner == (int)idx) {
+		g_owner = NO_CLIENT;
+		g_released = monotonic_time_us();
+	} else if (g_owner == (int)(g_client_cnt - 1)) {
+		g_owner = idx;
+	}
+
+	g_clients[idx] = g_clients[--g_client_cnt];
+}
+
+static bool client_respond(size_t idx, int status, const unsigned char *answer, unsigned char len) {
+	unsigned char buff[DAEMON_MSG_HEADER_LEN + ATSHA204_IO_BUFFER];
+
+	buff[0] = status;
+	buff[1] = len;
+	if (len > 0) memcpy(buff + DAEMON_MSG_HEADER_LEN, answer, len);
+
+	//Responses are short; client that doesn't read them is dropped
+	ssize_t cnt = send(g_clients[idx].fd, buff, DAEMON_MSG_HEADER_LEN + len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	return cnt == (ssize_t)(DAEMON_MSG_HEADER_LEN + len);
+}
+
+/*
+ * Length of complete frame in client buffer; 0 if it isn't complete yet
+ */
+static size_t frame_len(const struct client *client) {
+	if (client->in_len < DAEMON_MSG_HEADER_LEN) return 0;
+
+	size_t len = DAEMON_MSG_HEADER_LEN + client->in[1];
+	if (client->in_len < len) return 0;
+
+	return len;
+}
+
+/*
+ * Handle one complete frame; false if the client has to be dropped
+ */
+static bool frame_process(size_t idx) {
+	struct client *client = &g_clients[idx];
+	size_t len = frame_len(client);
+	unsigned char type = client->in[0];
+	unsigned char *payload = client->in + DAEMON_MSG_HEADER_LEN;
+	unsigned char payload_len = client->in[1];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	bool ok;
+
+	if (g_owner == NO_CLIENT) g_owner = idx;
+	g_owner_active = monotonic_time_us();
+
+	switch (type) {
+		case DAEMON_MSG_WAKE:
+			ok = client_respond(idx, ATSHA_ERR_OK, NULL, 0);
+			break;
+		case DAEMON_MSG_IDLE:
+			g_owner = NO_CLIENT;
+			g_released = monotonic_time_us();
+			ok = client_respond(idx, ATSHA_ERR_OK, NULL, 0);
+			break;
+		case DAEMON_MSG_COMMAND: {
+			if (payload_len < MIN_PACKET_LEN || payload_len > ATSHA204_IO_BUFFER || payload[0] != payload_len) {
+				log_message("atsha204d: frame_process: Malformed command packet");
+				return false;
+			}
+			int status = device_command(payload, answer);
+			ok = client_respond(idx, status, answer, (status == ATSHA_ERR_OK) ? answer[0] : 0);
+			break;
+		}
+		default:
+			log_message("atsha204d: frame_process: Unknown message type");
+			return false;
+	}
+
+	memmove(client->in, client->in + len, client->in_len - len);
+	client->in_len -= len;
+
+	return ok;
+}
+
+/*
+ * Process buffered frames; owner of transaction goes first, other clients
+ * start their transactions when it ends
+ */
+static void frames_process(void) {
+	bool progress = true;
+
+	while (progress) {
+		progress = false;
+
+		size_t idx;
+		if (g_owner != NO_CLIENT) {
+			idx = g_owner;
+			if (frame_len(&g_clients[idx]) == 0) return;
+		} else {
+			for (idx = 0; idx < g_client_cnt; idx++) {
+				if (frame_len(&g_clients[idx]) > 0) break;
+			}
+			if (idx == g_client_cnt) return;
+		}
+
+		if (frame_process(idx)) {
+			progress = true;
+		} else {
+			client_drop(idx);
+			progress = true;
+		}
+	}
+}
+
+static bool client_read(size_t idx) {
+	struct client *client = &g_clients[idx];
+
+	ssize_t cnt = read(client->fd, client->in + client->in_len, CLIENT_BUFFER - client->in_len);
+	if (cnt == -1 && (errno == EINTR || errno == EAGAIN)) return true;
+	if (cnt <= 0) return false;
+
+	client->in_len += cnt;
+
+	return true;
+}
+
+static void client_accept(int listen_fd) {
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) return;
+
+	if (g_client_cnt >= DAEMON_MAX_CLIENTS) {
+		log_message("atsha204d: client_accept: Too many clients");
+		close(fd);
+		return;
+	}
+
+	g_clients[g_client_cnt].fd = fd;
+	g_clients[g_client_cnt].in_len = 0;
+	g_client_cnt++;
+}
+
+/*
+ * Poll timeout in milliseconds; the device has to be idled and stalled
+ * transaction dropped in time
+ */
+static int poll_timeout(void) {
+	uint64_t now = monotonic_time_us();
+	uint64_t deadline = UINT64_MAX;
+
+	if (g_awake) {
+		deadline = g_woken + WAKE_PERIOD_BUDGET;
+		if (g_owner == NO_CLIENT && g_released + DAEMON_IDLE_DELAY < deadline) deadline = g_released + DAEMON_IDLE_DELAY;
+	}
+	if (g_owner != NO_CLIENT && g_owner_active + DAEMON_TRANSACTION_TOUT < deadline) {
+		deadline = g_owner_active + DAEMON_TRANSACTION_TOUT;
+	}
+
+	if (deadline == UINT64_MAX) return -1;
+	if (deadline <= now) return 0;
+
+	return (deadline - now + 999) / 1000;
+}
+
+static void timers_check(void) {
+	uint64_t now = monotonic_time_us();
+
+	if (g_owner != NO_CLIENT && now - g_owner_active >= DAEMON_TRANSACTION_TOUT) {
+		log_message("atsha204d: timers_check: Client stalled its transaction");
+		client_drop(g_owner);
+	}
+
+	if (g_awake && g_owner == NO_CLIENT && now - g_released >= DAEMON_IDLE_DELAY) {
+		device_idle();
+	}
+	if (g_awake && now - g_woken >= WAKE_PERIOD_BUDGET) {
+		//Watchdog would put the device to sleep and clear its state anyway
+		device_idle();
+	}
+}
+
+static void serve(int listen_fd) {
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+
+	while (!g_terminate) {
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < g_client_cnt; i++) {
+			fds[i + 1].fd = g_clients[i].fd;
+			fds[i + 1].events = (g_clients[i].in_len < CLIENT_BUFFER) ? POLLIN : 0;
+		}
+
+		size_t cnt = g_client_cnt;
+		if (poll(fds, cnt + 1, poll_timeout()) == -1 && errno != EINTR) {
+			log_message("atsha204d: serve: poll failed");
+			return;
+		}
+
+		//Drop from the end; indexes of the rest don't change
+		for (size_t i = cnt; i > 0; i--) {
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !client_read(i - 1)) {
+				client_drop(i - 1);
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			client_accept(listen_fd);
+		}
+
+		//Dropped stalled transaction lets the others continue
+		timers_check();
+		frames_process();
+	}
+}
+
+/*
+ * Socket passed by service manager (socket activation) or our own socket
+ */
+static int listen_socket(const char *path, bool *own) {
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+
+	*own = false;
+	if (pid != NULL && fds != NULL && atoi(pid) == getpid() && atoi(fds) >= 1) {
+		return LISTEN_FDS_START;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_message("atsha204d: listen_socket: Socket path is too long");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		log_message("atsha204d: listen_socket: Couldn't create socket");
+		return -1;
+	}
+
+	unlink(path); //Stale socket of previous instance
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, DAEMON_MAX_CLIENTS) == -1) {
+		log_message("atsha204d: listen_socket: Couldn't bind socket");
+		close(fd);
+		return -1;
+	}
+	chmod(path, 0660);
+	*own = true;
+
+	return fd;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [socket]\n", argv[0]);
+		return 1;
+	}
+	const char *path = (argc == 2) ? argv[1] : DEFAULT_DAEMON_SOCKET;
+
+	//init LIBATSHA204
+	atsha_set_log_callback(log_callback);
+
+	//Device is locked for whole life of the daemon
+	g_handle = atsha_open_device();
+	if (g_handle == NULL) {
+		fprintf(stderr, "Couldn't open device.\n");
+		return 1;
+	}
+
+	cache_setup();
+	//Daemon schedules idle of the device itself
+	idle_timer_stop(g_handle);
+
+	bool own_socket;
+	int listen_fd = listen_socket(path, &own_socket);
+	if (listen_fd == -1) {
+		atsha_close(g_handle);
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	serve(listen_fd);
+
+	while (g_client_cnt > 0) {
+		client_drop(g_client_cnt - 1);
+	}
+	device_idle();
+	close(listen_fd);
+	if (own_socket) unlink(path);
+	atsha_close(g_handle);
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "../libatsha204/atsha204.h"
+#include "../libatsha204/emulation.h"
+
+void log_callback(const char *msg) {
+	fprintf(stderr, "Log: %s\n", msg);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s config-file image-file\n", argv[0]);
+		fprintf(stderr, "Converts configuration file of emulation to binary image that is mapped by atsha_open_emulation()\n");
+		return 1;
+	}
+
+	atsha_set_log_callback(log_callback);
+
+	struct emul_image image;
+	if (emul_image_load(argv[1], &image) != ATSHA_ERR_OK) {
+		fprintf(stderr, "Couldn't load configuration file %s\n", argv[1]);
+		return 2;
+	}
+
+	if (emul_image_store(argv[2], &image) != ATSHA_ERR_OK) {
+		fprintf(stderr, "Couldn't store image file %s\n", argv[2]);
+		return 2;
+	}
+
+	//Check the image the same way as the library opens it
+	const struct emul_image *check;
+	bool mapped;
+	if (emul_image_open(argv[2], &check, &mapped) != ATSHA_ERR_OK || !mapped) {
+		fprintf(stderr, "Stored image file %s is not valid\n", argv[2]);
+		return 2;
+	}
+	emul_image_close(check, mapped);
+
+	return 0;
+}
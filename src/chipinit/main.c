@@ -53,22 +53,8 @@ static bool read_config(FILE *conf, unsigned char *data, size_t line_cnt) {
 			return false;
 		}
 
-		char *line_p = line;
-		char *line_end_p = (line_p + strlen(line_p));
-
-		size_t i = 0;
-		while (i < line_cnt) {
-			if (line_p[0] == ' ' || line_p[0] == '\t' || line_p[0] == ';' || line_p[0] == ',' || line_p[0] == ':') {
-				line_p++;
-				continue;
-			}
-
-			(data+(line_cnt*item))[i++] = get_number_from_hex_char(line_p[0], line_p[1]);
-			line_p += 2;
-
-			if (line_p >= line_end_p) {
-				return false;
-			}
+		if (!hex_decode(line, data + (line_cnt * item), line_cnt, NULL)) {
+			return false;
 		}
 	}
 
@@ -78,7 +64,8 @@ static bool read_config(FILE *conf, unsigned char *data, size_t line_cnt) {
 static bool set_otp_mode(struct atsha_handle *handle, unsigned char *config) {
 	atsha_big_int record;
 
-	if (atsha_raw_conf_read(handle, 0x04, &record) != ATSHA_ERR_OK) return false;
+	record.bytes = BYTESIZE_CNF;
+	memcpy(record.data, (config + (0x04 * BYTESIZE_CNF)), BYTESIZE_CNF);
 	record.data[2] = ATSHA204_CONFIG_OTPMODE_READONLY;
 	if (atsha_raw_conf_write(handle, 0x04, record) != ATSHA_ERR_OK) return false;
 
@@ -91,8 +78,9 @@ static bool set_otp_mode(struct atsha_handle *handle, unsigned char *config) {
 static bool set_slot_config(struct atsha_handle *handle, unsigned char *config) {
 	atsha_big_int record;
 
+	record.bytes = BYTESIZE_CNF;
 	for (unsigned char addr = 0x05; addr <= 0x0C; addr++) {
-		if (atsha_raw_conf_read(handle, addr, &record) != ATSHA_ERR_OK) return false;
+		memcpy(record.data, (config + (addr * BYTESIZE_CNF)), BYTESIZE_CNF);
 		record.data[0] = SLOT_CONFIG_READ;
 		record.data[1] = SLOT_CONFIG_WRITE;
 		record.data[2] = SLOT_CONFIG_READ;
@@ -111,15 +99,8 @@ static bool set_slot_config(struct atsha_handle *handle, unsigned char *config)
 static bool create_and_lock_config(struct atsha_handle *handle) {
 	unsigned char config[CONFIG_CNT*BYTESIZE_CNF];
 	unsigned char crc[2];
-	atsha_big_int record;
 
-	size_t item = 0;
-	record.bytes = BYTESIZE_CNF;
-	for (unsigned char addr = 0x00; addr <= 0x15; addr++) {
-		if (atsha_raw_conf_read(handle, addr, &record) != ATSHA_ERR_OK) return false;
-		memcpy((config + (item * BYTESIZE_CNF)), record.data, record.bytes);
-		item++;
-	}
+	if (atsha_conf_zone_read(handle, config) != ATSHA_ERR_OK) return false;
 
 	if (!set_otp_mode(handle, config)) return false;
 	if (!set_slot_config(handle, config)) return false;
@@ -87,71 +87,45 @@ int main(int argc, char **argv) {
 	printf("\n");
 	if (!cmp_responses(response_i2c, response_emul)) return 1;
 
-	for (unsigned char slot = 0; slot < 16; slot++) {
-		printf("================================================== %02u ==================================================\n", slot);
-		if (atsha_low_challenge_response(handle_i2c, slot, challenge, &response_i2c, true) != ATSHA_ERR_OK) return 1;
-		if (atsha_low_challenge_response(handle_emul, slot, challenge, &response_emul, true) != ATSHA_ERR_OK) return 1;
-
-		printf("HMAC HW: ");
-		for (size_t i = 0; i < response_i2c.bytes; i++) {
-			printf("%02X ", response_i2c.data[i]);
-		}
-		printf("\n");
-
-		printf("HMAC SW: ");
-		for (size_t i = 0; i < response_emul.bytes; i++) {
-			printf("%02X ", response_emul.data[i]);
-		}
-		printf("\n");
-		if (!cmp_responses(response_i2c, response_emul)) return 1;
-
-		if (atsha_low_challenge_response(handle_i2c, slot, challenge, &response_i2c, false) != ATSHA_ERR_OK) return 1;
-		if (atsha_low_challenge_response(handle_emul, slot, challenge, &response_emul, false) != ATSHA_ERR_OK) return 1;
-
-		printf("HMAC HW: ");
-		for (size_t i = 0; i < response_i2c.bytes; i++) {
-			printf("%02X ", response_i2c.data[i]);
-		}
-		printf("\n");
-
-		printf("HMAC SW: ");
-		for (size_t i = 0; i < response_emul.bytes; i++) {
-			printf("%02X ", response_emul.data[i]);
-		}
-		printf("\n");
-		if (!cmp_responses(response_i2c, response_emul)) return 1;
-
-		if (atsha_low_challenge_response_mac(handle_i2c, slot, challenge, &response_i2c, true) != ATSHA_ERR_OK) return 1;
-		if (atsha_low_challenge_response_mac(handle_emul, slot, challenge, &response_emul, true) != ATSHA_ERR_OK) return 1;
-
-		printf("MAC  HW: ");
-		for (size_t i = 0; i < response_i2c.bytes; i++) {
-			printf("%02X ", response_i2c.data[i]);
-		}
-		printf("\n");
+	//All slots and variants are computed in one batch per device
+	static const char *VARIANT_NAMES[] = { "HMAC", "HMAC", "MAC ", "MAC " };
+	size_t variants = sizeof(VARIANT_NAMES) / sizeof(VARIANT_NAMES[0]);
+	atsha_challenge_item items_i2c[16 * variants];
+	atsha_challenge_item items_emul[16 * variants];
 
-		printf("MAC  SW: ");
-		for (size_t i = 0; i < response_emul.bytes; i++) {
-			printf("%02X ", response_emul.data[i]);
+	for (unsigned char slot = 0; slot < 16; slot++) {
+		for (size_t variant = 0; variant < variants; variant++) {
+			atsha_challenge_item *item = &items_i2c[slot * variants + variant];
+			item->slot_number = slot;
+			item->challenge = challenge;
+			item->mode = (variant < 2) ? ATSHA_CHALLENGE_HMAC : ATSHA_CHALLENGE_MAC;
+			item->use_sn_in_digest = ((variant % 2) == 0);
+			items_emul[slot * variants + variant] = *item;
 		}
-		printf("\n");
-		if (!cmp_responses(response_i2c, response_emul)) return 1;
-
-		if (atsha_low_challenge_response_mac(handle_i2c, slot, challenge, &response_i2c, false) != ATSHA_ERR_OK) return 1;
-		if (atsha_low_challenge_response_mac(handle_emul, slot, challenge, &response_emul, false) != ATSHA_ERR_OK) return 1;
+	}
 
-		printf("MAC  HW: ");
-		for (size_t i = 0; i < response_i2c.bytes; i++) {
-			printf("%02X ", response_i2c.data[i]);
-		}
-		printf("\n");
+	if (atsha_challenge_response_batch(handle_i2c, items_i2c, 16 * variants) != ATSHA_ERR_OK) return 1;
+	if (atsha_challenge_response_batch(handle_emul, items_emul, 16 * variants) != ATSHA_ERR_OK) return 1;
 
-		printf("MAC  SW: ");
-		for (size_t i = 0; i < response_emul.bytes; i++) {
-			printf("%02X ", response_emul.data[i]);
+	for (unsigned char slot = 0; slot < 16; slot++) {
+		printf("================================================== %02u ==================================================\n", slot);
+		for (size_t variant = 0; variant < variants; variant++) {
+			atsha_challenge_item *item_i2c = &items_i2c[slot * variants + variant];
+			atsha_challenge_item *item_emul = &items_emul[slot * variants + variant];
+
+			printf("%s HW: ", VARIANT_NAMES[variant]);
+			for (size_t i = 0; i < item_i2c->response.bytes; i++) {
+				printf("%02X ", item_i2c->response.data[i]);
+			}
+			printf("\n");
+
+			printf("%s SW: ", VARIANT_NAMES[variant]);
+			for (size_t i = 0; i < item_emul->response.bytes; i++) {
+				printf("%02X ", item_emul->response.data[i]);
+			}
+			printf("\n");
+			if (!cmp_responses(item_i2c->response, item_emul->response)) return 1;
 		}
-		printf("\n");
-		if (!cmp_responses(response_i2c, response_emul)) return 1;
 	}
 
 	printf("================================================== OTP =================================================\n");
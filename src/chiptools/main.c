@@ -30,19 +30,19 @@ void log_callback(const char *msg) {
 }
 
 static void dump_config(struct atsha_handle *handle) {
-	atsha_big_int data;
+	unsigned char zone[ATSHA_CONFIG_ZONE_SIZE];
 
 	printf("Config zone (0x00 - 0x15):\n");
+	if (atsha_conf_zone_read(handle, zone) != ATSHA_ERR_OK) {
+		printf("ERROR\n\n");
+		return;
+	}
 	for (unsigned char addr = 0x00; addr <= 0x15; addr++) {
 		printf("0x%02X: ", addr);
-		if (atsha_raw_conf_read(handle, addr, &data) == ATSHA_ERR_OK) {
-			for (size_t i = 0; i < data.bytes; i++) {
-				printf("%02X ", data.data[i]);
-			}
-			printf("\n");
-		} else {
-			printf("ERROR\n");
+		for (size_t i = 0; i < 4; i++) {
+			printf("%02X ", zone[addr * 4 + i]);
 		}
+		printf("\n");
 	}
 	printf("\n");
 }
@@ -66,19 +66,19 @@ static void dump_data(struct atsha_handle *handle) {
 }
 
 static void dump_otp(struct atsha_handle *handle) {
-	atsha_big_int data;
+	unsigned char zone[ATSHA_OTP_ZONE_SIZE];
 
 	printf("OTP zone (0x00 - 0x0F):\n");
+	if (atsha_otp_zone_read(handle, zone) != ATSHA_ERR_OK) {
+		printf("ERROR\n\n");
+		return;
+	}
 	for (unsigned char addr = 0x00; addr <= 0x0F; addr++) {
 		printf("0x%02X: ", addr);
-		if (atsha_raw_otp_read(handle, addr, &data) == ATSHA_ERR_OK) {
-			for (size_t i = 0; i < data.bytes; i++) {
-				printf("%02X ", data.data[i]);
-			}
-			printf("\n");
-		} else {
-			printf("ERROR\n");
+		for (size_t i = 0; i < 4; i++) {
+			printf("%02X ", zone[addr * 4 + i]);
 		}
+		printf("\n");
 	}
 	printf("\n");
 }
@@ -20,15 +20,16 @@
 #include <stdlib.h>
 #include <unistd.h> //close()
 #include <fcntl.h>
-#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
-#include <assert.h>
 //#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
+#include <openssl/crypto.h>
 
 #include "configuration.h"
 
@@ -42,78 +43,290 @@
 #include "communication.h"
 #include "tools.h"
 #include "operations.h"
+#include "dnsmagic.h"
+#include "worker.h"
+#include "lock.h"
+#include "layer_daemon.h"
+#include "layer_ni2c.h"
+#include "layer_i2c.h"
+#include "layer_usb.h"
+#include "emulation.h"
 
 /**
  * Global variable with configuration and some initial config values.
+ * Settings could be changed while other threads use the library, so its
+ * fields are accessed atomically.
  */
 atsha_configuration g_config = {
 	.verbose = false,
-	.log_callback = NULL
+	.log_callback = NULL,
+	.lock_per_transaction = false
 };
 
 static const char *WARNING_WAKE_NOT_CONFIRMED = "WARNING: Device is possibly still awake";
 
 void log_message(const char* msg) {
-	if (g_config.log_callback != NULL) {
-		g_config.log_callback(msg);
+	void (*log_callback)(const char* msg) = __atomic_load_n(&g_config.log_callback, __ATOMIC_ACQUIRE);
+	if (log_callback != NULL) {
+		log_callback(msg);
 	}
 }
 
 void atsha_set_verbose() {
-	g_config.verbose = true;
+	__atomic_store_n(&g_config.verbose, true, __ATOMIC_RELEASE);
 }
 
 void atsha_set_log_callback(void (*clb)(const char* msg)) {
-	g_config.log_callback = clb;
+	__atomic_store_n(&g_config.log_callback, clb, __ATOMIC_RELEASE);
+}
+
+void atsha_set_lock_per_transaction() {
+	__atomic_store_n(&g_config.lock_per_transaction, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Deadline of call is per thread; library instance could be used by more
+ * threads at once
+ */
+static __thread uint64_t t_call_deadline;
+static __thread unsigned int t_call_depth;
+
+void call_begin(struct atsha_handle *handle) {
+	if (t_call_depth++ > 0) return;
+
+	t_call_deadline = (handle->timeout > 0) ? monotonic_time_us() + handle->timeout : 0;
+}
+
+void call_end() {
+	if (--t_call_depth > 0) return;
+
+	t_call_deadline = 0;
+}
+
+uint64_t call_time_left(uint64_t limit) {
+	if (t_call_deadline == 0) return limit;
+
+	uint64_t now = monotonic_time_us();
+	if (now >= t_call_deadline) return 0;
+
+	return (t_call_deadline - now < limit) ? t_call_deadline - now : limit;
+}
+
+bool call_expired() {
+	return t_call_deadline != 0 && call_time_left(1) == 0;
 }
 
 /*
- * Try to open or create lockfile
+ * Wait for the device and report contention
  */
-static int atsha_try_lock_file() {
-	int lock;
-	lock = open(LOCK_FILE, O_RDWR | O_CREAT, 0600 /* S_IRUSR | S_IWUSR, but these are not available on OpenWRT */);
-	if (lock == -1) {
-		log_message("api: try_lock: open lock file failed");
+static int atsha_lock(struct device_lock *lock) {
+	char msg[BUFFSIZE_LINE];
+	uint64_t waited;
+
+	if (!lock_acquire(lock, call_time_left(LOCK_TOUT), &waited)) {
+		if (call_expired()) {
+			return ATSHA_ERR_TIMEOUT;
+		}
+		snprintf(msg, BUFFSIZE_LINE, "api: atsha_lock: operation lock failed after %llu ms", (unsigned long long)(waited / 1000));
+		log_message(msg);
+		return ATSHA_ERR_DEVICE_LOCK;
 	}
 
-	return lock;
+	//Make contention visible
+	if (waited > LOCK_WAIT_REPORT || __atomic_load_n(&g_config.verbose, __ATOMIC_ACQUIRE)) {
+		snprintf(msg, BUFFSIZE_LINE, "api: atsha_lock: waited %llu us for the device", (unsigned long long)waited);
+		log_message(msg);
+	}
+
+	return ATSHA_ERR_OK;
 }
 
 /*
- * Attempts periodically to get lock. Time is limited.
- * When the time expires the operation fails.
+ * Open device lock; by default the device is locked until atsha_close()
+ *
+ * Each device has its own lock file named by its bus and slave address.
+ * Bus of device file is identified by its device number, so different
+ * paths to the same bus share the lock. Bus without device file (e.g.
+ * libmpsse) is identified by name.
  */
-static bool atsha_lock(int lockfile) {
-	int lock;
-	double seconds;
-	time_t now;
-	time_t start = time(NULL);
-
-	while (1) {
-		lock = flock(lockfile, LOCK_EX | LOCK_NB);
-		if (lock == -1) {
-			now = time(NULL);
-			seconds = difftime(now, start);
-			if (seconds > LOCK_TRY_MAX) {
-				log_message("api: atsha_lock: operation lock failed");
-				return false;
-			}
-			usleep(LOCK_TRY_TOUT);
-		} else {
-			return true;
+static struct device_lock *atsha_open_lock(const char *dev_path, const char *bus_name, unsigned char address) {
+	char lock_path[BUFFSIZE_LINE];
+	struct stat st;
+
+	if (dev_path != NULL) {
+		if (stat(dev_path, &st) == -1) {
+			log_message("api: open_lock: couldn't stat device file");
+			return NULL;
 		}
+		snprintf(lock_path, BUFFSIZE_LINE, "%s-%u.%u-%02X.lock", LOCK_FILE_PREFIX, major(st.st_rdev), minor(st.st_rdev), address);
+	} else {
+		snprintf(lock_path, BUFFSIZE_LINE, "%s-%s-%02X.lock", LOCK_FILE_PREFIX, bus_name, address);
+	}
+
+	struct device_lock *lock = lock_open(lock_path);
+	if (lock == NULL) {
+		return NULL;
+	}
+
+	if (!__atomic_load_n(&g_config.lock_per_transaction, __ATOMIC_ACQUIRE) && atsha_lock(lock) != ATSHA_ERR_OK) {
+		lock_close(lock);
+		return NULL;
+	}
+
+	return lock;
+}
+
+int transaction_lock(struct atsha_handle *handle) {
+	if (!handle->lock_per_transaction || handle->lock == NULL || lock_held(handle->lock)) {
+		return ATSHA_ERR_OK;
+	}
+
+	return atsha_lock(handle->lock);
+}
+
+/*
+ * Key of the device in profile file of execution times; NULL if its bottom layer doesn't poll for answers
+ */
+static const char *timing_device(struct atsha_handle *handle) {
+	if (handle->bottom_layer != BOTTOM_LAYER_NI2C && handle->bottom_layer != BOTTOM_LAYER_I2C) return NULL;
+
+	return (handle->dev_path != NULL) ? handle->dev_path : "mpsse";
+}
+
+/*
+ * Mutex of library instance serializes communication of threads.
+ * It is recursive - public functions call each other.
+ */
+static void bus_init(struct atsha_handle *handle) {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&handle->bus_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	handle->bus_depth = 0;
+	handle->worker = NULL;
+	//Mode follows the lock taken in open; the setting could change since then
+	if (handle->lock != NULL) {
+		handle->lock_per_transaction = !lock_held(handle->lock);
+	} else {
+		handle->lock_per_transaction = __atomic_load_n(&g_config.lock_per_transaction, __ATOMIC_ACQUIRE);
+	}
+
+	handle->retry.retries = TRY_SEND_RECV_ON_COMM_ERROR;
+	handle->retry.backoff = (handle->transport->backoff != 0) ? handle->transport->backoff : ATSHA204_I2C_CMD_TOUT;
+	handle->retry.backoff_max = handle->retry.backoff;
+	handle->timeout = 0;
+
+	if (timing_device(handle) != NULL) {
+		timing_load(&handle->timing, timing_device(handle));
+	}
+}
+
+int bus_lock(struct atsha_handle *handle) {
+	call_begin(handle);
+
+	int ret;
+	uint64_t left = call_time_left(UINT64_MAX);
+	if (left == UINT64_MAX) {
+		ret = pthread_mutex_lock(&handle->bus_mutex);
+	} else {
+		struct timespec deadline;
+		realtime_deadline(left, &deadline);
+		ret = pthread_mutex_timedlock(&handle->bus_mutex, &deadline);
+	}
+	if (ret != 0) {
+		log_message("api: bus_lock: Instance is used by other thread until deadline of the call");
+		call_end();
+		return ATSHA_ERR_TIMEOUT;
+	}
+
+	handle->bus_depth++;
+	return ATSHA_ERR_OK;
+}
+
+void bus_unlock(struct atsha_handle *handle) {
+	handle->bus_depth--;
+	if (handle->bus_depth == 0 && handle->lock_per_transaction && handle->lock != NULL) {
+		//Failed operation could leave the device awake
+		if (handle->awake) idle(handle);
+		lock_release(handle->lock);
 	}
+	pthread_mutex_unlock(&handle->bus_mutex);
+	call_end();
+}
+
+void atsha_set_retry_policy(struct atsha_handle *handle, const atsha_retry_policy *policy) {
+	pthread_mutex_lock(&handle->bus_mutex);
+	handle->retry = *policy;
+	pthread_mutex_unlock(&handle->bus_mutex);
+}
 
-	return true;
+void atsha_set_timeout(struct atsha_handle *handle, uint64_t timeout) {
+	pthread_mutex_lock(&handle->bus_mutex);
+	handle->timeout = timeout;
+	pthread_mutex_unlock(&handle->bus_mutex);
 }
 
-static void atsha_unlock(int lockfile) {
-	//Return value of flock is not important - OS release it anyway
-	flock(lockfile, LOCK_UN);
+void atsha_set_emulation_packets(struct atsha_handle *handle, bool enabled) {
+	pthread_mutex_lock(&handle->bus_mutex);
+	handle->emul_packets = enabled;
+	pthread_mutex_unlock(&handle->bus_mutex);
+}
+
+/*
+ * Connect to daemon; quiet version is used for detection of running daemon
+ */
+static struct atsha_handle *open_daemon(const char *path, bool quiet) {
+	if (path == NULL) return NULL;
+
+	int try_fd = daemon_connect(path, quiet);
+	if (try_fd == -1) {
+		return NULL;
+	}
+
+	struct atsha_handle *handle = (struct atsha_handle *)calloc(1, sizeof(struct atsha_handle));
+	if (handle == NULL) {
+		close(try_fd);
+		return NULL;
+	}
+
+	handle->bottom_layer = BOTTOM_LAYER_DAEMON;
+	handle->transport = &TRANSPORT_DAEMON;
+	handle->transport_ctx = handle;
+	handle->is_srv_emulation = false;
+	handle->fd = try_fd;
+	handle->daemon_pending = 0;
+	handle->image = NULL;
+	handle->lock = NULL; //Daemon holds the device lock
+	handle->i2c = NULL;
+	handle->sn = NULL;
+	handle->key = NULL;
+	handle->key_origin = 0;
+	handle->key_origin_cached = false;
+	handle->dns_cache = NULL;
+	handle->slot_id = 0;
+	handle->dev_path = strdup(path);
+	handle->zones_state = ZONES_NOT_READ;
+	bus_init(handle);
+
+	dns_ctx_acquire();
+
+	return handle;
 }
 
 struct atsha_handle *atsha_open() {
+	//Transport could be chosen at run time
+	const char *spec = getenv(TRANSPORT_ENV);
+	if (spec != NULL && spec[0] != '\0') return atsha_open_spec(spec);
+
+	//Daemon owns the device when it runs
+	struct atsha_handle *handle = open_daemon(DEFAULT_DAEMON_SOCKET, true);
+	if (handle != NULL) return handle;
+
+	return atsha_open_device();
+}
+
+struct atsha_handle *atsha_open_device() {
 	struct atsha_handle *handle;
 
 #if USE_LAYER == USE_LAYER_USB
@@ -132,22 +345,84 @@ struct atsha_handle *atsha_open() {
 	return handle;
 }
 
-struct atsha_handle *atsha_open_usb_dev(const char *path) {
-	if (path == NULL) return NULL;
+static bool spec_name(const char *spec, size_t len, const char *name) {
+	return len == strlen(name) && strncmp(spec, name, len) == 0;
+}
 
-	int try_lockfile = atsha_try_lock_file();
-	if (try_lockfile == -1) {
+struct atsha_handle *atsha_open_spec(const char *spec) {
+	if (spec == NULL) return NULL;
+
+	//Name of transport is optionally followed by ":path"
+	const char *path = strchr(spec, ':');
+	size_t len = (path != NULL) ? (size_t)(path - spec) : strlen(spec);
+	if (path != NULL) path++;
+
+	if (spec_name(spec, len, "daemon")) {
+		return open_daemon((path != NULL) ? path : DEFAULT_DAEMON_SOCKET, false);
+	} else if (spec_name(spec, len, "ni2c")) {
+		return atsha_open_ni2c_dev((path != NULL) ? path : DEFAULT_NI2C_DEV_PATH);
+	} else if (spec_name(spec, len, "usb")) {
+		return atsha_open_usb_dev((path != NULL) ? path : DEFAULT_USB_DEV_PATH);
+	} else if (spec_name(spec, len, "i2c")) {
+#if USE_LAYER == USE_LAYER_I2C
+		return atsha_open_i2c_dev();
+#else
+		log_message("api: open_spec: I2C transport isn't compiled in");
 		return NULL;
+#endif
+	} else if (spec_name(spec, len, "emulation")) {
+		return atsha_open_emulation((path != NULL) ? path : DEFAULT_EMULATION_CONFIG_PATH);
 	}
 
-	if (!atsha_lock(try_lockfile)) {
-		close(try_lockfile);
+	log_message("api: open_spec: Unknown transport");
+	return NULL;
+}
+
+struct atsha_handle *atsha_open_transport(const atsha_transport *transport, void *ctx) {
+	if (transport == NULL || transport->wake == NULL || transport->idle == NULL || transport->command == NULL) return NULL;
+
+	struct atsha_handle *handle = (struct atsha_handle *)calloc(1, sizeof(struct atsha_handle));
+	if (handle == NULL) return NULL;
+
+	handle->bottom_layer = BOTTOM_LAYER_CUSTOM;
+	handle->transport = transport;
+	handle->transport_ctx = ctx;
+	handle->is_srv_emulation = false;
+	handle->fd = -1;
+	handle->image = NULL;
+	handle->lock = NULL; //Transport is responsible for sharing of the device
+	handle->i2c = NULL;
+	handle->sn = NULL;
+	handle->key = NULL;
+	handle->key_origin = 0;
+	handle->key_origin_cached = false;
+	handle->dns_cache = NULL;
+	handle->slot_id = 0;
+	handle->dev_path = NULL;
+	handle->zones_state = ZONES_NOT_READ;
+	bus_init(handle);
+
+	dns_ctx_acquire();
+
+	return handle;
+}
+
+struct atsha_handle *atsha_open_daemon(const char *path) {
+	return open_daemon(path, false);
+}
+
+struct atsha_handle *atsha_open_usb_dev(const char *path) {
+	if (path == NULL) return NULL;
+
+	struct device_lock *try_lock = atsha_open_lock(path, NULL, 0);
+	if (try_lock == NULL) {
 		return NULL;
 	}
 
 	int try_fd = open(path, O_RDWR);
 	if (try_fd == -1) {
 		log_message("api: open_usb_dev: Couldn't open usb device.");
+		lock_close(try_lock);
 		return NULL;
 	}
 
@@ -155,39 +430,45 @@ struct atsha_handle *atsha_open_usb_dev(const char *path) {
 	if (handle == NULL) return NULL;
 
 	handle->bottom_layer = BOTTOM_LAYER_USB;
+	handle->transport = &TRANSPORT_USB;
+	handle->transport_ctx = handle;
 	handle->is_srv_emulation = false;
 	handle->fd = try_fd;
-	handle->file = NULL;
-	handle->lockfile = try_lockfile;
+	handle->image = NULL;
+	handle->lock = try_lock;
 	handle->i2c = NULL;
 	handle->sn = NULL;
 	handle->key = NULL;
 	handle->key_origin = 0;
 	handle->key_origin_cached = false;
+	handle->dns_cache = NULL;
 	handle->slot_id = 0;
+	handle->dev_path = strdup(path);
+	handle->zones_state = ZONES_NOT_READ;
+	bus_init(handle);
+
+	dns_ctx_acquire();
 
 	return handle;
 }
 
 struct atsha_handle *atsha_open_ni2c_dev(const char *path) {
-	int try_lockfile = atsha_try_lock_file();
-	if (try_lockfile == -1) {
-		return NULL;
-	}
-
-	if (!atsha_lock(try_lockfile)) {
-		close(try_lockfile);
+	struct device_lock *try_lock = atsha_open_lock(path, NULL, ATSHA204_NI2C_ADDRESS);
+	if (try_lock == NULL) {
 		return NULL;
 	}
 
 	int try_fd = open(path, O_RDWR);
 	if (try_fd == -1) {
 		log_message("api: open_ni2c_dev: Couldn't open native I2C device.");
+		lock_close(try_lock);
 		return NULL;
 	}
 
 	if (ioctl(try_fd, I2C_SLAVE, ATSHA204_NI2C_ADDRESS) < 0) {
 		log_message("api: open_ni2c_dev: Couldn't bind address.");
+		close(try_fd);
+		lock_close(try_lock);
 		return NULL;
 	}
 
@@ -195,49 +476,63 @@ struct atsha_handle *atsha_open_ni2c_dev(const char *path) {
 	if (handle == NULL) return NULL;
 
 	handle->bottom_layer = BOTTOM_LAYER_NI2C;
+	handle->transport = &TRANSPORT_NI2C;
+	handle->transport_ctx = handle;
 	handle->is_srv_emulation = false;
 	handle->fd = try_fd;
-	handle->file = NULL;
-	handle->lockfile = try_lockfile;
+	handle->image = NULL;
+	handle->lock = try_lock;
 	handle->i2c = NULL;
 	handle->sn = NULL;
 	handle->key = NULL;
 	handle->key_origin = 0;
 	handle->key_origin_cached = false;
+	handle->dns_cache = NULL;
 	handle->slot_id = 0;
+	handle->dev_path = strdup(path);
+	handle->zones_state = ZONES_NOT_READ;
+	bus_init(handle);
+
+	dns_ctx_acquire();
 
 	return handle;
 }
 
 #if USE_LAYER == USE_LAYER_I2C
 struct atsha_handle *atsha_open_i2c_dev() {
-	int try_lockfile = atsha_try_lock_file();
-	if (try_lockfile == -1) {
+	struct device_lock *try_lock = atsha_open_lock(NULL, "mpsse", ATSHA204_I2C_ADDRESS);
+	if (try_lock == NULL) {
 		return NULL;
 	}
 
-	if (!atsha_lock(try_lockfile)) {
-		close(try_lockfile);
+	struct mpsse_context *try_i2c = MPSSE(I2C, FOUR_HUNDRED_KHZ, MSB); //# Initialize libmpsse for I2C operations at 400kHz
+	if (try_i2c == NULL) {
+		lock_close(try_lock);
 		return NULL;
 	}
-
-	struct mpsse_context *try_i2c = MPSSE(I2C, FOUR_HUNDRED_KHZ, MSB); //# Initialize libmpsse for I2C operations at 400kHz
-	if (try_i2c == NULL) return NULL;
 	SendAcks(try_i2c);
 
 	struct atsha_handle *handle = (struct atsha_handle *)calloc(1, sizeof(struct atsha_handle));
 	if (handle == NULL) return NULL;
 
 	handle->bottom_layer = BOTTOM_LAYER_I2C;
+	handle->transport = &TRANSPORT_I2C;
+	handle->transport_ctx = handle;
 	handle->is_srv_emulation = false;
-	handle->file = NULL;
-	handle->lockfile = try_lockfile;
+	handle->image = NULL;
+	handle->lock = try_lock;
 	handle->i2c = try_i2c;
 	handle->sn = NULL;
 	handle->key = NULL;
 	handle->key_origin = 0;
 	handle->key_origin_cached = false;
+	handle->dns_cache = NULL;
 	handle->slot_id = 0;
+	handle->dev_path = NULL;
+	handle->zones_state = ZONES_NOT_READ;
+	bus_init(handle);
+
+	dns_ctx_acquire();
 
 	return handle;
 }
@@ -246,25 +541,39 @@ struct atsha_handle *atsha_open_i2c_dev() {
 struct atsha_handle *atsha_open_emulation(const char *path) {
 	if (path == NULL) return NULL;
 
-	FILE *try_file = fopen(path, "r");
-	if (try_file == NULL) {
-		log_message("api: open_emulation: Couldn't open configuration file.");
+	//Configuration is parsed (or binary image mapped) once; operations are served from memory
+	const struct emul_image *try_image;
+	bool mapped;
+	if (emul_image_open(path, &try_image, &mapped) != ATSHA_ERR_OK) {
+		log_message("api: open_emulation: Couldn't load configuration file.");
 		return NULL;
 	}
 
 	struct atsha_handle *handle = (struct atsha_handle *)calloc(1, sizeof(struct atsha_handle));
-	if (handle == NULL) return NULL;
+	if (handle == NULL) {
+		emul_image_close(try_image, mapped);
+		return NULL;
+	}
 
 	handle->bottom_layer = BOTTOM_LAYER_EMULATION;
+	handle->transport = &TRANSPORT_EMULATION;
+	handle->transport_ctx = handle;
 	handle->is_srv_emulation = false;
-	handle->file = try_file;
-	handle->lockfile = -1;
+	handle->image = try_image;
+	handle->image_mapped = mapped;
+	handle->lock = NULL;
 	handle->i2c = NULL;
 	handle->sn = NULL;
 	handle->key = NULL;
 	handle->key_origin = 0;
 	handle->key_origin_cached = false;
+	handle->dns_cache = NULL;
 	handle->slot_id = 0;
+	handle->dev_path = NULL;
+	handle->zones_state = ZONES_NOT_READ;
+	bus_init(handle);
+
+	dns_ctx_acquire();
 
 	atsha_big_int number;
 	if (atsha_serial_number(handle, &number) != ATSHA_ERR_OK) {
@@ -300,13 +609,19 @@ struct atsha_handle *atsha_open_server_emulation(unsigned char slot_id, const un
 	if (handle == NULL) return NULL;
 
 	handle->bottom_layer = BOTTOM_LAYER_EMULATION;
+	handle->transport = &TRANSPORT_EMULATION;
+	handle->transport_ctx = handle;
 	handle->is_srv_emulation = true;
-	handle->file = NULL;
-	handle->lockfile = -1;
+	handle->image = NULL;
+	handle->lock = NULL;
 	handle->i2c = NULL;
 	handle->key_origin = 0;
 	handle->key_origin_cached = false;
+	handle->dns_cache = NULL;
 	handle->slot_id = slot_id;
+	handle->dev_path = NULL;
+	handle->zones_state = ZONES_NOT_READ;
+	bus_init(handle);
 
 	if (USE_OUR_SN) {
 		handle->sn = (unsigned char *)calloc(2*ATSHA204_OTP_BYTE_LEN, sizeof(unsigned char));
@@ -324,121 +639,143 @@ struct atsha_handle *atsha_open_server_emulation(unsigned char slot_id, const un
 	}
 	memcpy(handle->key, key, ATSHA204_SLOT_BYTE_LEN);
 
+	dns_ctx_acquire();
+
 	return handle;
 }
 
 void atsha_close(struct atsha_handle *handle) {
 	if (handle == NULL) return;
 
-	if (handle->bottom_layer == BOTTOM_LAYER_USB || handle->bottom_layer == BOTTOM_LAYER_NI2C) {
-		close(handle->fd);
-	}
+	//Finish queued requests before the device is closed
+	worker_stop(handle->worker);
+	idle_timer_stop(handle);
 
-	if (handle->file != NULL) {
-		fclose(handle->file);
+	if (timing_device(handle) != NULL) {
+		timing_store(&handle->timing, timing_device(handle));
 	}
 
-	if (handle->i2c != NULL) {
-#if USE_LAYER == USE_LAYER_I2C
-		Close(handle->i2c); //Deinitialize libmpsse
-#else
-		assert(0); // I2C not compiled in!
-#endif
+	if (handle->transport->close != NULL) {
+		handle->transport->close(handle->transport_ctx);
 	}
 
-	if (handle->lockfile != -1) {
-		atsha_unlock(handle->lockfile);
-		close(handle->lockfile);
-	}
+	lock_close(handle->lock);
+
+	dns_ctx_release();
 
 	free(handle->sn);
 	free(handle->key);
+	free(handle->dev_path);
+	free(handle->dns_cache);
+
+	pthread_mutex_destroy(&handle->bus_mutex);
 
 	free(handle);
 }
 
-int atsha_dev_rev(struct atsha_handle *handle, uint32_t *revision) {
+static int dev_rev_nolock(struct atsha_handle *handle, uint32_t *revision) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
 	packet = op_dev_rev();
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
 	*revision = op_dev_rev_recv(answer);
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
-int atsha_random(struct atsha_handle *handle, atsha_big_int *number) {
+int atsha_dev_rev(struct atsha_handle *handle, uint32_t *revision) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = dev_rev_nolock(handle, revision);
+	bus_unlock(handle);
+
+	return status;
+}
+
+static int random_nolock(struct atsha_handle *handle, atsha_big_int *number) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
 	packet = op_random();
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
 	number->bytes = op_random_recv(answer, number->data);
 	if (number->bytes == 0) {
-		free(packet);
-		free(answer);
 		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
+int atsha_random(struct atsha_handle *handle, atsha_big_int *number) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = random_nolock(handle, number);
+	bus_unlock(handle);
+
+	return status;
+}
+
+/*
+ * Slot number of actual key; DNS failure caused by deadline is reported as timeout
+ */
+static int key_slot_number(struct atsha_handle *handle, unsigned char *slot_number) {
+	*slot_number = atsha_find_slot_number(handle);
+	if (*slot_number != DNS_ERR_CONST) return ATSHA_ERR_OK;
+
+	return call_expired() ? ATSHA_ERR_TIMEOUT : ATSHA_ERR_DNS_GET_KEY;
+}
+
 int atsha_slot_read(struct atsha_handle *handle, atsha_big_int *number) {
-	unsigned char slot_number = atsha_find_slot_number(handle);
-	if (slot_number == DNS_ERR_CONST) return ATSHA_ERR_DNS_GET_KEY;
+	unsigned char slot_number;
+
+	call_begin(handle);
+	int status = key_slot_number(handle, &slot_number);
+	if (status == ATSHA_ERR_OK) {
+		status = atsha_raw_slot_read(handle, slot_number, number);
+	}
+	call_end();
 
-	return atsha_raw_slot_read(handle, slot_number, number);
+	return status;
 }
 
-int atsha_raw_slot_read(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int *number) {
+static int raw_slot_read_nolock(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int *number) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
 
 	if (slot_number > ATSHA204_MAX_SLOT_NUMBER) {
 		log_message("api: low_slot_read: requested slot number is bigger than max slot number");
@@ -449,63 +786,72 @@ int atsha_raw_slot_read(struct atsha_handle *handle, unsigned char slot_number,
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	packet = op_raw_read(get_zone_config(IO_MEM_DATA, IO_RW_NON_ENC, IO_RW_32_BYTES), get_slot_address(slot_number));
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_raw_read(buffer, get_zone_config(IO_MEM_DATA, IO_RW_NON_ENC, IO_RW_32_BYTES), get_slot_address(slot_number));
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
 	number->bytes = op_raw_read_recv(answer, number->data);
 	if (number->bytes == 0) {
-		free(packet);
-		free(answer);
 		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
+int atsha_raw_slot_read(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int *number) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = raw_slot_read_nolock(handle, slot_number, number);
+	bus_unlock(handle);
+
+	return status;
+}
+
 int atsha_slot_write(struct atsha_handle *handle, atsha_big_int number) {
-	unsigned char slot_number = atsha_find_slot_number(handle);
-	if (slot_number == DNS_ERR_CONST) return ATSHA_ERR_DNS_GET_KEY;
+	unsigned char slot_number;
+
+	call_begin(handle);
+	int status = key_slot_number(handle, &slot_number);
+	if (status == ATSHA_ERR_OK) {
+		status = atsha_raw_slot_write(handle, slot_number, number);
+	}
+	call_end();
 
-	return atsha_raw_slot_write(handle, slot_number, number);
+	return status;
 }
 
-int atsha_raw_slot_write(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int number) {
+static int raw_slot_write_nolock(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int number) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
 
 	if (slot_number > ATSHA204_MAX_SLOT_NUMBER) {
 		log_message("api: low_slot_write: requested slot number is bigger than max slot number");
 		return ATSHA_ERR_INVALID_INPUT;
 	}
+	if (number.bytes > ATSHA_MAX_DATA_SIZE) {
+		log_message("api: low_slot_write: data are bigger than max data size");
+		return ATSHA_ERR_INVALID_INPUT;
+	}
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	packet = op_raw_write(get_zone_config(IO_MEM_DATA, IO_RW_NON_ENC, IO_RW_32_BYTES), get_slot_address(slot_number), number.bytes, number.data);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_raw_write(buffer, get_zone_config(IO_MEM_DATA, IO_RW_NON_ENC, IO_RW_32_BYTES), get_slot_address(slot_number), number.bytes, number.data);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
@@ -514,52 +860,63 @@ int atsha_raw_slot_write(struct atsha_handle *handle, unsigned char slot_number,
 		return status;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
-int atsha_challenge_response(struct atsha_handle *handle, atsha_big_int challenge, atsha_big_int *response) {
-	unsigned char slot_number = atsha_find_slot_number(handle);
-	if (slot_number == DNS_ERR_CONST) return ATSHA_ERR_DNS_GET_KEY;
+int atsha_raw_slot_write(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int number) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = raw_slot_write_nolock(handle, slot_number, number);
+	bus_unlock(handle);
 
-	return atsha_low_challenge_response(handle, slot_number, challenge, response, DEFAULT_USE_SN_IN_DIGEST);
+	return status;
 }
 
-int atsha_low_challenge_response(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest) {
+/*
+ * Caller of worker waits for its items until deadline of the call
+ */
+static int worker_submit_call(struct atsha_handle *handle, atsha_challenge_item *items, size_t count) {
+	call_begin(handle);
+	int status = worker_submit(handle->worker, items, count, call_time_left(UINT64_MAX));
+	call_end();
+
+	return status;
+}
+
+/*
+ * Emulation computes digests directly from the device image unless packets are requested
+ */
+static bool emul_direct(const struct atsha_handle *handle) {
+	return handle->bottom_layer == BOTTOM_LAYER_EMULATION && !handle->emul_packets;
+}
+
+/*
+ * Commands of HMAC challenge-response without wake and idle
+ */
+static int challenge_response_hmac(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
 
-	if (slot_number > ATSHA204_MAX_SLOT_NUMBER) {
-		log_message("api: low_challenge_response: requested slot number is bigger than max slot number");
-		return ATSHA_ERR_INVALID_INPUT;
-	}
-	if (challenge.bytes != 32) {
-		log_message("api: low_challenge_response: challnege is bigger than 32 bytes");
-		return ATSHA_ERR_INVALID_INPUT;
+	if (emul_direct(handle)) {
+		status = emul_challenge_response(handle, slot_number, challenge.data, use_sn_in_digest, response->data);
+		response->bytes = (status == ATSHA_ERR_OK) ? ATSHA204_SLOT_BYTE_LEN : 0;
+		return status;
 	}
 
-	//Wakeup device
-	status = wake(handle);
-	if (status != ATSHA_ERR_OK) return status;
-
 	//Store Challenge to TempKey memory
 	////////////////////////////////////////////////////////////////////
-	packet = op_nonce(challenge.bytes, challenge.data);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_nonce(buffer, challenge.bytes, challenge.data);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
@@ -568,61 +925,94 @@ int atsha_low_challenge_response(struct atsha_handle *handle, unsigned char slot
 		return status;
 	}
 
-	//Clean and reinit
-	free(packet);
-	free(answer);
-	answer = NULL;
-
 	//Get HMAC digest
 	////////////////////////////////////////////////////////////////////
-	packet = op_hmac(slot_number, use_sn_in_digest);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_hmac(buffer, slot_number, use_sn_in_digest);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
 	response->bytes = op_hmac_recv(answer, response->data);
 	if (response->bytes == 0) {
-		free(packet);
-		free(answer);
 		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	return ATSHA_ERR_OK;
+}
+
+/*
+ * Commands of MAC challenge-response without wake and idle
+ */
+static int challenge_response_mac(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest) {
+	int status;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+
+	if (emul_direct(handle)) {
+		status = emul_challenge_response_mac(handle, slot_number, challenge.data, use_sn_in_digest, response->data);
+		response->bytes = (status == ATSHA_ERR_OK) ? ATSHA204_SLOT_BYTE_LEN : 0;
+		return status;
+	}
+
+	packet = op_mac(buffer, slot_number, challenge.bytes, challenge.data, use_sn_in_digest);
+
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		log_message(WARNING_WAKE_NOT_CONFIRMED);
+		return status;
 	}
 
-	free(packet);
-	free(answer);
+	response->bytes = op_mac_recv(answer, response->data);
+	if (response->bytes == 0) {
+		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	}
 
 	return ATSHA_ERR_OK;
 }
 
-int atsha_challenge_response_mac(struct atsha_handle *handle, atsha_big_int challenge, atsha_big_int *response) {
-	unsigned char slot_number = atsha_find_slot_number(handle);
-	if (slot_number == DNS_ERR_CONST) return ATSHA_ERR_DNS_GET_KEY;
+/*
+ * Worst case time of one challenge-response item in microseconds
+ */
+static unsigned int challenge_response_max_time(unsigned char mode) {
+	unsigned int typical, max, total = 0;
+
+	if (mode == ATSHA_CHALLENGE_MAC) {
+		op_exec_time(ATSHA204_OPCODE_MAC, &typical, &max);
+		total += max;
+	} else {
+		op_exec_time(ATSHA204_OPCODE_NONCE, &typical, &max);
+		total += max;
+		op_exec_time(ATSHA204_OPCODE_HMAC, &typical, &max);
+		total += max;
+	}
 
-	return atsha_low_challenge_response_mac(handle, slot_number, challenge, response, DEFAULT_USE_SN_IN_DIGEST);
+	return total;
 }
 
-int atsha_low_challenge_response_mac(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest) {
+int atsha_challenge_response(struct atsha_handle *handle, atsha_big_int challenge, atsha_big_int *response) {
+	unsigned char slot_number;
+
+	call_begin(handle);
+	int status = key_slot_number(handle, &slot_number);
+	if (status == ATSHA_ERR_OK) {
+		status = atsha_low_challenge_response(handle, slot_number, challenge, response, DEFAULT_USE_SN_IN_DIGEST);
+	}
+	call_end();
+
+	return status;
+}
+
+static int low_challenge_response_nolock(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
 
 	if (slot_number > ATSHA204_MAX_SLOT_NUMBER) {
-		log_message("api: low_challenge_response_mac: requested slot number is bigger than max slot number");
+		log_message("api: low_challenge_response: requested slot number is bigger than max slot number");
 		return ATSHA_ERR_INVALID_INPUT;
 	}
-
 	if (challenge.bytes != 32) {
-		log_message("api: low_challenge_response_max: challenge is bigger than 32 bytes");
+		log_message("api: low_challenge_response: challnege is bigger than 32 bytes");
 		return ATSHA_ERR_INVALID_INPUT;
 	}
 
@@ -630,75 +1020,379 @@ int atsha_low_challenge_response_mac(struct atsha_handle *handle, unsigned char
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	//Store Challenge to TempKey memory
-	////////////////////////////////////////////////////////////////////
-	packet = op_mac(slot_number, challenge.bytes, challenge.data, use_sn_in_digest);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
-
-	status = command(handle, packet, &answer);
+	status = challenge_response_hmac(handle, slot_number, challenge, response, use_sn_in_digest);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
-	response->bytes = op_mac_recv(answer, response->data);
-	if (response->bytes == 0) {
-		free(packet);
-		free(answer);
-		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
-	}
-
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
-int atsha_chip_serial_number(struct atsha_handle *handle, atsha_big_int *number) {
-	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
-
+int atsha_low_challenge_response(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest) {
+	if (handle->worker != NULL) {
+		atsha_challenge_item item = {
+			.slot_number = slot_number,
+			.challenge = challenge,
+			.mode = ATSHA_CHALLENGE_HMAC,
+			.use_sn_in_digest = use_sn_in_digest
+		};
+
+		int status = worker_submit_call(handle, &item, 1);
+		if (status == ATSHA_ERR_OK) {
+			*response = item.response;
+		}
+
+		return status;
+	}
+
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = low_challenge_response_nolock(handle, slot_number, challenge, response, use_sn_in_digest);
+	bus_unlock(handle);
+
+	return status;
+}
+
+int atsha_challenge_response_mac(struct atsha_handle *handle, atsha_big_int challenge, atsha_big_int *response) {
+	unsigned char slot_number;
+
+	call_begin(handle);
+	int status = key_slot_number(handle, &slot_number);
+	if (status == ATSHA_ERR_OK) {
+		status = atsha_low_challenge_response_mac(handle, slot_number, challenge, response, DEFAULT_USE_SN_IN_DIGEST);
+	}
+	call_end();
+
+	return status;
+}
+
+static int low_challenge_response_mac_nolock(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest) {
+	int status;
+
+	if (slot_number > ATSHA204_MAX_SLOT_NUMBER) {
+		log_message("api: low_challenge_response_mac: requested slot number is bigger than max slot number");
+		return ATSHA_ERR_INVALID_INPUT;
+	}
+
+	if (challenge.bytes != 32) {
+		log_message("api: low_challenge_response_max: challenge is bigger than 32 bytes");
+		return ATSHA_ERR_INVALID_INPUT;
+	}
+
+	//Wakeup device
+	status = wake(handle);
+	if (status != ATSHA_ERR_OK) return status;
+
+	status = challenge_response_mac(handle, slot_number, challenge, response, use_sn_in_digest);
+	if (status != ATSHA_ERR_OK) {
+		return status;
+	}
+
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
+	if (status != ATSHA_ERR_OK) {
+		log_message(WARNING_WAKE_NOT_CONFIRMED);
+	}
+
+	return ATSHA_ERR_OK;
+}
+
+int atsha_low_challenge_response_mac(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest) {
+	if (handle->worker != NULL) {
+		atsha_challenge_item item = {
+			.slot_number = slot_number,
+			.challenge = challenge,
+			.mode = ATSHA_CHALLENGE_MAC,
+			.use_sn_in_digest = use_sn_in_digest
+		};
+
+		int status = worker_submit_call(handle, &item, 1);
+		if (status == ATSHA_ERR_OK) {
+			*response = item.response;
+		}
+
+		return status;
+	}
+
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = low_challenge_response_mac_nolock(handle, slot_number, challenge, response, use_sn_in_digest);
+	bus_unlock(handle);
+
+	return status;
+}
+
+int atsha_server_response(unsigned char slot_id, const unsigned char *serial_number, const unsigned char *key, const unsigned char *challenge, unsigned char mode, bool use_sn_in_digest, unsigned char *response) {
+	if (serial_number == NULL || key == NULL || challenge == NULL || response == NULL) return ATSHA_ERR_INVALID_INPUT;
+
+	if (slot_id > ATSHA204_MAX_SLOT_NUMBER) {
+		log_message("api: server_response: requested slot number is bigger than max slot number");
+		return ATSHA_ERR_INVALID_INPUT;
+	}
+	if (mode != ATSHA_CHALLENGE_HMAC && mode != ATSHA_CHALLENGE_MAC) {
+		log_message("api: server_response: unknown mode of challenge-response");
+		return ATSHA_ERR_INVALID_INPUT;
+	}
+
+	return emul_response(key, serial_number, slot_id, challenge, mode, use_sn_in_digest, response);
+}
+
+int atsha_server_verify(unsigned char slot_id, const unsigned char *serial_number, const unsigned char *key, const unsigned char *challenge, unsigned char mode, bool use_sn_in_digest, const unsigned char *response) {
+	unsigned char expected[ATSHA204_SLOT_BYTE_LEN];
+
+	if (response == NULL) return ATSHA_ERR_INVALID_INPUT;
+
+	int status = atsha_server_response(slot_id, serial_number, key, challenge, mode, use_sn_in_digest, expected);
+	if (status != ATSHA_ERR_OK) return status;
+
+	//Comparison time mustn't depend on position of the first difference
+	status = (CRYPTO_memcmp(expected, response, ATSHA204_SLOT_BYTE_LEN) == 0) ? ATSHA_ERR_OK : ATSHA_ERR_RESPONSE_MISMATCH;
+	OPENSSL_cleanse(expected, ATSHA204_SLOT_BYTE_LEN);
+
+	return status;
+}
+
+static int challenge_response_batch_nolock(struct atsha_handle *handle, atsha_challenge_item *items, size_t count) {
+	int status, result = ATSHA_ERR_OK;
+
+	for (size_t i = 0; i < count; i++) {
+		atsha_challenge_item *item = &items[i];
+
+		if (item->slot_number > ATSHA204_MAX_SLOT_NUMBER || item->challenge.bytes != 32 || (item->mode != ATSHA_CHALLENGE_HMAC && item->mode != ATSHA_CHALLENGE_MAC)) {
+			log_message("api: challenge_response_batch: invalid item");
+			item->status = ATSHA_ERR_INVALID_INPUT;
+			if (result == ATSHA_ERR_OK) result = item->status;
+			continue;
+		}
+
+		//Watchdog puts device to sleep regardless of commands; wake it again in time
+		if (handle->awake && (monotonic_time_us() - handle->wake_time + challenge_response_max_time(item->mode)) > WAKE_PERIOD_BUDGET) {
+			if (idle(handle) != ATSHA_ERR_OK) {
+				log_message(WARNING_WAKE_NOT_CONFIRMED);
+			}
+		}
+
+		if (!handle->awake) {
+			status = wake(handle);
+			if (status != ATSHA_ERR_OK) {
+				item->status = status;
+				if (result == ATSHA_ERR_OK) result = item->status;
+				continue;
+			}
+		}
+
+		if (item->mode == ATSHA_CHALLENGE_MAC) {
+			item->status = challenge_response_mac(handle, item->slot_number, item->challenge, &item->response, item->use_sn_in_digest);
+		} else {
+			item->status = challenge_response_hmac(handle, item->slot_number, item->challenge, &item->response, item->use_sn_in_digest);
+		}
+
+		if (item->status != ATSHA_ERR_OK) {
+			if (result == ATSHA_ERR_OK) result = item->status;
+			//State of the device is unknown; start next item with clean wake
+			idle(handle);
+		}
+	}
+
+	if (handle->awake) {
+		//Let device sleep; idle is deferred for next operation
+		status = idle_deferred(handle);
+		if (status != ATSHA_ERR_OK) {
+			log_message(WARNING_WAKE_NOT_CONFIRMED);
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Batch processing used by worker and by callers without worker
+ */
+static int challenge_response_batch_locked(struct atsha_handle *handle, atsha_challenge_item *items, size_t count) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = challenge_response_batch_nolock(handle, items, count);
+	bus_unlock(handle);
+
+	return status;
+}
+
+int atsha_challenge_response_batch(struct atsha_handle *handle, atsha_challenge_item *items, size_t count) {
+	if (handle->worker != NULL) {
+		return worker_submit_call(handle, items, count);
+	}
+
+	return challenge_response_batch_locked(handle, items, count);
+}
+
+int atsha_start_worker(struct atsha_handle *handle) {
+	if (handle->worker != NULL) return ATSHA_ERR_OK;
+
+	handle->worker = worker_start(handle, challenge_response_batch_locked);
+	if (handle->worker == NULL) {
+		log_message("api: start_worker: couldn't start worker thread");
+		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	}
+
+	return ATSHA_ERR_OK;
+}
+
+/*
+ * Read one block or word of config or OTP zone; device must be awake
+ */
+static int zone_read(struct atsha_handle *handle, unsigned char zone_config, unsigned char address, unsigned char *data, size_t len) {
+	int status;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+	atsha_big_int number;
+
+	packet = op_raw_read(buffer, zone_config, address);
+
+	status = command(handle, packet, answer);
+	if (status != ATSHA_ERR_OK) {
+		return status;
+	}
+
+	number.bytes = op_raw_read_recv(answer, number.data);
+	if (number.bytes != len) {
+		log_message("api: zone_read: unexpected size of answer");
+		return ATSHA_ERR_BAD_COMMUNICATION_STATUS;
+	}
+
+	memcpy(data, number.data, len);
+
+	return ATSHA_ERR_OK;
+}
+
+/*
+ * Read config zone (and OTP zone if it is locked) in one wake period.
+ * Snapshot is kept only when both zones are locked - they couldn't change anymore.
+ */
+static int zones_snapshot(struct atsha_handle *handle) {
+	int status;
+	unsigned char conf_32 = get_zone_config(IO_MEM_CONFIG, IO_RW_NON_ENC, IO_RW_32_BYTES);
+	unsigned char conf_4 = get_zone_config(IO_MEM_CONFIG, IO_RW_NON_ENC, IO_RW_4_BYTES);
+	unsigned char otp_32 = get_zone_config(IO_MEM_OTP, IO_RW_NON_ENC, IO_RW_32_BYTES);
+
+	if (handle->zones_state == ZONES_CACHED) return ATSHA_ERR_OK;
+
+	//Wakeup device
+	status = wake(handle);
+	if (status != ATSHA_ERR_OK) return status;
+
+	//Blocks 0 and 1 are complete; block 2 has only 6 words
+	for (unsigned char block = 0; block < 2; block++) {
+		status = zone_read(handle, conf_32, block * 8, handle->conf_zone + (block * ATSHA204_SLOT_BYTE_LEN), ATSHA204_SLOT_BYTE_LEN);
+		if (status != ATSHA_ERR_OK) return status;
+	}
+	for (unsigned char word = 0x10; word < (ATSHA204_CONFIG_ZONE_BYTE_LEN / ATSHA204_OTP_BYTE_LEN); word++) {
+		status = zone_read(handle, conf_4, word, handle->conf_zone + (word * ATSHA204_OTP_BYTE_LEN), ATSHA204_OTP_BYTE_LEN);
+		if (status != ATSHA_ERR_OK) return status;
+	}
+
+	bool conf_locked = (handle->conf_zone[ATSHA204_CONFIG_LOCK_CONFIG] == ATSHA204_CONFIG_ZONE_LOCKED);
+	bool otp_locked = (handle->conf_zone[ATSHA204_CONFIG_LOCK_VALUE] == ATSHA204_CONFIG_ZONE_LOCKED);
+
+	//Unlocked OTP zone couldn't be read
+	if (otp_locked) {
+		for (unsigned char block = 0; block < 2; block++) {
+			status = zone_read(handle, otp_32, block * 8, handle->otp_zone + (block * ATSHA204_SLOT_BYTE_LEN), ATSHA204_SLOT_BYTE_LEN);
+			if (status != ATSHA_ERR_OK) return status;
+		}
+	}
+
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
+	if (status != ATSHA_ERR_OK) {
+		log_message(WARNING_WAKE_NOT_CONFIRMED);
+	}
+
+	if (conf_locked && otp_locked) {
+		handle->zones_state = ZONES_CACHED;
+	} else {
+		handle->zones_state = ZONES_UNLOCKED;
+	}
+
+	return ATSHA_ERR_OK;
+}
+
+/*
+ * Check whether zones could be served from snapshot. Try to make one if it wasn't done yet.
+ */
+static bool zones_cached(struct atsha_handle *handle) {
+	//Emulation doesn't support 32 bytes reads of OTP and config zone
+	if (handle->zones_state == ZONES_NOT_READ && handle->bottom_layer != BOTTOM_LAYER_EMULATION) {
+		if (zones_snapshot(handle) != ATSHA_ERR_OK) {
+			log_message("api: zones_cached: zone snapshot failed");
+		}
+	}
+
+	return (handle->zones_state == ZONES_CACHED);
+}
+
+/*
+ * Content of zones could be changed by write (OTP consumption mode) or lock
+ */
+static void zones_invalidate(struct atsha_handle *handle, bool lock) {
+	if (lock || handle->zones_state == ZONES_CACHED) {
+		handle->zones_state = ZONES_NOT_READ;
+	}
+}
+
+static int chip_serial_number_nolock(struct atsha_handle *handle, atsha_big_int *number) {
+	int status;
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+
+	if (zones_cached(handle)) {
+		//Serial number is spread over config words 0, 2 and 3
+		memcpy(number->data, handle->conf_zone, 4);
+		memcpy(number->data + 4, handle->conf_zone + 8, 5);
+		number->bytes = ATSHA204_SN_BYTE_LEN;
+		return ATSHA_ERR_OK;
+	}
+
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
 	packet = op_serial_number();
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
 	number->bytes = op_serial_number_recv(answer, number->data);
 	if (number->bytes == 0) {
-		free(packet);
-		free(answer);
 		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
+int atsha_chip_serial_number(struct atsha_handle *handle, atsha_big_int *number) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = chip_serial_number_nolock(handle, number);
+	bus_unlock(handle);
+
+	return status;
+}
+
 int atsha_serial_number(struct atsha_handle *handle, atsha_big_int *number) {
 	if (USE_OUR_SN) {
 		int status;
@@ -721,60 +1415,73 @@ int atsha_serial_number(struct atsha_handle *handle, atsha_big_int *number) {
 	}
 }
 
-int atsha_raw_conf_read(struct atsha_handle *handle, unsigned char address, atsha_big_int *data) {
+static int raw_conf_read_nolock(struct atsha_handle *handle, unsigned char address, atsha_big_int *data) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+
+	if (((address + 1) * ATSHA204_OTP_BYTE_LEN) <= ATSHA204_CONFIG_ZONE_BYTE_LEN && zones_cached(handle)) {
+		memcpy(data->data, handle->conf_zone + (address * ATSHA204_OTP_BYTE_LEN), ATSHA204_OTP_BYTE_LEN);
+		data->bytes = ATSHA204_OTP_BYTE_LEN;
+		return ATSHA_ERR_OK;
+	}
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	packet = op_raw_read(get_zone_config(IO_MEM_CONFIG, IO_RW_NON_ENC, IO_RW_4_BYTES), address);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_raw_read(buffer, get_zone_config(IO_MEM_CONFIG, IO_RW_NON_ENC, IO_RW_4_BYTES), address);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
 	data->bytes = op_raw_read_recv(answer, data->data);
 	if (data->bytes == 0) {
-		free(packet);
-		free(answer);
 		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
-int atsha_raw_conf_write(struct atsha_handle *handle, unsigned char address, atsha_big_int data) {
+int atsha_raw_conf_read(struct atsha_handle *handle, unsigned char address, atsha_big_int *data) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = raw_conf_read_nolock(handle, address, data);
+	bus_unlock(handle);
+
+	return status;
+}
+
+static int raw_conf_write_nolock(struct atsha_handle *handle, unsigned char address, atsha_big_int data) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+
+	if (data.bytes > ATSHA_MAX_DATA_SIZE) {
+		log_message("api: raw_conf_write: data are bigger than max data size");
+		return ATSHA_ERR_INVALID_INPUT;
+	}
+
+	zones_invalidate(handle, false);
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	packet = op_raw_write(get_zone_config(IO_MEM_CONFIG, IO_RW_NON_ENC, IO_RW_4_BYTES), address, data.bytes, data.data);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_raw_write(buffer, get_zone_config(IO_MEM_CONFIG, IO_RW_NON_ENC, IO_RW_4_BYTES), address, data.bytes, data.data);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
@@ -783,72 +1490,91 @@ int atsha_raw_conf_write(struct atsha_handle *handle, unsigned char address, ats
 		return status;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
-int atsha_raw_otp_read(struct atsha_handle *handle, unsigned char address, atsha_big_int *data) {
+int atsha_raw_conf_write(struct atsha_handle *handle, unsigned char address, atsha_big_int data) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = raw_conf_write_nolock(handle, address, data);
+	bus_unlock(handle);
+
+	return status;
+}
+
+static int raw_otp_read_nolock(struct atsha_handle *handle, unsigned char address, atsha_big_int *data) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+
+	if (((address + 1) * ATSHA204_OTP_BYTE_LEN) <= ATSHA204_OTP_ZONE_BYTE_LEN && zones_cached(handle)) {
+		memcpy(data->data, handle->otp_zone + (address * ATSHA204_OTP_BYTE_LEN), ATSHA204_OTP_BYTE_LEN);
+		data->bytes = ATSHA204_OTP_BYTE_LEN;
+		return ATSHA_ERR_OK;
+	}
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	packet = op_raw_read(get_zone_config(IO_MEM_OTP, IO_RW_NON_ENC, IO_RW_4_BYTES), address);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_raw_read(buffer, get_zone_config(IO_MEM_OTP, IO_RW_NON_ENC, IO_RW_4_BYTES), address);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
 	data->bytes = op_raw_read_recv(answer, data->data);
 	if (data->bytes == 0) {
-		free(packet);
-		free(answer);
 		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
-int atsha_raw_otp_write(struct atsha_handle *handle, unsigned char address, atsha_big_int data) {
+int atsha_raw_otp_read(struct atsha_handle *handle, unsigned char address, atsha_big_int *data) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = raw_otp_read_nolock(handle, address, data);
+	bus_unlock(handle);
+
+	return status;
+}
+
+static int raw_otp_write_nolock(struct atsha_handle *handle, unsigned char address, atsha_big_int data) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+
+	if (data.bytes > ATSHA_MAX_DATA_SIZE) {
+		log_message("api: raw_otp_write: data are bigger than max data size");
+		return ATSHA_ERR_INVALID_INPUT;
+	}
+
+	zones_invalidate(handle, false);
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	packet = op_raw_write(get_zone_config(IO_MEM_OTP, IO_RW_NON_ENC, IO_RW_4_BYTES), address, data.bytes, data.data);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_raw_write(buffer, get_zone_config(IO_MEM_OTP, IO_RW_NON_ENC, IO_RW_4_BYTES), address, data.bytes, data.data);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
@@ -857,34 +1583,97 @@ int atsha_raw_otp_write(struct atsha_handle *handle, unsigned char address, atsh
 		return status;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
+	return ATSHA_ERR_OK;
+}
+
+int atsha_raw_otp_write(struct atsha_handle *handle, unsigned char address, atsha_big_int data) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = raw_otp_write_nolock(handle, address, data);
+	bus_unlock(handle);
+
+	return status;
+}
+
+static int conf_zone_read_nolock(struct atsha_handle *handle, unsigned char *data) {
+	int status;
+
+	if (handle->bottom_layer != BOTTOM_LAYER_EMULATION) {
+		status = zones_snapshot(handle);
+		if (status != ATSHA_ERR_OK) return status;
+
+		memcpy(data, handle->conf_zone, ATSHA204_CONFIG_ZONE_BYTE_LEN);
+		return ATSHA_ERR_OK;
+	}
+
+	atsha_big_int word;
+	for (unsigned char address = 0; address < (ATSHA204_CONFIG_ZONE_BYTE_LEN / ATSHA204_OTP_BYTE_LEN); address++) {
+		status = atsha_raw_conf_read(handle, address, &word);
+		if (status != ATSHA_ERR_OK) return status;
+		memcpy(data + (address * ATSHA204_OTP_BYTE_LEN), word.data, ATSHA204_OTP_BYTE_LEN);
+	}
 
 	return ATSHA_ERR_OK;
 }
 
-int atsha_lock_config(struct atsha_handle *handle, const unsigned char *crc) {
+int atsha_conf_zone_read(struct atsha_handle *handle, unsigned char *data) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = conf_zone_read_nolock(handle, data);
+	bus_unlock(handle);
+
+	return status;
+}
+
+static int otp_zone_read_nolock(struct atsha_handle *handle, unsigned char *data) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+
+	if (zones_cached(handle)) {
+		memcpy(data, handle->otp_zone, ATSHA204_OTP_ZONE_BYTE_LEN);
+		return ATSHA_ERR_OK;
+	}
+
+	atsha_big_int word;
+	for (unsigned char address = 0; address < (ATSHA204_OTP_ZONE_BYTE_LEN / ATSHA204_OTP_BYTE_LEN); address++) {
+		status = atsha_raw_otp_read(handle, address, &word);
+		if (status != ATSHA_ERR_OK) return status;
+		memcpy(data + (address * ATSHA204_OTP_BYTE_LEN), word.data, ATSHA204_OTP_BYTE_LEN);
+	}
+
+	return ATSHA_ERR_OK;
+}
+
+int atsha_otp_zone_read(struct atsha_handle *handle, unsigned char *data) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = otp_zone_read_nolock(handle, data);
+	bus_unlock(handle);
+
+	return status;
+}
+
+static int lock_config_nolock(struct atsha_handle *handle, const unsigned char *crc) {
+	int status;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+
+	zones_invalidate(handle, true);
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	packet = op_lock(get_lock_config(LOCK_CONFIG), crc);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_lock(buffer, get_lock_config(LOCK_CONFIG), crc);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
@@ -893,34 +1682,40 @@ int atsha_lock_config(struct atsha_handle *handle, const unsigned char *crc) {
 		return status;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
 
-int atsha_lock_data(struct atsha_handle *handle, const unsigned char *crc) {
+int atsha_lock_config(struct atsha_handle *handle, const unsigned char *crc) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = lock_config_nolock(handle, crc);
+	bus_unlock(handle);
+
+	return status;
+}
+
+static int lock_data_nolock(struct atsha_handle *handle, const unsigned char *crc) {
 	int status;
-	unsigned char *packet;
-	unsigned char *answer = NULL;
+	unsigned char buffer[ATSHA204_IO_BUFFER];
+	unsigned char answer[ATSHA204_IO_BUFFER];
+	const unsigned char *packet;
+
+	zones_invalidate(handle, true);
 
 	//Wakeup device
 	status = wake(handle);
 	if (status != ATSHA_ERR_OK) return status;
 
-	packet = op_lock(get_lock_config(LOCK_DATA), crc);
-	if (!packet) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	packet = op_lock(buffer, get_lock_config(LOCK_DATA), crc);
 
-	status = command(handle, packet, &answer);
+	status = command(handle, packet, answer);
 	if (status != ATSHA_ERR_OK) {
-		free(packet);
-		free(answer);
 		return status;
 	}
 
@@ -929,14 +1724,113 @@ int atsha_lock_data(struct atsha_handle *handle, const unsigned char *crc) {
 		return status;
 	}
 
-	//Let device sleep
-	status = idle(handle);
+	//Let device sleep; idle is deferred for next operation
+	status = idle_deferred(handle);
 	if (status != ATSHA_ERR_OK) {
 		log_message(WARNING_WAKE_NOT_CONFIRMED);
 	}
 
-	free(packet);
-	free(answer);
-
 	return ATSHA_ERR_OK;
 }
+
+int atsha_lock_data(struct atsha_handle *handle, const unsigned char *crc) {
+	int status = bus_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
+	status = lock_data_nolock(handle, crc);
+	bus_unlock(handle);
+
+	return status;
+}
+
+/*
+ * Worst case execution time of one operation of transaction in microseconds
+ */
+static unsigned int transaction_op_max_time(unsigned char op) {
+	unsigned int typical, max;
+
+	switch (op) {
+		case ATSHA_OP_DEV_REV:
+			op_exec_time(ATSHA204_OPCODE_DEV_REV, &typical, &max);
+			return max;
+		case ATSHA_OP_RANDOM:
+			op_exec_time(ATSHA204_OPCODE_RANDOM, &typical, &max);
+			return max;
+		case ATSHA_OP_SLOT_WRITE:
+		case ATSHA_OP_CONF_WRITE:
+		case ATSHA_OP_OTP_WRITE:
+			op_exec_time(ATSHA204_OPCODE_WRITE, &typical, &max);
+			return max;
+		case ATSHA_OP_HMAC:
+			return challenge_response_max_time(ATSHA_CHALLENGE_HMAC);
+		case ATSHA_OP_MAC:
+			return challenge_response_max_time(ATSHA_CHALLENGE_MAC);
+		default:
+			op_exec_time(ATSHA204_OPCODE_READ, &typical, &max);
+			return max;
+	}
+}
+
+static int transaction_op_run(struct atsha_handle *handle, atsha_transaction_op *op) {
+	switch (op->op) {
+		case ATSHA_OP_DEV_REV:
+			return dev_rev_nolock(handle, &op->revision);
+		case ATSHA_OP_RANDOM:
+			return random_nolock(handle, &op->result);
+		case ATSHA_OP_SLOT_READ:
+			return raw_slot_read_nolock(handle, op->address, &op->result);
+		case ATSHA_OP_SLOT_WRITE:
+			return raw_slot_write_nolock(handle, op->address, op->data);
+		case ATSHA_OP_CONF_READ:
+			return raw_conf_read_nolock(handle, op->address, &op->result);
+		case ATSHA_OP_CONF_WRITE:
+			return raw_conf_write_nolock(handle, op->address, op->data);
+		case ATSHA_OP_OTP_READ:
+			return raw_otp_read_nolock(handle, op->address, &op->result);
+		case ATSHA_OP_OTP_WRITE:
+			return raw_otp_write_nolock(handle, op->address, op->data);
+		case ATSHA_OP_HMAC:
+			return low_challenge_response_nolock(handle, op->address, op->data, &op->result, op->use_sn_in_digest);
+		case ATSHA_OP_MAC:
+			return low_challenge_response_mac_nolock(handle, op->address, op->data, &op->result, op->use_sn_in_digest);
+		default:
+			log_message("api: transaction: unknown operation");
+			return ATSHA_ERR_INVALID_INPUT;
+	}
+}
+
+int atsha_transaction(struct atsha_handle *handle, atsha_transaction_op *ops, size_t count) {
+	int result = bus_lock(handle);
+	if (result != ATSHA_ERR_OK) return result;
+
+	//Operations share wake periods; new one is started only when watchdog is close
+	handle->keep_awake = true;
+
+	for (size_t i = 0; i < count; i++) {
+		atsha_transaction_op *op = &ops[i];
+
+		if (handle->awake && (monotonic_time_us() - handle->wake_time + transaction_op_max_time(op->op)) > WAKE_PERIOD_BUDGET) {
+			if (idle(handle) != ATSHA_ERR_OK) {
+				log_message(WARNING_WAKE_NOT_CONFIRMED);
+			}
+		}
+
+		op->status = transaction_op_run(handle, op);
+		if (op->status != ATSHA_ERR_OK) {
+			if (result == ATSHA_ERR_OK) result = op->status;
+			//State of the device is unknown; start next operation with clean wake
+			//Invalid input is refused before any communication
+			if (handle->awake && op->status != ATSHA_ERR_INVALID_INPUT) idle(handle);
+		}
+	}
+
+	handle->keep_awake = false;
+	if (handle->awake) {
+		//Let device sleep; idle is deferred for next operation
+		if (idle_deferred(handle) != ATSHA_ERR_OK) {
+			log_message(WARNING_WAKE_NOT_CONFIRMED);
+		}
+	}
+	bus_unlock(handle);
+
+	return result;
+}
@@ -22,6 +22,12 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
+
+#include "atsha204.h"
+#include "atsha204consts.h"
+#include "breaker.h"
+#include "timing.h"
 
 /**
  * \file api.h
@@ -34,8 +40,11 @@
 typedef struct {
 	bool verbose; ///<Enable verbose mode
 	void (*log_callback)(const char* msg); ///<Callback for error reporting
+	bool lock_per_transaction; ///<Lock the device only for each operation
 } atsha_configuration;
 
+struct dns_cache;
+
 /**
  * \brief Instance of library
  *
@@ -43,27 +52,97 @@ typedef struct {
  */
 struct atsha_handle {
 	int bottom_layer; ///<What kind of bottom layer is used
+	const atsha_transport *transport; ///<Operations of bottom layer
+	void *transport_ctx; ///<Context of transport operations
 	bool is_srv_emulation; ///<Server-side or client-side emulation?
 	int fd;  ///<File descriptor of binary file (e.g. USB layer file)
-	FILE *file; ///<Text file handler, mainly for emulation
-	int lockfile; ///<File descriptor of lock file
+	unsigned int daemon_pending; ///<Responses of pipelined requests to daemon that aren't read yet
+	const struct emul_image *image; ///<Content of emulated device; NULL for other devices
+	bool image_mapped; ///<Is content of emulated device mapped from binary image?
+	bool emul_packets; ///<Does emulation exchange packets instead of direct computation?
+	struct device_lock *lock; ///<Lock of the device shared by all processes
+	bool lock_per_transaction; ///<Is device locked only during operations?
 	struct mpsse_context *i2c; ///<Instance of libmpsse library
 	unsigned char *sn; ///<Serial number for server-side emulation and for caching
 	unsigned char *key; ///<Key for server-side emulation
 	uint32_t key_origin; ///<Cached key origin value
 	bool key_origin_cached; ///<It key origin value cached?
 	unsigned char slot_id; ///<Cached key origin value that is read from OTP memory
+	char *dev_path; ///<Path of device file
+	struct dns_cache *dns_cache; ///<Persistent cache of DNS offset; loaded by first slot lookup
 	unsigned char nonce[32]; ///<Emulation of TempKey memory slot
+	int zones_state; ///<State of zone snapshot (ZONES_* constants)
+	unsigned char conf_zone[ATSHA204_CONFIG_ZONE_BYTE_LEN]; ///<Snapshot of config zone
+	unsigned char otp_zone[ATSHA204_OTP_ZONE_BYTE_LEN]; ///<Snapshot of OTP zone
+	pthread_mutex_t bus_mutex; ///<Serializes communication of threads using this instance
+	unsigned int bus_depth; ///<Nesting of operations holding bus_mutex
+	struct atsha_worker *worker; ///<Worker thread that owns the bus; NULL if not started
+	bool awake; ///<Is wake period of the device in progress?
+	uint64_t wake_time; ///<Start of actual wake period (monotonic time in microseconds)
+	uint64_t last_use; ///<End of last operation (monotonic time in microseconds)
+	bool keep_awake; ///<Transaction in progress; operations don't idle the device
+	struct breaker breaker; ///<Circuit breaker of the device without lock file
+	atsha_retry_policy retry; ///<Retry policy of communication
+	uint64_t timeout; ///<Time limit of one call in microseconds; 0 if unlimited
+	pthread_t idle_thread; ///<Timer thread of deferred idle
+	pthread_cond_t idle_cond; ///<Wakes timer thread of deferred idle
+	bool idle_timer_running; ///<Is timer thread of deferred idle started?
+	bool idle_timer_stop; ///<Request for timer thread to finish
+	struct timing_profile timing; ///<Learned execution times of commands
 };
 
 #define BOTTOM_LAYER_EMULATION 0
 #define BOTTOM_LAYER_NI2C 1
 #define BOTTOM_LAYER_I2C 2
 #define BOTTOM_LAYER_USB 3
+#define BOTTOM_LAYER_DAEMON 4
+#define BOTTOM_LAYER_CUSTOM 5
 #define DNS_ERR_CONST 255
 
+#define ZONES_NOT_READ 0
+#define ZONES_CACHED 1
+#define ZONES_UNLOCKED 2
+
 /**
  * \brief Use callback (from global configuration) and send message through it
  */
 void log_message(const char* msg);
+/**
+ * \brief Lock the device until the end of actual operation
+ *
+ * It does nothing unless the instance locks the device per transaction.
+ * It is called by the first wake of operation.
+ * \return status code
+ */
+int transaction_lock(struct atsha_handle *handle);
+/**
+ * \brief Start operation of the instance; it begins public call too
+ *
+ * Other threads of the instance are waited for until deadline of the call.
+ * \return status code
+ */
+int bus_lock(struct atsha_handle *handle);
+/**
+ * \brief End operation of the instance; end of outermost one ends transaction too
+ */
+void bus_unlock(struct atsha_handle *handle);
+/**
+ * \brief Start public call; the outermost call of thread sets its deadline
+ *
+ * Nested calls share deadline of the outermost one.
+ */
+void call_begin(struct atsha_handle *handle);
+/**
+ * \brief End public call
+ */
+void call_end();
+/**
+ * \brief Time left until deadline of actual call in microseconds
+ * \param limit Result if the call has no deadline or more time is left
+ */
+uint64_t call_time_left(uint64_t limit);
+/**
+ * \brief Has deadline of actual call expired?
+ */
+bool call_expired();
 #endif //MAIN_H
@@ -40,6 +40,14 @@ struct atsha_handle;
  * \brief Maximum data size that could be used for communication with the chip.
  */
 #define ATSHA_MAX_DATA_SIZE 32
+/**
+ * \brief Size of the whole config zone
+ */
+#define ATSHA_CONFIG_ZONE_SIZE 88
+/**
+ * \brief Size of the whole OTP zone
+ */
+#define ATSHA_OTP_ZONE_SIZE 64
 
 /**
  * \brief Data structure for long numbers
@@ -49,7 +57,91 @@ typedef struct {
 	unsigned char data[ATSHA_MAX_DATA_SIZE]; ///<Static buffer for data
 } atsha_big_int;
 
+/**
+ * \brief Algorithms of challenge-response operation
+ */
+#define ATSHA_CHALLENGE_HMAC 0
+#define ATSHA_CHALLENGE_MAC 1
+
+/**
+ * \brief One item of batched challenge-response operation
+ */
+typedef struct {
+	unsigned char slot_number; ///<Number of slot with key to combine with challenge
+	atsha_big_int challenge; ///<Challenge data
+	unsigned char mode; ///<ATSHA_CHALLENGE_HMAC or ATSHA_CHALLENGE_MAC
+	bool use_sn_in_digest; ///<Combine challenge with serial number
+	atsha_big_int response; ///<Computed response (output)
+	int status; ///<Status code of this item (output)
+} atsha_challenge_item;
+
+/**
+ * \brief Retry policy of communication with the device
+ */
+typedef struct {
+	unsigned int retries; ///<Repeated attempts of wake or command after communication error
+	unsigned int backoff; ///<Delay before the first repeated attempt in microseconds
+	unsigned int backoff_max; ///<The longest delay; delay doubles with each attempt up to this value
+} atsha_retry_policy;
+
+/**
+ * \brief Transport delivers packets to the device and back
+ *
+ * Built-in bottom layers are transports too. Transport with
+ * ATSHA_TRANSPORT_RELIABLE checks and repeats wakes and commands itself;
+ * results of the other ones are checked by the library (CRC, wake
+ * confirmation) and repeated by retry policy.
+ */
+#define ATSHA_TRANSPORT_RELIABLE 0x01
+/**
+ * \brief Transport talks directly to device hardware
+ *
+ * Circuit breaker guards its wakes and idle of the device is deferred so
+ * that next operation could reuse the wake period.
+ */
+#define ATSHA_TRANSPORT_DIRECT 0x02
+
+/**
+ * \brief Operations of transport; ctx is the context passed to atsha_open_transport()
+ */
+typedef struct {
+	unsigned int flags; ///<ATSHA_TRANSPORT_* flags
+	unsigned int backoff; ///<Delay before repeated attempt in microseconds of default retry policy; 0 for library default
+	int (*wake)(void *ctx, unsigned char *answer); ///<Wake the device; answer gets wake confirmation packet
+	int (*idle)(void *ctx); ///<Put the device to idle
+	int (*command)(void *ctx, const unsigned char *raw_packet, unsigned char *answer); ///<Send command packet and read answer packet
+	void (*close)(void *ctx); ///<Release the transport; may be NULL
+} atsha_transport;
+
+/**
+ * \brief Operations of transaction
+ */
+#define ATSHA_OP_DEV_REV 0
+#define ATSHA_OP_RANDOM 1
+#define ATSHA_OP_SLOT_READ 2
+#define ATSHA_OP_SLOT_WRITE 3
+#define ATSHA_OP_CONF_READ 4
+#define ATSHA_OP_CONF_WRITE 5
+#define ATSHA_OP_OTP_READ 6
+#define ATSHA_OP_OTP_WRITE 7
+#define ATSHA_OP_HMAC 8
+#define ATSHA_OP_MAC 9
+
+/**
+ * \brief One operation of transaction
+ */
+typedef struct {
+	unsigned char op; ///<ATSHA_OP_* constant
+	unsigned char address; ///<Slot number or address of config/OTP word
+	atsha_big_int data; ///<Data to write or challenge
+	bool use_sn_in_digest; ///<Combine challenge with serial number (HMAC and MAC)
+	atsha_big_int result; ///<Read data, random number or response (output)
+	uint32_t revision; ///<Revision of the device (output of ATSHA_OP_DEV_REV)
+	int status; ///<Status code of this operation (output)
+} atsha_transaction_op;
+
 //Library settings and initialization
+//Settings could be changed at any time, even while other threads use the library
 /**
  * \brief Enable verbose mode
  */
@@ -58,10 +150,80 @@ void atsha_set_verbose();
  * \brief Set callback for reporting errors and warnings from library
  */
 void atsha_set_log_callback(void (*clb)(const char* msg));
+/**
+ * \brief Lock the device per operation instead of whole life of instance
+ *
+ * Instances opened after this call don't lock the device in open. Every
+ * operation locks it with its first wake and unlocks it when it ends, so
+ * several long-lived processes could share the device.
+ */
+void atsha_set_lock_per_transaction();
+/**
+ * \brief Set retry policy of library instance
+ *
+ * Default policy repeats failed wake or command TRY_SEND_RECV_ON_COMM_ERROR
+ * times with constant delay that depends on the bottom layer.
+ */
+void atsha_set_retry_policy(struct atsha_handle *handle, const atsha_retry_policy *policy);
+/**
+ * \brief Limit duration of each call of library instance
+ *
+ * Deadline of the call limits waiting for the device lock, for other
+ * threads using the instance, for the worker, for DNS and repeated
+ * attempts of communication. Call that would exceed it returns
+ * ATSHA_ERR_TIMEOUT. Command that is already sent to the device is
+ * finished.
+ * \param timeout Time limit in microseconds; 0 means no limit (default)
+ */
+void atsha_set_timeout(struct atsha_handle *handle, uint64_t timeout);
+/**
+ * \brief Let emulation exchange packets with CRC like a real device
+ *
+ * Emulation computes challenge-response digests directly from the device
+ * image by default. Packet mode is meant for testing of the protocol.
+ * It has no effect on other bottom layers.
+ */
+void atsha_set_emulation_packets(struct atsha_handle *handle, bool enabled);
 /**
  * \brief Create instance of library. Let library to decide what kind of device is in the system.
+ *
+ * Transport described by ATSHA204_TRANSPORT environment variable is used
+ * when it is set (see atsha_open_spec()). Running atsha204d daemon is used
+ * otherwise when it is available, the device is opened directly at last.
  */
 struct atsha_handle *atsha_open();
+/**
+ * \brief Create instance of library with transport selected by its description
+ *
+ * Description is name of transport optionally followed by colon and path:
+ * "daemon", "ni2c", "i2c", "usb" or "emulation". Default path of the
+ * transport is used without it, e.g. "ni2c:/dev/i2c-1" or "daemon".
+ * atsha_open() uses description from ATSHA204_TRANSPORT environment
+ * variable when it is set.
+ * \return library instance hadler; NULL if transport is unknown or isn't compiled in
+ */
+struct atsha_handle *atsha_open_spec(const char *spec);
+/**
+ * \brief Create instance of library with custom transport
+ *
+ * The library doesn't lock the device of custom transport. Transport is
+ * closed by atsha_close().
+ * \param transport Operations of transport; it has to live until the instance is closed
+ * \param ctx Context passed to operations of transport
+ * \return library instance hadler
+ */
+struct atsha_handle *atsha_open_transport(const atsha_transport *transport, void *ctx);
+/**
+ * \brief Create instance of library with the device compiled in as default; daemon is not used.
+ * \return library instance hadler
+ */
+struct atsha_handle *atsha_open_device();
+/**
+ * \brief Create instance of library that communicates through atsha204d daemon
+ * \param path Path to daemon socket
+ * \return library instance hadler
+ */
+struct atsha_handle *atsha_open_daemon(const char *path);
 /**
  * \brief Create instance of library with USB device
  * \param path Path to hidraw device
@@ -98,6 +260,19 @@ struct atsha_handle *atsha_open_server_emulation(unsigned char slot_id, const un
  */
 void atsha_close(struct atsha_handle *handle);
 
+/**
+ * \brief Let dedicated thread communicate with the device
+ *
+ * Challenge-response requests from all threads are queued and the worker
+ * processes everything that is waiting in one wake period. Concurrent
+ * callers are batched together. Other operations are serialized with the
+ * worker. Start the worker before the instance is shared between threads;
+ * it is stopped by atsha_close().
+ * \param handle Library instance
+ * \return status code
+ */
+int atsha_start_worker(struct atsha_handle *handle);
+
 /**
  * \brief Use DNS-Magic and find slot number for this device
  * \param handle Library instance
@@ -190,6 +365,55 @@ int atsha_challenge_response_mac(struct atsha_handle *handle, atsha_big_int chal
  * \return status code
  */
 int atsha_low_challenge_response_mac(struct atsha_handle *handle, unsigned char slot_number, atsha_big_int challenge, atsha_big_int *response, bool use_sn_in_digest);
+/**
+ * \brief Compute expected response of a device on server side
+ *
+ * It gives the same result as challenge-response of atsha_open_server_emulation()
+ * instance, but it needs no library instance, DNS nor memory allocation.
+ * It is safe to call it from several threads.
+ * \param slot_id Slot ID of actual key of the device
+ * \param serial_number Serial number of the device (as in atsha_open_server_emulation())
+ * \param key Actual key of the device (32 bytes)
+ * \param challenge Challenge data (32 bytes)
+ * \param mode ATSHA_CHALLENGE_HMAC or ATSHA_CHALLENGE_MAC
+ * \param use_sn_in_digest Combine challenge with serial number
+ * \param [out] response buffer for 32 bytes of response
+ * \return status code
+ */
+int atsha_server_response(unsigned char slot_id, const unsigned char *serial_number, const unsigned char *key, const unsigned char *challenge, unsigned char mode, bool use_sn_in_digest, unsigned char *response);
+/**
+ * \brief Verify response of a device on server side
+ *
+ * Expected response is computed as by atsha_server_response() and compared
+ * in constant time.
+ * \param response 32 bytes of response received from the device
+ * \return ATSHA_ERR_OK if the response matches, ATSHA_ERR_RESPONSE_MISMATCH if it doesn't, other status code on error
+ */
+int atsha_server_verify(unsigned char slot_id, const unsigned char *serial_number, const unsigned char *key, const unsigned char *challenge, unsigned char mode, bool use_sn_in_digest, const unsigned char *response);
+/**
+ * \brief Perform several challenge-response operations in one wake period
+ *
+ * Items are processed in order. The device is woken up again only when the
+ * next item wouldn't finish before chip watchdog puts the device to sleep or
+ * when previous item failed.
+ * \param handle Library instance
+ * \param [in,out] items Array of challenges; response and status are filled for each item
+ * \param count Number of items
+ * \return ATSHA_ERR_OK if all items succeeded, status code of first failed item otherwise
+ */
+int atsha_challenge_response_batch(struct atsha_handle *handle, atsha_challenge_item *items, size_t count);
+/**
+ * \brief Execute several operations at once
+ *
+ * Operations are executed in order. The device is locked once and woken
+ * as few times as its watchdog allows. Failed operation doesn't stop the
+ * following ones.
+ * \param handle Library instance
+ * \param ops Operations; results and status codes are stored in them
+ * \param count Number of operations
+ * \return ATSHA_ERR_OK if all operations succeeded, status code of first failed operation otherwise
+ */
+int atsha_transaction(struct atsha_handle *handle, atsha_transaction_op *ops, size_t count);
 /**
  * \brief Get chip serial number defined by manufacturer
  * \param handle Library instance
@@ -240,6 +464,25 @@ int atsha_raw_otp_read(struct atsha_handle *handle, unsigned char address, atsha
  * \return status code
  */
 int atsha_raw_otp_write(struct atsha_handle *handle, unsigned char address, atsha_big_int data);
+/**
+ * \brief Read the whole config zone
+ *
+ * Zones are read in one wake period. When both config and OTP zones are
+ * locked, their content is cached in library instance and next reads
+ * don't communicate with the device.
+ * \param handle Library instance
+ * \param [out] data buffer with at least ATSHA_CONFIG_ZONE_SIZE bytes
+ * \return status code
+ */
+int atsha_conf_zone_read(struct atsha_handle *handle, unsigned char *data);
+/**
+ * \brief Read the whole OTP zone
+ * \warning Success of this operation depends on actual state of the device
+ * \param handle Library instance
+ * \param [out] data buffer with at least ATSHA_OTP_ZONE_SIZE bytes
+ * \return status code
+ */
+int atsha_otp_zone_read(struct atsha_handle *handle, unsigned char *data);
 /**
  * \brief Get chip DevRev number
  * \param handle Library instance
@@ -266,6 +509,10 @@ int atsha_lock_data(struct atsha_handle *handle, const unsigned char *crc);
 #define ATSHA_ERR_CONFIG_FILE_BAD_FORMAT 7
 #define ATSHA_ERR_DNS_GET_KEY 8
 #define ATSHA_ERR_USBCMD_NOT_CONFIRMED 9
+#define ATSHA_ERR_DEVICE_LOCK 10
+#define ATSHA_ERR_DEVICE_UNAVAILABLE 11
+#define ATSHA_ERR_TIMEOUT 12
+#define ATSHA_ERR_RESPONSE_MISMATCH 13
 
 /**
  * \brief Get text description of error status code
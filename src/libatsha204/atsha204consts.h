@@ -35,7 +35,6 @@
 #define ATSHA204_I2C_WA_IDLE 0x02
 #define ATSHA204_I2C_WA_COMMAND 0x03
 #define ATSHA204_I2C_IO_ERR_RESPONSE 0xFF
-#define ATSHA204_I2C_IO_ERR_RESPONSE_TRIES 5
 
 //Status codes
 #define ATSHA204_STATUS_SUCCES 0x00
@@ -55,16 +54,44 @@
 #define ATSHA204_OPCODE_MAC 0x08
 #define ATSHA204_OPCODE_LOCK 0x17
 
+//Execution times (in microseconds; typical and maximal according to datasheet)
+#define ATSHA204_EXEC_TYP_DEV_REV 400
+#define ATSHA204_EXEC_MAX_DEV_REV 2000
+#define ATSHA204_EXEC_TYP_RANDOM 11000
+#define ATSHA204_EXEC_MAX_RANDOM 50000
+#define ATSHA204_EXEC_TYP_READ 400
+#define ATSHA204_EXEC_MAX_READ 4000
+#define ATSHA204_EXEC_TYP_WRITE 4000
+#define ATSHA204_EXEC_MAX_WRITE 42000
+#define ATSHA204_EXEC_TYP_NONCE 22000
+#define ATSHA204_EXEC_MAX_NONCE 60000
+#define ATSHA204_EXEC_TYP_HMAC 27000
+#define ATSHA204_EXEC_MAX_HMAC 69000
+#define ATSHA204_EXEC_TYP_MAC 12000
+#define ATSHA204_EXEC_MAX_MAC 35000
+#define ATSHA204_EXEC_TYP_LOCK 5000
+#define ATSHA204_EXEC_MAX_LOCK 24000
+#define ATSHA204_WAKE_HIGH_DELAY 2500
+#define ATSHA204_WATCHDOG_MIN 700000
+
 //Sizes
 #define ATSHA204_SN_BYTE_LEN 9
 #define ATSHA204_SLOT_BYTE_LEN 32
 #define ATSHA204_OTP_BYTE_LEN 4
+#define ATSHA204_CONFIG_ZONE_BYTE_LEN 88
+#define ATSHA204_OTP_ZONE_BYTE_LEN 64
 #define ATSHA204_MAX_SLOT_NUMBER 15
 #define ATSHA204_IO_BUFFER 84
+#define ATSHA204_ANSWER_STATUS_LEN 4
+#define ATSHA204_ANSWER_SHORT_LEN 7
+#define ATSHA204_ANSWER_LONG_LEN 35
 
 //Public interface
 #define ATSHA204_CONFIG_OTPMODE_READONLY 0xAA
 #define ATSHA204_CONFIG_OTPMODE_LEGAY 0x00
+#define ATSHA204_CONFIG_LOCK_VALUE 86
+#define ATSHA204_CONFIG_LOCK_CONFIG 87
+#define ATSHA204_CONFIG_ZONE_LOCKED 0x00
 
 //Our constants
 #define ATSHA204_OTP_MEMORY_MAP_REV_NUMBER 0x00
@@ -0,0 +1,72 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "atsha204.h"
+#include "configuration.h"
+#include "api.h"
+#include "tools.h"
+#include "breaker.h"
+
+static uint32_t now_ms(void) {
+	return (uint32_t)(monotonic_time_us() / 1000);
+}
+
+bool breaker_allow(struct breaker *breaker, bool *probe) {
+	*probe = false;
+
+	if (__atomic_load_n(&breaker->failures, __ATOMIC_ACQUIRE) < BREAKER_THRESHOLD) {
+		return true;
+	}
+
+	//Milliseconds wrap around; compare by difference
+	uint32_t until = __atomic_load_n(&breaker->open_until, __ATOMIC_ACQUIRE);
+	uint32_t now = now_ms();
+	if ((int32_t)(now - until) < 0) {
+		return false;
+	}
+
+	//Half-open; caller that moves the end of cool-down probes the device, the others are refused
+	if (!__atomic_compare_exchange_n(&breaker->open_until, &until, now + BREAKER_COOLDOWN, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return false;
+	}
+	*probe = true;
+
+	return true;
+}
+
+void breaker_success(struct breaker *breaker) {
+	if (__atomic_exchange_n(&breaker->failures, 0, __ATOMIC_ACQ_REL) >= BREAKER_THRESHOLD) {
+		log_message("breaker: device is available again");
+	}
+}
+
+void breaker_failure(struct breaker *breaker) {
+	uint32_t failures = __atomic_add_fetch(&breaker->failures, 1, __ATOMIC_ACQ_REL);
+	if (failures < BREAKER_THRESHOLD) return;
+
+	__atomic_store_n(&breaker->open_until, now_ms() + BREAKER_COOLDOWN, __ATOMIC_RELEASE);
+	if (failures == BREAKER_THRESHOLD) {
+		char msg[BUFFSIZE_LINE];
+		snprintf(msg, BUFFSIZE_LINE, "breaker: device doesn't respond; communication is refused for %d ms", BREAKER_COOLDOWN);
+		log_message(msg);
+	}
+}
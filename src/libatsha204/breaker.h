@@ -0,0 +1,61 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * \file breaker.h
+ * \brief Circuit breaker of the device
+ *
+ * Device that failed to wake up BREAKER_THRESHOLD times in a row is
+ * considered unavailable. Wakes are refused without any communication for
+ * BREAKER_COOLDOWN and then one caller probes the device by a single
+ * attempt. Breaker of device with lock file is shared by all processes.
+ */
+
+/**
+ * \brief State of breaker; zero-filled state is closed breaker
+ *
+ * Only 32-bit members are used; they are changed atomically in shared
+ * memory on 32-bit platforms too.
+ */
+struct breaker {
+	uint32_t failures; ///<Failed wakes in a row
+	uint32_t open_until; ///<End of cool-down (monotonic time in milliseconds)
+};
+
+/**
+ * \brief May the device be woken?
+ * \param [out] probe Is this a single attempt after cool-down?
+ * \return false if communication has to be refused
+ */
+bool breaker_allow(struct breaker *breaker, bool *probe);
+/**
+ * \brief Record successful wake; the breaker is closed
+ */
+void breaker_success(struct breaker *breaker);
+/**
+ * \brief Record failed wake; the breaker is opened after too many of them
+ */
+void breaker_failure(struct breaker *breaker);
+
+#endif //BREAKER_H
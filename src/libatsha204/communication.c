@@ -20,171 +20,325 @@
 #include <unistd.h> //close()
 #include <stdint.h>
 #include <stdbool.h>
-#include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "atsha204.h"
 #include "tools.h"
 #include "configuration.h"
 #include "atsha204consts.h"
-#include "layer_usb.h"
-#include "layer_i2c.h"
-#include "layer_ni2c.h"
-#include "emulation.h"
+#include "lock.h"
+#include "breaker.h"
+#include "timing.h"
+#include "operations.h"
 #include "api.h"
+#include "communication.h"
 
 extern atsha_configuration g_config;
 
-static void try_send_and_recv_sleep(struct atsha_handle *handle) {
-	if (handle->bottom_layer == BOTTOM_LAYER_USB) {
-		usleep(TRY_SEND_RECV_ON_COMM_ERROR_TOUT);
-	} else {
-#if USE_LAYER == USE_LAYER_I2C
-		i2c_wait();
-#endif
-#if USE_LAYER == USE_LAYER_NI2C
-		ni2c_wait();
-#endif
+/*
+ * Wait before next attempt by retry policy of the instance
+ *
+ * Returns false if the deadline of the call would expire before the attempt.
+ */
+static bool retry_sleep(struct atsha_handle *handle, unsigned int *attempt) {
+	uint64_t delay = handle->retry.backoff;
+	for (unsigned int i = 0; i < *attempt && delay < handle->retry.backoff_max; i++) {
+		delay *= 2;
+	}
+	if (delay > handle->retry.backoff_max) delay = handle->retry.backoff_max;
+	(*attempt)++;
+
+	if (call_time_left(delay + 1) <= delay) {
+		log_message("communication: retry_sleep: Deadline of the call doesn't allow next attempt");
+		return false;
+	}
+
+	usleep(delay);
+	return true;
+}
+
+/*
+ * Poll the device until it answers
+ *
+ * Times of the last busy poll and of the successful one are measured from
+ * the start; busy is 0 if the first poll succeeds.
+ */
+static int poll_timed(struct atsha_handle *handle, unsigned int typical, unsigned int max, size_t size, int (*try_read)(struct atsha_handle *handle, size_t size, unsigned char *answer), unsigned char *answer, unsigned int *busy, unsigned int *ready) {
+	int status;
+	unsigned int elapsed = typical;
+	unsigned int delay = ANSWER_POLL_TOUT;
+	uint64_t start = monotonic_time_us();
+
+	*busy = 0;
+	usleep(typical);
+
+	while (true) {
+		//The device is busy or ready already when it is addressed; transfer of the answer doesn't count
+		unsigned int poll_time = (unsigned int)(monotonic_time_us() - start);
+		status = try_read(handle, size, answer);
+		//Communication error means that device is still busy
+		if (status != ATSHA_ERR_COMMUNICATION) {
+			*ready = poll_time;
+			return status;
+		}
+		*busy = poll_time;
+		//Command is already running; deadline of the call doesn't stop it, its max execution time does
+		if (elapsed >= max) break;
+
+		usleep(delay);
+		elapsed += delay;
+		delay *= 2;
+		if (delay > ANSWER_POLL_TOUT_MAX) delay = ANSWER_POLL_TOUT_MAX;
+	}
+
+	log_message("communication: poll_answer: Device didn't answer in time");
+	return status;
+}
+
+int poll_answer(struct atsha_handle *handle, unsigned int typical, unsigned int max, size_t size, int (*try_read)(struct atsha_handle *handle, size_t size, unsigned char *answer), unsigned char *answer) {
+	unsigned int busy, ready;
+
+	return poll_timed(handle, typical, max, size, try_read, answer, &busy, &ready);
+}
+
+int poll_command(struct atsha_handle *handle, const unsigned char *raw_packet, int (*try_read)(struct atsha_handle *handle, size_t size, unsigned char *answer), unsigned char *answer) {
+	unsigned char opcode = raw_packet[1];
+	unsigned int exec_typical, exec_max;
+	op_exec_time(opcode, &exec_typical, &exec_max);
+
+	unsigned int busy, ready;
+	int status = poll_timed(handle, timing_wait(&handle->timing, opcode, exec_typical, exec_max), exec_max, op_answer_size(raw_packet), try_read, answer, &busy, &ready);
+	if (status == ATSHA_ERR_OK) {
+		timing_record(&handle->timing, opcode, busy, ready, exec_max);
 	}
+
+	return status;
+}
+
+/*
+ * Breaker of device with lock file is shared with other processes
+ */
+static struct breaker *device_breaker(struct atsha_handle *handle) {
+	if (!(handle->transport->flags & ATSHA_TRANSPORT_DIRECT)) {
+		return NULL;
+	}
+
+	return (handle->lock != NULL) ? lock_breaker(handle->lock) : &handle->breaker;
 }
 
 int wake(struct atsha_handle *handle) {
 	int status;
-	int tries = TRY_SEND_RECV_ON_COMM_ERROR + 1; //+1 will be eliminated after first iteration
-	unsigned char *answer = NULL;
+	int tries = handle->retry.retries + 1; //+1 will be eliminated after first iteration
+	unsigned int attempt = 0;
+	unsigned char answer[ATSHA204_IO_BUFFER];
+
+	//Reuse wake period of previous operation; start a new one if watchdog is close
+	if (handle->awake) {
+		if (handle->keep_awake || (monotonic_time_us() - handle->wake_time) < WAKE_REUSE_PERIOD) return ATSHA_ERR_OK;
+		idle(handle);
+	}
+
+	if (call_expired()) return ATSHA_ERR_TIMEOUT;
+
+	//Unavailable device isn't contacted; after cool-down one attempt probes it
+	struct breaker *breaker = device_breaker(handle);
+	if (breaker != NULL) {
+		bool probe;
+		if (!breaker_allow(breaker, &probe)) {
+			log_message("communication: wake: Device is unavailable");
+			return ATSHA_ERR_DEVICE_UNAVAILABLE;
+		}
+		if (probe) tries = 0;
+	}
+
+	//Device is locked from the first wake to the end of operation
+	status = transaction_lock(handle);
+	if (status != ATSHA_ERR_OK) return status;
 
 	while (tries >= 0) {
 		tries--;
-////////////////////////////////////////////////////////////////////////
-		switch (handle->bottom_layer) {
-			case BOTTOM_LAYER_EMULATION:
-				return ATSHA_ERR_OK; //Wake is dummy in implementation. Always is successful.
-				break;
-			case BOTTOM_LAYER_NI2C:
-				status = ni2c_wake(handle, &answer);
-				break;
-			case BOTTOM_LAYER_I2C:
-#if USE_LAYER == USE_LAYER_I2C
-				status = i2c_wake(handle, &answer); //do not check - there are no data
-#else
-				assert(0);
-#endif
-				break;
-			case BOTTOM_LAYER_USB:
-				status = usb_wake(handle->fd, &answer);
-				break;
+		//Watchdog starts with the wake; count from the earliest moment
+		uint64_t wake_time = monotonic_time_us();
+		status = handle->transport->wake(handle->transport_ctx, answer);
+		//Reliable transport checks wake confirmation itself
+		if (handle->transport->flags & ATSHA_TRANSPORT_RELIABLE) {
+			handle->awake = (status == ATSHA_ERR_OK);
+			handle->wake_time = wake_time;
+			break;
 		}
-////////////////////////////////////////////////////////////////////////
-		if (status == ATSHA_ERR_OK) {
-			//Check bus consistency
-			if ((handle->bottom_layer == BOTTOM_LAYER_I2C) && (answer[0] == ATSHA204_I2C_IO_ERR_RESPONSE)) {
-				free(answer);
-				answer = NULL;
-				log_message("communication: wake: I2C I/O error detected");
-				status = ATSHA_ERR_COMMUNICATION;
-				try_send_and_recv_sleep(handle);
-				continue;
-			}
 
+		if (status == ATSHA_ERR_OK) {
 			//Check packet consistency and check wake confirmation
 			bool packet_ok = check_packet(answer);
 			if (!packet_ok || (answer[1] != ATSHA204_STATUS_WAKE_OK)) {
-				free(answer);
-				answer = NULL;
 				if (!packet_ok) log_message("communication: wake: CRC doesn't match.");
 				status = ATSHA_ERR_COMMUNICATION;
-				try_send_and_recv_sleep(handle);
+				if (tries >= 0 && !retry_sleep(handle, &attempt)) {
+					status = ATSHA_ERR_TIMEOUT;
+					break;
+				}
 				continue;
 			}
 
+			handle->awake = true;
+			handle->wake_time = wake_time;
+			break;
+		} else if (tries >= 0 && !retry_sleep(handle, &attempt)) {
+			status = ATSHA_ERR_TIMEOUT;
 			break;
+		}
+	}
+
+	if (breaker != NULL) {
+		if (status == ATSHA_ERR_OK) {
+			breaker_success(breaker);
 		} else {
-			try_send_and_recv_sleep(handle);
+			breaker_failure(breaker);
 		}
 	}
 
-	free(answer);
 	return status;
 }
 
 int idle(struct atsha_handle *handle) {
 	int status;
-	int tries = TRY_SEND_RECV_ON_COMM_ERROR;
+	int tries = handle->retry.retries;
+
+	//Device that doesn't confirm idle is left to its watchdog
+	handle->awake = false;
 
 	while (true) {
-////////////////////////////////////////////////////////////////////////
-		switch (handle->bottom_layer) {
-			case BOTTOM_LAYER_EMULATION:
-				return ATSHA_ERR_OK; //Idle is dummy in implementation. Always is successful.
-				break;
-			case BOTTOM_LAYER_NI2C:
-				status = ni2c_idle(handle);
-				break;
-			case BOTTOM_LAYER_I2C:
-#if USE_LAYER == USE_LAYER_I2C
-				status = i2c_idle(handle);
-#else
-				assert(0);
-#endif
-				break;
-			case BOTTOM_LAYER_USB:
-				status = usb_idle(handle->fd);
-				break;
-		}
-////////////////////////////////////////////////////////////////////////
+		tries--;
+		status = handle->transport->idle(handle->transport_ctx);
+		if (handle->transport->flags & ATSHA_TRANSPORT_RELIABLE) return status;
 		if (status == ATSHA_ERR_OK) return status;
 		if (tries < 0) return status;
 	}
 }
 
-int command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
+/*
+ * Deferred idle pays off only when the device belongs to this instance
+ */
+static bool idle_deferrable(struct atsha_handle *handle) {
+	if (handle->lock_per_transaction) return false;
+
+	return (handle->transport->flags & ATSHA_TRANSPORT_DIRECT) != 0;
+}
+
+/*
+ * Put awake device to idle after inactivity or before its watchdog
+ * expires. It holds the bus mutex, so no operation is interrupted.
+ */
+static void *idle_timer(void *arg) {
+	struct atsha_handle *handle = (struct atsha_handle *)arg;
+
+	pthread_mutex_lock(&handle->bus_mutex);
+	while (!handle->idle_timer_stop) {
+		if (!handle->awake) {
+			pthread_cond_wait(&handle->idle_cond, &handle->bus_mutex);
+			continue;
+		}
+
+		uint64_t deadline = handle->last_use + IDLE_DELAY;
+		if (deadline > handle->wake_time + WAKE_PERIOD_BUDGET) {
+			deadline = handle->wake_time + WAKE_PERIOD_BUDGET;
+		}
+
+		if (monotonic_time_us() >= deadline) {
+			if (idle(handle) != ATSHA_ERR_OK) {
+				log_message("communication: idle_timer: Device is possibly still awake");
+			}
+			continue;
+		}
+
+		struct timespec ts = { .tv_sec = deadline / 1000000, .tv_nsec = (deadline % 1000000) * 1000 };
+		pthread_cond_timedwait(&handle->idle_cond, &handle->bus_mutex, &ts);
+	}
+	pthread_mutex_unlock(&handle->bus_mutex);
+
+	return NULL;
+}
+
+static bool idle_timer_start(struct atsha_handle *handle) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); //Same clock as monotonic_time_us()
+	pthread_cond_init(&handle->idle_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	handle->idle_timer_stop = false;
+	if (pthread_create(&handle->idle_thread, NULL, idle_timer, handle) != 0) {
+		log_message("communication: idle_timer_start: Couldn't start timer thread");
+		pthread_cond_destroy(&handle->idle_cond);
+		return false;
+	}
+	handle->idle_timer_running = true;
+
+	return true;
+}
+
+int idle_deferred(struct atsha_handle *handle) {
+	//Transaction decides about wake periods itself
+	if (handle->keep_awake && handle->awake) return ATSHA_ERR_OK;
+
+	if (!handle->awake || !idle_deferrable(handle)) {
+		return idle(handle);
+	}
+
+	handle->last_use = monotonic_time_us();
+	if (!handle->idle_timer_running && !idle_timer_start(handle)) {
+		return idle(handle);
+	}
+	pthread_cond_signal(&handle->idle_cond);
+
+	return ATSHA_ERR_OK;
+}
+
+void idle_timer_stop(struct atsha_handle *handle) {
+	if (handle->idle_timer_running) {
+		pthread_mutex_lock(&handle->bus_mutex);
+		handle->idle_timer_stop = true;
+		pthread_cond_signal(&handle->idle_cond);
+		pthread_mutex_unlock(&handle->bus_mutex);
+
+		pthread_join(handle->idle_thread, NULL);
+		pthread_cond_destroy(&handle->idle_cond);
+		handle->idle_timer_running = false;
+	}
+
+	if (handle->awake) {
+		idle(handle);
+	}
+}
+
+int command(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
 	int status;
-	int tries = TRY_SEND_RECV_ON_COMM_ERROR + 1; //+1 will be eliminated after first iteration
+	int tries = handle->retry.retries + 1; //+1 will be eliminated after first iteration
+	unsigned int attempt = 0;
+
+	if (call_expired()) return ATSHA_ERR_TIMEOUT;
 
 	while (tries >= 0) {
 		tries--;
-////////////////////////////////////////////////////////////////////////
-		switch (handle->bottom_layer) {
-			case BOTTOM_LAYER_EMULATION:
-				return emul_command(handle, raw_packet, answer);
-				break;
-			case BOTTOM_LAYER_NI2C:
-				status = ni2c_command(handle, raw_packet, answer);
-				break;
-			case BOTTOM_LAYER_I2C:
-#if USE_LAYER == USE_LAYER_I2C
-				status = i2c_command(handle, raw_packet, answer);
-#else
-				assert(0);
-#endif
-				break;
-			case BOTTOM_LAYER_USB:
-				status = usb_command(handle->fd, raw_packet, answer);
-				break;
-		}
-////////////////////////////////////////////////////////////////////////
-		if (status == ATSHA_ERR_OK) {
-			//Check bus consistency
-			if ((handle->bottom_layer == BOTTOM_LAYER_I2C) && ((*answer)[0] == ATSHA204_I2C_IO_ERR_RESPONSE)) {
-				free(*answer);
-				*answer = NULL;
-				log_message("communication: command: I2C I/O error detected");
-				status = ATSHA_ERR_COMMUNICATION;
-				try_send_and_recv_sleep(handle);
-				continue;
-			}
+		status = handle->transport->command(handle->transport_ctx, raw_packet, answer);
+		//Reliable transport checks and repeats commands itself
+		if (handle->transport->flags & ATSHA_TRANSPORT_RELIABLE) return status;
 
+		if (status == ATSHA_ERR_OK) {
 			//Check packet consistency and status code
-			if (!check_packet(*answer)) {
-				free(*answer);
-				*answer = NULL;
+			if (!check_packet(answer)) {
 				log_message("communication: command: CRC doesn't match.");
 				status = ATSHA_ERR_COMMUNICATION;
-				try_send_and_recv_sleep(handle);
+				if (tries >= 0 && !retry_sleep(handle, &attempt)) {
+					status = ATSHA_ERR_TIMEOUT;
+					break;
+				}
 				continue;
 			}
 
-			if ((*answer)[0] == 4) { //Messages with length 4 are always status codes
-				unsigned char atsha204_status = (*answer)[1];
+			if (answer[0] == 4) { //Messages with length 4 are always status codes
+				unsigned char atsha204_status = answer[1];
 				bool go_trough = true;
 				if (atsha204_status == ATSHA204_STATUS_PARSE_ERROR) {
 					log_message("communication: command: Bad ATSHA204 status: Parse error.");
@@ -202,17 +356,19 @@ int command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned cha
 				} //The rest of status codes are distributed
 
 				if (!go_trough) {
-					free(*answer);
-					*answer = NULL;
 					status = ATSHA_ERR_BAD_COMMUNICATION_STATUS;
-					try_send_and_recv_sleep(handle);
+					if (tries >= 0 && !retry_sleep(handle, &attempt)) {
+						status = ATSHA_ERR_TIMEOUT;
+						break;
+					}
 					continue;
 				}
 			}
 
 			break;
-		} else {
-			try_send_and_recv_sleep(handle);
+		} else if (tries >= 0 && !retry_sleep(handle, &attempt)) {
+			status = ATSHA_ERR_TIMEOUT;
+			break;
 		}
 	}
 
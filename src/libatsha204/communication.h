@@ -36,11 +36,46 @@ int wake(struct atsha_handle *handle);
  * \brief Wrapper for layer-dependent implementation of idle command
  */
 int idle(struct atsha_handle *handle);
+/**
+ * \brief End of operation; idle is deferred so that next operation could reuse the wake period
+ *
+ * Device is put to idle after IDLE_DELAY of inactivity or before its
+ * watchdog expires. Device that isn't owned by this instance only (e.g.
+ * it is locked per transaction) is put to idle immediately.
+ */
+int idle_deferred(struct atsha_handle *handle);
+/**
+ * \brief Stop timer of deferred idle and put awake device to idle
+ */
+void idle_timer_stop(struct atsha_handle *handle);
 /**
  * \brief Wrapper for layer-dependent implementation of data exchange
  * \param raw_packet Command for the device
- * \param [out] answer Response from the device
+ * \param [out] answer Buffer with at least ATSHA204_IO_BUFFER bytes for response from the device
+ */
+int command(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer);
+/**
+ * \brief Wait until the device finishes execution and read its answer
+ *
+ * The device doesn't respond while it is busy. Sleep typical execution time
+ * and then poll the device with growing delay until maximal execution time
+ * expires.
+ * \param typical typical execution time in microseconds
+ * \param max maximal execution time in microseconds
+ * \param size expected size of the answer
+ * \param try_read Layer-dependent implementation of one read attempt
+ * \param [out] answer Buffer with at least ATSHA204_IO_BUFFER bytes for response from the device
+ */
+int poll_answer(struct atsha_handle *handle, unsigned int typical, unsigned int max, size_t size, int (*try_read)(struct atsha_handle *handle, size_t size, unsigned char *answer), unsigned char *answer);
+/**
+ * \brief Wait until the device finishes the command and read its answer
+ *
+ * Like poll_answer() but the first wait is learned from previous executions
+ * of the command (see timing.h) and this execution is recorded.
+ * \param raw_packet Command sent to the device
+ * \param try_read Layer-dependent implementation of one read attempt
+ * \param [out] answer Buffer with at least ATSHA204_IO_BUFFER bytes for response from the device
  */
-int command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer);
+int poll_command(struct atsha_handle *handle, const unsigned char *raw_packet, int (*try_read)(struct atsha_handle *handle, size_t size, unsigned char *answer), unsigned char *answer);
 
 #endif //COMMUNICATION_H
@@ -25,6 +25,24 @@
 #define TRY_SEND_RECV_ON_COMM_ERROR 5
 #define TRY_SEND_RECV_ON_COMM_ERROR_TOUT 2000000
 										//in microseconds (2s)
+#define ANSWER_POLL_TOUT 500
+#define ANSWER_POLL_TOUT_MAX 4000
+										//in microseconds; delay between polls for answer grows from min to max
+#define WAKE_PERIOD_BUDGET (ATSHA204_WATCHDOG_MIN - 100000)
+										//in microseconds; time usable for commands in one wake period
+#define WAKE_REUSE_PERIOD (WAKE_PERIOD_BUDGET / 2)
+										//in microseconds; operation started later doesn't reuse previous wake
+#define IDLE_DELAY 50000
+										//in microseconds; device is put to idle after this inactivity
+#define TIMING_OPCODES 8
+#define TIMING_MIN_SAMPLES 8
+										//in executions; typical time from datasheet is used until then
+#define TIMING_WAIT_MARGIN 10
+										//in percent; initial wait is shorter than learned median
+#define TIMING_EWMA_WEIGHT 8
+#define TIMING_MEDIAN_STEP 32
+										//in fractions of average execution time; step of median estimate
+//TIMING_PROFILE_FILE could be defined in build time; learned execution times persist then
 #define BUFFSIZE_USB 1024
 #define BUFFSIZE_I2C ATSHA204_IO_BUFFER
 #define BUFFSIZE_NI2C ATSHA204_IO_BUFFER
@@ -38,6 +56,11 @@
 #define DEFAULT_EMULATION_CONFIG_PATH "atsha204.sw"
 #endif
 #define DEFAULT_USB_DEV_PATH "/dev/hidraw0"
+#ifndef DEFAULT_DAEMON_SOCKET
+#define DEFAULT_DAEMON_SOCKET "/var/run/atsha204d.sock"
+#endif
+#define TRANSPORT_ENV "ATSHA204_TRANSPORT"
+										//environment variable with description of transport used by atsha_open()
 #define NI2C_DEV_PATH_LOCAL "/dev/i2c-0"
 #define NI2C_DEV_PATH_REMOTE "/dev/i2c-1"
 #ifndef DEFAULT_NI2C_DEV_PATH
@@ -46,9 +69,38 @@
 #define DEFAULT_USE_SN_IN_DIGEST true
 #define DEFAULT_DNS_RECORD_FIND_KEY "atsha-key.turris.cz"
 #define DEFAULT_DNSSEC_ROOT_KEY "/etc/unbound/root.key"
-#define LOCK_FILE "/tmp/libatsha204.lock"
-#define LOCK_TRY_TOUT 10000
-#define LOCK_TRY_MAX 2.2
+#ifndef DNS_CACHE_FILE
+#define DNS_CACHE_FILE "/var/run/libatsha204.cache"
+#endif
+#define DNS_CACHE_TTL_MAX 86400
+										//in seconds; longer TTL of DNS record is shortened
+#define DNS_CACHE_REFRESH_AHEAD 60
+										//in seconds; record is refreshed in background before it expires (long-running processes only)
+#define DNS_CACHE_STALE_MAX 604800
+										//in seconds; expired record is still used when refresh fails (7 days)
+#define DNS_RESOLVE_TOUT 2000
+										//in milliseconds; the longest wait for DNS answer
+//DEFAULT_DNS_PINNED_OFFSET could be defined in build time; DNS isn't used then
+#define LOCK_FILE_PREFIX "/tmp/libatsha204"
+										//lock file of device is <prefix>-<bus>-<address>.lock
+#define LOCK_TOUT 2200000
+										//in microseconds; the longest wait for the device lock
+#define LOCK_CHECK_PERIOD 100000
+										//in microseconds; serving ticket that doesn't take free device for this long is skipped
+#define LOCK_WAIT_REPORT 10000
+										//in microseconds; longer wait for the lock is reported
+#define LOCK_SLOTS 32
+#define BREAKER_THRESHOLD 3
+										//in failed wakes; device is considered unavailable then
+#define BREAKER_COOLDOWN 30000
+										//in milliseconds; unavailable device isn't contacted for this time
+#define DAEMON_IDLE_DELAY 20000
+										//in microseconds; daemon keeps the device awake for next transaction
+#define DAEMON_TRANSACTION_TOUT 2000000
+										//in microseconds; daemon drops client that stalls its transaction
+#define DAEMON_MAX_CLIENTS 32
+#define DAEMON_CACHE_SIZE 64
+										//in answers of Read and DevRev commands
 
 #define USE_LAYER_EMULATION 0
 #define USE_LAYER_NI2C 1
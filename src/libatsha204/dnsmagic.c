@@ -17,10 +17,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 //DNS Resolving
 #include <unbound.h>
@@ -30,6 +37,7 @@
 #include "atsha204.h"
 #include "tools.h"
 #include "api.h"
+#include "dnsmagic.h"
 
 /*
  * viz IANA
@@ -45,33 +53,65 @@
 atsha_configuration g_config;
 
 /*
- * Get decimal number from its string representation
+ * Resolver context shared by all library instances in the process.
+ * It keeps libunbound cache and validated chain of trust between lookups.
  */
-static uint32_t number_from_string(size_t len, char *str) {
-	uint32_t res = 0;
-	unsigned char digit = 0;
+static struct ub_ctx *shared_ctx = NULL;
+static size_t shared_ctx_refs = 0;
+static pthread_mutex_t shared_ctx_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-	for (size_t i = 0; i < len; i++) {
-		digit = str[i] - '0';
-		res *= 10;
-		res += digit;
+/*
+ * State of asynchronous query; protected by shared_ctx_mutex
+ *
+ * Answer is kept for all callers until its TTL runs out.
+ */
+static struct {
+	bool pending;
+	int id;
+	bool done;
+	bool ok;
+	uint32_t offset;
+	int ttl;
+	time_t answered;
+} query;
+
+void dns_ctx_acquire() {
+	pthread_mutex_lock(&shared_ctx_mutex);
+	shared_ctx_refs++;
+	pthread_mutex_unlock(&shared_ctx_mutex);
+}
+
+/*
+ * Drop one reference of shared context; shared_ctx_mutex has to be locked
+ */
+static void ctx_unref() {
+	if (shared_ctx_refs > 0) shared_ctx_refs--;
+	if (shared_ctx_refs == 0 && shared_ctx != NULL) {
+		//Deleting of context cancels pending query too
+		ub_ctx_delete(shared_ctx);
+		shared_ctx = NULL;
+		memset(&query, 0, sizeof(query));
 	}
+}
 
-	return res;
+void dns_ctx_release() {
+	pthread_mutex_lock(&shared_ctx_mutex);
+	ctx_unref();
+	pthread_mutex_unlock(&shared_ctx_mutex);
 }
 
+#ifndef DEFAULT_DNS_PINNED_OFFSET
 /*
- * Use linunbound for DNS resolving of TXT record
+ * Create and configure libunbound context
  */
-static bool resolve_key(uint32_t *offset) {
-	struct ub_result* result;
-    struct ub_ctx *ctx = ub_ctx_create();
+static struct ub_ctx *dns_ctx_create() {
+	struct ub_ctx *ctx = ub_ctx_create();
 	int retval;
 	char strbuff[BUFFSIZE_DNSMAGIC_ERRSTRLEN];
 
-    if (!ctx) {
+	if (!ctx) {
 		log_message("dnsmagic: libunbound: create context error");
-		return false;
+		return NULL;
 	}
 
 	/*
@@ -83,8 +123,8 @@ static bool resolve_key(uint32_t *offset) {
 		log_message("dnsmagic: libunbound: reset configuration error");
 		snprintf(strbuff, BUFFSIZE_DNSMAGIC_ERRSTRLEN, "libunbound returned %d status code with explanation: %s and errno: %s\n", retval, ub_strerror(retval), strerror(errno));
 		log_message(strbuff);
-
-		return false;
+		ub_ctx_delete(ctx);
+		return NULL;
 	}
 
 	//read public keys for DNSSEC verification
@@ -93,23 +133,66 @@ static bool resolve_key(uint32_t *offset) {
 		log_message("dnsmagic: libunbound: adding keys failed");
 		snprintf(strbuff, BUFFSIZE_DNSMAGIC_ERRSTRLEN, "libunbound returned %d status code with explanation: %s\n", retval, ub_strerror(retval));
 		log_message(strbuff);
-		return false;
+		ub_ctx_delete(ctx);
+		return NULL;
 	}
 
-	retval = ub_resolve(ctx, DEFAULT_DNS_RECORD_FIND_KEY, TYPE_TXT, CLASS_INET, &result);
+	//Resolve in background thread; query continues between library calls
+	retval = ub_ctx_async(ctx, 1);
 	if (retval != 0) {
-		log_message("dnsmagic: libunbound: resolve error");
+		log_message("dnsmagic: libunbound: set async mode failed");
 		snprintf(strbuff, BUFFSIZE_DNSMAGIC_ERRSTRLEN, "libunbound returned %d status code with explanation: %s\n", retval, ub_strerror(retval));
 		log_message(strbuff);
 		ub_ctx_delete(ctx);
-		return false;
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/*
+ * Get decimal number from its string representation
+ */
+static uint32_t number_from_string(size_t len, char *str) {
+	uint32_t res = 0;
+	unsigned char digit = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		digit = str[i] - '0';
+		res *= 10;
+		res += digit;
+	}
+
+	return res;
+}
+
+/*
+ * Store answer of asynchronous query; shared_ctx_mutex has to be locked
+ */
+static void query_answer(int err, struct ub_result *result) {
+	char strbuff[BUFFSIZE_DNSMAGIC_ERRSTRLEN];
+
+	query.pending = false;
+
+	//Failed refresh doesn't replace answer that is still valid
+	if (!(query.done && query.ok)) {
+		query.done = true;
+		query.ok = false;
+	}
+
+	if (err != 0) {
+		log_message("dnsmagic: libunbound: resolve error");
+		snprintf(strbuff, BUFFSIZE_DNSMAGIC_ERRSTRLEN, "libunbound returned %d status code with explanation: %s\n", err, ub_strerror(err));
+		log_message(strbuff);
+		return;
 	}
 
 	if (result->havedata && result->secure) {
-		*offset = (unsigned char) number_from_string(result->data[0][0], (result->data[0] + 1));
-		ub_resolve_free(result);
-		ub_ctx_delete(ctx);
-		return true;
+		query.offset = (unsigned char) number_from_string(result->data[0][0], (result->data[0] + 1));
+		query.ttl = result->ttl;
+		query.answered = time(NULL);
+		query.done = true;
+		query.ok = true;
 	}
 
 	if (!result->havedata) {
@@ -121,32 +204,368 @@ static bool resolve_key(uint32_t *offset) {
 	}
 
 	ub_resolve_free(result);
-	ub_ctx_delete(ctx);
+}
 
-	return false;
+/*
+ * Callback of asynchronous query; it's called from ub_process()
+ */
+static void resolve_callback(void *data, int err, struct ub_result *result) {
+	(void) data;
+
+	pthread_mutex_lock(&shared_ctx_mutex);
+	query_answer(err, result);
+	pthread_mutex_unlock(&shared_ctx_mutex);
 }
 
-unsigned char atsha_find_slot_number(struct atsha_handle *handle) {
-	if (handle->is_srv_emulation == true) {
-		return handle->slot_id;
+/*
+ * Start query if there isn't one running already
+ */
+static bool query_start() {
+	int retval;
+	char strbuff[BUFFSIZE_DNSMAGIC_ERRSTRLEN];
+
+	if (query.pending) return true;
+
+	if (shared_ctx == NULL) {
+		shared_ctx = dns_ctx_create();
+		if (shared_ctx == NULL) return false;
+	}
+
+	retval = ub_resolve_async(shared_ctx, DEFAULT_DNS_RECORD_FIND_KEY, TYPE_TXT, CLASS_INET, NULL, resolve_callback, &query.id);
+	if (retval != 0) {
+		log_message("dnsmagic: libunbound: resolve error");
+		snprintf(strbuff, BUFFSIZE_DNSMAGIC_ERRSTRLEN, "libunbound returned %d status code with explanation: %s\n", retval, ub_strerror(retval));
+		log_message(strbuff);
+		return false;
+	}
+
+	query.pending = true;
+
+	return true;
+}
+
+/*
+ * Remaining TTL of the answer in seconds; shared_ctx_mutex has to be locked
+ */
+static int answer_ttl() {
+	return query.ttl - (int)(time(NULL) - query.answered);
+}
+
+/*
+ * Is there query without answer yet?
+ */
+static bool query_running() {
+	pthread_mutex_lock(&shared_ctx_mutex);
+	bool running = query.pending;
+	pthread_mutex_unlock(&shared_ctx_mutex);
+
+	return running;
+}
+
+/*
+ * Process answers of running query; wait for it at most timeout milliseconds
+ *
+ * It's called without shared_ctx_mutex, so other threads aren't blocked by
+ * the wait. Caller holds reference of the context.
+ */
+static void query_wait(struct ub_ctx *ctx, int timeout) {
+	uint64_t deadline = monotonic_time_us() + (uint64_t)timeout * 1000;
+
+	while (query_running()) {
+		if (ub_poll(ctx)) {
+			ub_process(ctx);
+			continue;
+		}
+
+		uint64_t now = monotonic_time_us();
+		if (now >= deadline) break;
+
+		struct pollfd pfd = { .fd = ub_fd(ctx), .events = POLLIN };
+		int retval = poll(&pfd, 1, (int)((deadline - now + 999) / 1000));
+		if (retval == -1 && errno != EINTR) break;
+		if (retval > 0) ub_process(ctx);
 	}
+}
 
+/*
+ * Use linunbound for DNS resolving of TXT record
+ *
+ * Valid answer is returned at once; a new query is started when there is no
+ * answer or when it is going to expire. Answer of new query is waited for at
+ * most timeout milliseconds. Unanswered query keeps running in background and
+ * its answer is picked up by next call of the process.
+ */
+static bool resolve_key(uint32_t *offset, int *ttl, int timeout) {
+	bool ok = false;
+
+	pthread_mutex_lock(&shared_ctx_mutex);
+
+	//Failed or expired answer is dropped
+	if (query.done && (!query.ok || answer_ttl() < 0)) {
+		query.done = false;
+	}
+
+	if ((!query.done || answer_ttl() <= DNS_CACHE_REFRESH_AHEAD) && query_start()) {
+		//Refresh of valid answer isn't waited for
+		int wait = query.done ? 0 : timeout;
+
+		//Context isn't deleted while it is used without the mutex
+		struct ub_ctx *ctx = shared_ctx;
+		shared_ctx_refs++;
+		pthread_mutex_unlock(&shared_ctx_mutex);
+
+		query_wait(ctx, wait);
+
+		pthread_mutex_lock(&shared_ctx_mutex);
+		ctx_unref();
+	}
+
+	if (query.done && (!query.ok || answer_ttl() >= 0)) {
+		ok = query.ok;
+		*offset = query.offset;
+		*ttl = answer_ttl();
+	} else if (query.pending && timeout > 0) {
+		log_message("dnsmagic: libunbound: no answer in time");
+	}
+
+	pthread_mutex_unlock(&shared_ctx_mutex);
+
+	return ok;
+}
+
+#endif //DEFAULT_DNS_PINNED_OFFSET
+
+/*
+ * Content of cache file shared by all processes
+ *
+ * Only offset of DNS record is kept; key origin belongs to the chip and it's
+ * read from zone snapshot of the instance.
+ */
+struct dns_cache {
+	bool writable;
+	bool offset_valid;
 	uint32_t offset;
-	if (!resolve_key(&offset)) {
-		return DNS_ERR_CONST;
+	time_t expires;
+};
+
+/*
+ * Load cache file; missing or malformed records are just ignored
+ *
+ * Format of the file is:
+ * offset <offset> <expiration as unix time>
+ */
+static struct dns_cache *cache_load() {
+	char line[BUFFSIZE_LINE];
+	unsigned int number;
+	long long expires;
+
+	struct dns_cache *cache = (struct dns_cache *)calloc(1, sizeof(struct dns_cache));
+	if (cache == NULL) return NULL;
+	cache->writable = true;
+
+	FILE *file = fopen(DNS_CACHE_FILE, "r");
+	if (file == NULL) return cache;
+
+	while (fgets(line, BUFFSIZE_LINE, file) != NULL) {
+		if (sscanf(line, "offset %u %lld", &number, &expires) == 2) {
+			cache->offset_valid = true;
+			cache->offset = number;
+			cache->expires = (time_t)expires;
+		}
+	}
+
+	fclose(file);
+
+	return cache;
+}
+
+/*
+ * Replace cache file atomically - readers see the old or the new one
+ *
+ * Unprivileged user usually can't write to the directory; the cache is kept
+ * only in memory then and nothing is reported.
+ */
+static void cache_store(struct dns_cache *cache) {
+	char tmp_path[BUFFSIZE_LINE];
+	snprintf(tmp_path, BUFFSIZE_LINE, "%s.XXXXXX", DNS_CACHE_FILE);
+
+	if (!cache->writable) return;
+
+	int fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		cache->writable = false;
+		if (errno != EACCES && errno != EPERM && errno != EROFS) {
+			log_message("dnsmagic: cache_store: couldn't create cache file");
+		}
+		return;
+	}
+	fchmod(fd, 0644);
+
+	FILE *file = fdopen(fd, "w");
+	if (file == NULL) {
+		close(fd);
+		unlink(tmp_path);
+		log_message("dnsmagic: cache_store: couldn't open cache file");
+		return;
+	}
+
+	if (cache->offset_valid) {
+		fprintf(file, "offset %u %lld\n", (unsigned int)cache->offset, (long long)cache->expires);
+	}
+
+	if (fclose(file) != 0 || rename(tmp_path, DNS_CACHE_FILE) != 0) {
+		unlink(tmp_path);
+		log_message("dnsmagic: cache_store: couldn't write cache file");
 	}
+}
+
+#ifndef DEFAULT_DNS_PINNED_OFFSET
+/*
+ * Store fresh offset to cache
+ */
+static void cache_offset(struct dns_cache *cache, uint32_t offset, int ttl, time_t now, bool *cache_changed) {
+	if (ttl <= 0) return;
+	if (ttl > DNS_CACHE_TTL_MAX) ttl = DNS_CACHE_TTL_MAX;
+	if (cache->offset_valid && cache->offset == offset && cache->expires == now + ttl) return;
+
+	cache->offset_valid = true;
+	cache->offset = offset;
+	cache->expires = now + ttl;
+	*cache_changed = true;
+}
+#endif
 
-	if (!handle->key_origin_cached) {
-		atsha_big_int number;
-		if (atsha_raw_otp_read(handle, ATSHA204_OTP_MEMORY_MAP_ORIGIN_KEY_SET, &number) != ATSHA_ERR_OK) {
-			log_message("dnsmagic: find_slot_number: read key origin from OTP memory");
+/*
+ * Get offset from pinned value, from cache or from DNS
+ *
+ * Record that is going to expire soon is refreshed in background. The
+ * refresh is picked up only by later calls of the same process, so it works
+ * in long-running processes; short-lived ones wait for DNS when the record
+ * expires. Expired record is used when DNS doesn't answer in time
+ * (serve-stale).
+ */
+static bool find_offset(struct dns_cache *cache, uint32_t *offset, bool *cache_changed) {
+#ifdef DEFAULT_DNS_PINNED_OFFSET
+	(void) cache;
+	(void) cache_changed;
+	*offset = DEFAULT_DNS_PINNED_OFFSET;
+	return true;
+#else
+	time_t now = time(NULL);
+	uint32_t fresh_offset;
+	int ttl;
+
+	//Expiration too far in the future means that the clock was changed
+	bool cache_sane = cache->offset_valid && (cache->expires - now) <= DNS_CACHE_TTL_MAX;
+
+	if (cache_sane && now < cache->expires) {
+		//Refresh ahead; answer isn't waited for
+		if ((cache->expires - now) <= DNS_CACHE_REFRESH_AHEAD && resolve_key(&fresh_offset, &ttl, 0)) {
+			cache_offset(cache, fresh_offset, ttl, now, cache_changed);
+		}
+
+		*offset = cache->offset;
+		return true;
+	}
+
+	bool stale_usable = cache_sane && (now - cache->expires) <= DNS_CACHE_STALE_MAX;
+
+	//Expired record is served at once when some previous call has already waited for DNS
+	int timeout = (stale_usable && query_running()) ? 0 : DNS_RESOLVE_TOUT;
+	//Deadline of the call limits the wait too; round up so it is really reached
+	timeout = (call_time_left((uint64_t)timeout * 1000) + 999) / 1000;
+
+	if (resolve_key(&fresh_offset, &ttl, timeout)) {
+		cache_offset(cache, fresh_offset, ttl, now, cache_changed);
+		*offset = fresh_offset;
+		return true;
+	}
+
+	if (stale_usable) {
+		log_message("dnsmagic: find_offset: DNS failed, expired offset is used");
+		*offset = cache->offset;
+		return true;
+	}
+
+	return false;
+#endif
+}
+
+/*
+ * Get hexadecimal representation of chip serial number
+ */
+/*
+ * Get key origin of the chip; zone snapshot serves it without the bus when
+ * the chip is locked. Bus of the instance has to be locked.
+ */
+static bool find_chip_key_origin(struct atsha_handle *handle) {
+	if (handle->key_origin_cached) return true;
+
+	atsha_big_int number;
+	if (atsha_raw_otp_read(handle, ATSHA204_OTP_MEMORY_MAP_ORIGIN_KEY_SET, &number) != ATSHA_ERR_OK) {
+		log_message("dnsmagic: find_slot_number: read key origin from OTP memory");
+		return false;
+	}
+
+	handle->key_origin = uint32_from_4_bytes(number.data);
+	handle->key_origin_cached = true;
+
+	return true;
+}
+
+/*
+ * State of the instance is used under its bus lock; DNS is waited for without it
+ */
+static unsigned char find_slot_number(struct atsha_handle *handle) {
+	bool offset_changed = false;
+	struct dns_cache offset_cache;
+	uint32_t key_origin;
+
+	if (bus_lock(handle) != ATSHA_ERR_OK) return DNS_ERR_CONST;
+
+	//Cache file is read only once per instance
+	if (handle->dns_cache == NULL) {
+		handle->dns_cache = cache_load();
+		if (handle->dns_cache == NULL) {
+			log_message("dnsmagic: find_slot_number: memory allocation error");
+			bus_unlock(handle);
 			return DNS_ERR_CONST;
 		}
+	}
 
-		handle->key_origin = uint32_from_4_bytes(number.data);
-		handle->key_origin_cached = true;
+	if (!find_chip_key_origin(handle)) {
+		bus_unlock(handle);
+		return DNS_ERR_CONST;
+	}
+	key_origin = handle->key_origin;
+	offset_cache = *handle->dns_cache;
+
+	bus_unlock(handle);
+
+	uint32_t offset;
+	bool offset_found = find_offset(&offset_cache, &offset, &offset_changed);
+
+	if (offset_changed && bus_lock(handle) == ATSHA_ERR_OK) {
+		handle->dns_cache->offset_valid = offset_cache.offset_valid;
+		handle->dns_cache->offset = offset_cache.offset;
+		handle->dns_cache->expires = offset_cache.expires;
+		cache_store(handle->dns_cache);
+		bus_unlock(handle);
+	}
+
+	if (!offset_found) return DNS_ERR_CONST;
+
+	return (unsigned char)(offset - key_origin);
+}
+
+unsigned char atsha_find_slot_number(struct atsha_handle *handle) {
+	if (handle->is_srv_emulation == true) {
+		return handle->slot_id;
 	}
 
+	call_begin(handle);
+	unsigned char slot_number = find_slot_number(handle);
+	call_end();
 
-	return (unsigned char)(offset - handle->key_origin);
+	return slot_number;
 }
@@ -0,0 +1,40 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DNSMAGIC_H
+#define DNSMAGIC_H
+
+/**
+ * \file dnsmagic.h
+ * \brief Resolving of key origin offset
+ */
+
+/**
+ * \brief Take reference of resolver context shared by all library instances
+ *
+ * The context is created with the first lookup and kept until the last
+ * reference is released. libunbound cache survives between lookups.
+ */
+void dns_ctx_acquire();
+/**
+ * \brief Release reference of shared resolver context
+ */
+void dns_ctx_release();
+
+#endif //DNSMAGIC_H
@@ -17,12 +17,20 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
-#include <openssl/hmac.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include "atsha204.h"
 #include "atsha204consts.h"
@@ -31,6 +39,7 @@
 #include "operations.h"
 #include "tools.h"
 #include "api.h"
+#include "emulation.h"
 
 extern atsha_configuration g_config;
 
@@ -38,70 +47,120 @@ static const size_t POSITION_OPCODE = 1;
 static const size_t POSITION_PARAM1 = 2;
 static const size_t POSITION_ADDRESS = 3;
 
-static int emul_nonce(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
+static int emul_nonce(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
 	memcpy(handle->nonce, (raw_packet + 5), ATSHA204_SLOT_BYTE_LEN);
 
 	unsigned char data[1];
 	data[0] = ATSHA204_STATUS_SUCCES;
-	*answer = generate_answer_packet(data, 1);
-	if (*answer == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	generate_answer_packet(answer, data, 1);
 
 	return ATSHA_ERR_OK;
 }
 
-static int emul_hmac(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
-	unsigned char output[32];
+/*
+ * Key of the slot; server-side emulation has only one key
+ */
+static const unsigned char *emul_key(const struct atsha_handle *handle, unsigned char slot_number) {
+	if (handle->is_srv_emulation) return handle->key;
+
+	if (slot_number >= EMUL_SLOTS) {
+		log_message("emulation: emul_key: Slot number out of range");
+		return NULL;
+	}
+
+	return handle->image->slot[slot_number];
+}
+
+/*
+ * SHA256 implementation is fetched only once; OpenSSL 3 looks it up in each
+ * digest otherwise
+ */
+static EVP_MD *sha256_md = NULL;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void sha256_fetch() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+#endif
+}
+
+static const EVP_MD *sha256() {
+	pthread_once(&sha256_once, sha256_fetch);
+
+	return (sha256_md != NULL) ? sha256_md : EVP_sha256();
+}
+
+/*
+ * SHA256 of concatenation of two buffers; digest could be the second one
+ */
+static bool sha256_concat(EVP_MD_CTX *ctx, const unsigned char *first, size_t first_len, const unsigned char *second, size_t second_len, unsigned char *digest) {
+	return EVP_DigestInit_ex(ctx, sha256(), NULL) &&
+		EVP_DigestUpdate(ctx, first, first_len) &&
+		EVP_DigestUpdate(ctx, second, second_len) &&
+		EVP_DigestFinal_ex(ctx, digest, NULL);
+}
+
+/*
+ * HMAC-SHA256 keyed by 32 bytes key of a slot. It is composed of SHA256
+ * digests; generic HMAC() of OpenSSL costs several times more than the
+ * hashing itself.
+ */
+static bool hmac_sha256(const unsigned char *key, const unsigned char *message, size_t message_len, unsigned char *digest) {
+	unsigned char pad[SHA256_CBLOCK];
+	bool ok;
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	if (ctx == NULL) return false;
+
+	//Key shorter than block is padded by zeros
+	memset(pad, 0x36, SHA256_CBLOCK);
+	for (size_t i = 0; i < ATSHA204_SLOT_BYTE_LEN; i++) pad[i] ^= key[i];
+	ok = sha256_concat(ctx, pad, SHA256_CBLOCK, message, message_len, digest);
+
+	memset(pad, 0x5C, SHA256_CBLOCK);
+	for (size_t i = 0; i < ATSHA204_SLOT_BYTE_LEN; i++) pad[i] ^= key[i];
+	ok = ok && sha256_concat(ctx, pad, SHA256_CBLOCK, digest, SHA256_DIGEST_LENGTH, digest);
+
+	EVP_MD_CTX_free(ctx);
+
+	return ok;
+}
+
+/*
+ * Digest of HMAC or MAC command. HMAC digests TempKey (challenge stored by
+ * Nonce command) keyed by the slot; MAC digests the key and the challenge.
+ * Serial number is used only if mode requests it.
+ */
+static int emul_digest(const unsigned char *key, const unsigned char *sn, unsigned char opcode, unsigned char mode, unsigned char slot_number, const unsigned char *challenge, unsigned char *digest) {
 	size_t message_len = 32+32+1+1+2+8+3+1+4+2+2; //88
 	unsigned char message[message_len];
 
 	bool use_sn;
 	if (USE_OUR_SN) {
-		if ((raw_packet[POSITION_PARAM1] & 0x20) == 0) {
-			use_sn = false;
-		} else {
-			use_sn = true;
-		}
+		use_sn = (mode & 0x20) != 0;
 	} else {
-		if ((raw_packet[POSITION_PARAM1] & 0x40) == 0) {
-			use_sn = false;
-		} else {
-			use_sn = true;
-		}
+		use_sn = (mode & 0x40) != 0;
 	}
 	//Start of message
 	//////////////////
-	for (size_t i = 0; i < 32; i++) {
-		message[i] = 0;
+	if (opcode == ATSHA204_OPCODE_HMAC) {
+		memset(message, 0, 32);
+	} else {
+		memcpy(message, key, 32);
 	}
 	//////////////////
-	for (size_t i = 32; i < 64; i++) {
-		message[i] = handle->nonce[i-32];
-	}
+	memcpy(message + 32, challenge, 32);
 	//////////////////
-	message[64] = ATSHA204_OPCODE_HMAC; //opcode
-	message[65] = raw_packet[POSITION_PARAM1]; //mode
-	message[66] = raw_packet[POSITION_PARAM1 + 1]; //param2 alias slotID
-	message[67] = raw_packet[POSITION_PARAM1 + 2]; //param2 alias slotID
+	message[64] = opcode;
+	message[65] = mode;
+	message[66] = slot_number; //param2 alias slotID
+	message[67] = 0x00;
 	//////////////////
 	//8bytes OTP[0:7]
 	if (USE_OUR_SN && use_sn) {
-		message[68] = handle->sn[0];
-		message[69] = handle->sn[1];
-		message[70] = handle->sn[2];
-		message[71] = handle->sn[3];
-		message[72] = handle->sn[4];
-		message[73] = handle->sn[5];
-		message[74] = handle->sn[6];
-		message[75] = handle->sn[7];
+		memcpy(message + 68, sn, 8);
 	} else {
-		message[68] = 0x00;
-		message[69] = 0x00;
-		message[70] = 0x00;
-		message[71] = 0x00;
-		message[72] = 0x00;
-		message[73] = 0x00;
-		message[74] = 0x00;
-		message[75] = 0x00;
+		memset(message + 68, 0, 8);
 	}
 	//////////////////
 	message[76] = 0x00; //8bytes OTP[8:10] - we will never use it!!
@@ -111,23 +170,17 @@ static int emul_hmac(struct atsha_handle *handle, unsigned char *raw_packet, uns
 	message[79] = 0xEE;
 	//////////////////
 	if (!USE_OUR_SN && use_sn) {
-		message[80] = handle->sn[4];
-		message[81] = handle->sn[5];
-		message[82] = handle->sn[6];
-		message[83] = handle->sn[7];
+		memcpy(message + 80, sn + 4, 4);
 	} else {
-		message[80] = 0x00;
-		message[81] = 0x00;
-		message[82] = 0x00;
-		message[83] = 0x00;
+		memset(message + 80, 0, 4);
 	}
 	//////////////////
 	message[84] = 0x01;
 	message[85] = 0x23;
 	//////////////////
 	if (!USE_OUR_SN && use_sn) {
-		message[86] = handle->sn[2];
-		message[87] = handle->sn[3];
+		message[86] = sn[2];
+		message[87] = sn[3];
 	} else {
 		message[86] = 0x00;
 		message[87] = 0x00;
@@ -135,133 +188,70 @@ static int emul_hmac(struct atsha_handle *handle, unsigned char *raw_packet, uns
 	//////////////////
 	//End of message
 
-	atsha_big_int key;
-	if (atsha_raw_slot_read(handle, raw_packet[POSITION_PARAM1+1], &key) != ATSHA_ERR_OK) {
-		log_message("emulation: emul_hmac: Bad status code: atsha_low_slot_read");
-		return ATSHA_ERR_BAD_COMMUNICATION_STATUS;
+	if (opcode == ATSHA204_OPCODE_HMAC) {
+		if (!hmac_sha256(key, message, message_len, digest)) {
+			log_message("emulation: emul_digest: Bad status code: HMAC (libopenssl)");
+			return ATSHA_ERR_BAD_COMMUNICATION_STATUS;
+		}
+	} else {
+		if (!EVP_Digest(message, message_len, digest, NULL, sha256(), NULL)) {
+			log_message("emulation: emul_digest: Bad status code: SHA256 (libopenssl)");
+			return ATSHA_ERR_BAD_COMMUNICATION_STATUS;
+		}
 	}
 
-	unsigned int ret_len;
-	unsigned char *ret_status;
-	ret_status = HMAC(EVP_sha256(), key.data, key.bytes, message, message_len, output, &ret_len);
+	return ATSHA_ERR_OK;
+}
 
-	if (ret_status == NULL || ret_len != 32) {
-		log_message("emulation: emul_hmac: Bad status code: HMAC (libopenssl)");
-		return ATSHA_ERR_BAD_COMMUNICATION_STATUS;
-	}
+/*
+ * Digest of HMAC or MAC command computed by emulated device of the handle
+ */
+static int emul_handle_digest(const struct atsha_handle *handle, unsigned char opcode, unsigned char mode, unsigned char slot_number, const unsigned char *challenge, unsigned char *digest) {
+	const unsigned char *key = emul_key(handle, slot_number);
+	if (key == NULL) return ATSHA_ERR_INVALID_INPUT;
+
+	return emul_digest(key, handle->sn, opcode, mode, slot_number, challenge, digest);
+}
+
+static int emul_hmac(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
+	unsigned char output[32];
 
-	(*answer) = generate_answer_packet(output, 32);
-	if ((*answer) == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	int status = emul_handle_digest(handle, ATSHA204_OPCODE_HMAC, raw_packet[POSITION_PARAM1], raw_packet[POSITION_ADDRESS], handle->nonce, output);
+	if (status != ATSHA_ERR_OK) return status;
+
+	generate_answer_packet(answer, output, 32);
 
 	return ATSHA_ERR_OK;
 }
 
-static int emul_mac(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
+static int emul_mac(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
 	unsigned char output[32];
-	size_t message_len = 32+32+1+1+2+8+3+1+4+2+2; //88
-	unsigned char message[message_len];
 
-	atsha_big_int key;
-	if (atsha_raw_slot_read(handle, raw_packet[POSITION_PARAM1+1], &key) != ATSHA_ERR_OK) {
-		log_message("emulation: emul_mac: Bad status code: atsha_low_slot_read");
-		return ATSHA_ERR_BAD_COMMUNICATION_STATUS;
-	}
+	int status = emul_handle_digest(handle, ATSHA204_OPCODE_MAC, raw_packet[POSITION_PARAM1], raw_packet[POSITION_ADDRESS], raw_packet + 5, output);
+	if (status != ATSHA_ERR_OK) return status;
 
-	bool use_sn;
-	if (USE_OUR_SN) {
-		if ((raw_packet[POSITION_PARAM1] & 0x20) == 0) {
-			use_sn = false;
-		} else {
-			use_sn = true;
-		}
-	} else {
-		if ((raw_packet[POSITION_PARAM1] & 0x40) == 0) {
-			use_sn = false;
-		} else {
-			use_sn = true;
-		}
-	}
-	//Start of message
-	//////////////////
-	for (size_t i = 0; i < 32; i++) {
-		message[i] = key.data[i];
-	}
-	//////////////////
-	for (size_t i = 32; i < 64; i++) {
-		message[i] = raw_packet[i-32+5]; //+1 == skip count parameter
-	}
-	//////////////////
-	message[64] = ATSHA204_OPCODE_MAC; //opcode
-	message[65] = raw_packet[POSITION_PARAM1]; //mode
-	message[66] = raw_packet[POSITION_PARAM1 + 1]; //param2 alias slotID
-	message[67] = raw_packet[POSITION_PARAM1 + 2]; //param2 alias slotID
-	//////////////////
-	//8bytes OTP[0:7]
-	if (USE_OUR_SN && use_sn) {
-		message[68] = handle->sn[0];
-		message[69] = handle->sn[1];
-		message[70] = handle->sn[2];
-		message[71] = handle->sn[3];
-		message[72] = handle->sn[4];
-		message[73] = handle->sn[5];
-		message[74] = handle->sn[6];
-		message[75] = handle->sn[7];
-	} else {
-		message[68] = 0x00;
-		message[69] = 0x00;
-		message[70] = 0x00;
-		message[71] = 0x00;
-		message[72] = 0x00;
-		message[73] = 0x00;
-		message[74] = 0x00;
-		message[75] = 0x00;
-	}
-	//////////////////
-	message[76] = 0x00; //8bytes OTP[8:10] - we will never use it!!
-	message[77] = 0x00;
-	message[78] = 0x00;
-	//////////////////
-	message[79] = 0xEE;
-	//////////////////
-	if (!USE_OUR_SN && use_sn) {
-		message[80] = handle->sn[4];
-		message[81] = handle->sn[5];
-		message[82] = handle->sn[6];
-		message[83] = handle->sn[7];
-	} else {
-		message[80] = 0x00;
-		message[81] = 0x00;
-		message[82] = 0x00;
-		message[83] = 0x00;
-	}
-	//////////////////
-	message[84] = 0x01;
-	message[85] = 0x23;
-	//////////////////
-	if (!USE_OUR_SN && use_sn) {
-		message[86] = handle->sn[2];
-		message[87] = handle->sn[3];
-	} else {
-		message[86] = 0x00;
-		message[87] = 0x00;
-	}
-	//////////////////
-	//End of message
+	generate_answer_packet(answer, output, 32);
 
-	unsigned char *ret_status;
-	ret_status = SHA256(message, message_len, output);
-	if (ret_status == NULL) {
-		log_message("emulation: emul_mac: Bad status code: SHA256 (libopenssl)");
-		return ATSHA_ERR_BAD_COMMUNICATION_STATUS;
-	}
+	return ATSHA_ERR_OK;
+}
 
-	(*answer) = generate_answer_packet(output, 32);
-	if ((*answer) == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+int emul_challenge_response(const struct atsha_handle *handle, unsigned char slot_number, const unsigned char *challenge, bool use_sn_in_digest, unsigned char *response) {
+	return emul_handle_digest(handle, ATSHA204_OPCODE_HMAC, op_hmac_mode(use_sn_in_digest), slot_number, challenge, response);
+}
 
-	return ATSHA_ERR_OK;
+int emul_challenge_response_mac(const struct atsha_handle *handle, unsigned char slot_number, const unsigned char *challenge, bool use_sn_in_digest, unsigned char *response) {
+	return emul_handle_digest(handle, ATSHA204_OPCODE_MAC, op_mac_mode(use_sn_in_digest), slot_number, challenge, response);
+}
+
+int emul_response(const unsigned char *key, const unsigned char *sn, unsigned char slot_number, const unsigned char *challenge, unsigned char mode, bool use_sn_in_digest, unsigned char *response) {
+	if (mode == ATSHA_CHALLENGE_MAC) {
+		return emul_digest(key, sn, ATSHA204_OPCODE_MAC, op_mac_mode(use_sn_in_digest), slot_number, challenge, response);
+	}
+
+	return emul_digest(key, sn, ATSHA204_OPCODE_HMAC, op_hmac_mode(use_sn_in_digest), slot_number, challenge, response);
 }
 
-static int emul_random(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
+static int emul_random(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
 	(void) raw_packet;
 	(void) handle;
 
@@ -272,187 +262,238 @@ static int emul_random(struct atsha_handle *handle, unsigned char *raw_packet, u
 		0x8D, 0x23, 0xEE, 0xC4, 0x04, 0xF3, 0xC4, 0x14
 	};
 
-	(*answer) = generate_answer_packet(data, ATSHA204_SLOT_BYTE_LEN);
-	if ((*answer) == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	generate_answer_packet(answer, data, ATSHA204_SLOT_BYTE_LEN);
 
 	return ATSHA_ERR_OK;
 }
 
-static int emul_read(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
-	char line[BUFFSIZE_LINE];
-	char *line_p = line;
-
+static int emul_read(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
 	//Decide if user try to read SN or data
 	unsigned char read_from = raw_packet[POSITION_PARAM1] & 0x3;
+	unsigned char address = raw_packet[POSITION_ADDRESS];
 
 	if (read_from == IO_MEM_CONFIG) {
 		//User want serial number
 
 		//Operation read supports only reading SN from config memory
-		if (raw_packet[POSITION_ADDRESS] != 0x00) {
+		if (address != 0x00) {
 			log_message("emulation: emul_read: Reading only 0x00 address from config zone is allowed");
 			return ATSHA_ERR_NOT_IMPLEMENTED;
 		}
 
 		//Prepare memory for reading operation
-		size_t sn_in_memory_len = ATSHA204_SN_BYTE_LEN + 4;
 		unsigned char SN[ATSHA204_SLOT_BYTE_LEN]; //this is much more memory, but higher layers want it
 		clear_buffer(SN, ATSHA204_SLOT_BYTE_LEN);
 
 		if (handle->is_srv_emulation) {
-			SN[0] = handle->sn[0]; SN[1] = handle->sn[1]; SN[2] = handle->sn[2];
-			SN[3] = handle->sn[3]; SN[8] = handle->sn[4]; SN[9] = handle->sn[5];
-			SN[10] = handle->sn[6]; SN[11] = handle->sn[7]; SN[12] = handle->sn[8];
+			//Make "virtual" hole in answer
+			memcpy(SN, handle->sn, 4);
+			memcpy(SN + 8, handle->sn + 4, ATSHA204_SN_BYTE_LEN - 4);
 		} else {
-			rewind(handle->file);
-			//Serial number is LAST line - skip all keys and OTP records
-			for (size_t i = 0; i < (2*16); i++) {
-				if (fgets(line, BUFFSIZE_LINE, handle->file) == NULL) {
-					log_message("emulation: emul_read: skip keys (bad file format)");
-					return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-				}
-			}
-
-			if (fgets(line, BUFFSIZE_LINE, handle->file) == NULL) {
-				log_message("emulation: emul_read: read SN (bad file format)");
-				return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-			}
-
-			char *line_end_p = (line_p + strlen(line_p));
-
-			size_t i = 0;
-			while (i < sn_in_memory_len) {
-				//Make "virtual" hole in answer
-				if ((i >= 4) && (i <= 7)) {
-					i++;
-					continue;
-				}
-				//skip delimiters
-				if (line_p[0] == ' ' || line_p[0] == '\t' || line_p[0] == ';' || line_p[0] == ',' || line_p[0] == ':') {
-					line_p++;
-					continue;
-				}
-				//Decode byte representation
-				SN[i++] = get_number_from_hex_char(line_p[0], line_p[1]);
-				line_p += 2;
-
-				if (line_p >= line_end_p) {
-					log_message("emulation: emul_read: read SN (input too short)");
-					return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-				}
-			}
+			memcpy(SN, handle->image->config, ATSHA204_SLOT_BYTE_LEN);
 		}
 
-		(*answer) = generate_answer_packet(SN, ATSHA204_SLOT_BYTE_LEN);
-		if ((*answer) == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+		generate_answer_packet(answer, SN, ATSHA204_SLOT_BYTE_LEN);
 
 	} else if (read_from == IO_MEM_DATA) {
 		//User want some slot data
 
+		//Adresses starts at multiples of 8
+		const unsigned char *key = emul_key(handle, address / 8);
+		if (key == NULL) return ATSHA_ERR_INVALID_INPUT;
+
+		generate_answer_packet(answer, key, ATSHA204_SLOT_BYTE_LEN);
+
+	} else if (read_from == IO_MEM_OTP) {
 		if (handle->is_srv_emulation) {
-			(*answer) = generate_answer_packet(handle->key, ATSHA204_SLOT_BYTE_LEN);
-			if ((*answer) == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+			log_message("emulation: emul_read: OTP zone not supporten in server emulation mode.");
+			return ATSHA_ERR_NOT_IMPLEMENTED;
 		} else {
-			rewind(handle->file);
-			//Adresses starts at multiples of 8
-			size_t skip_lines = (raw_packet[POSITION_ADDRESS] / 8);
-			for (size_t i = 0; i < skip_lines; i++) {
-				if (fgets(line, BUFFSIZE_LINE, handle->file) == NULL) {
-					log_message("emulation: emul_read: skip keys (bad file format)");
-					return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-				}
+			if (address >= EMUL_OTP_WORDS) {
+				log_message("emulation: emul_read: OTP address out of range");
+				return ATSHA_ERR_INVALID_INPUT;
 			}
 
-			//On next line is key that user want
-			if (fgets(line, BUFFSIZE_LINE, handle->file) == NULL) {
-				log_message("emulation: emul_read: read requested key (bad file format)");
-				return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-			}
+			generate_answer_packet(answer, handle->image->otp[address], ATSHA204_OTP_BYTE_LEN);
+		}
+	} else {
+		log_message("emulation: emul_read: Unknown memory type to read.");
+		return ATSHA_ERR_NOT_IMPLEMENTED;
+	}
+
+	return ATSHA_ERR_OK;
+}
 
-			char *line_end_p = (line_p + strlen(line_p));
+/*
+ * Read one line of configuration file and decode exactly len bytes from it
+ */
+static bool image_line(FILE *file, unsigned char *data, size_t len) {
+	char line[BUFFSIZE_LINE];
 
-			unsigned char key[ATSHA204_SLOT_BYTE_LEN];
-			size_t i = 0;
-			while (i < ATSHA204_SLOT_BYTE_LEN) {
-				if (line_p[0] == ' ' || line_p[0] == '\t' || line_p[0] == ';' || line_p[0] == ',' || line_p[0] == ':') {
-					line_p++;
-					continue;
-				}
+	if (fgets(line, BUFFSIZE_LINE, file) == NULL) return false;
 
-				key[i++] = get_number_from_hex_char(line_p[0], line_p[1]);
-				line_p += 2;
+	return hex_decode(line, data, len, NULL);
+}
 
-				if (line_p >= line_end_p) {
-					log_message("emulation: emul_read: read key (input too short)");
-					return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-				 }
-			}
+int emul_image_load(const char *path, struct emul_image *image) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		log_message("emulation: emul_image_load: Couldn't open configuration file");
+		return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+	}
 
-			(*answer) = generate_answer_packet(key, ATSHA204_SLOT_BYTE_LEN);
-			if ((*answer) == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	int status = ATSHA_ERR_OK;
+	for (size_t i = 0; i < EMUL_SLOTS && status == ATSHA_ERR_OK; i++) {
+		if (!image_line(file, image->slot[i], ATSHA204_SLOT_BYTE_LEN)) {
+			log_message("emulation: emul_image_load: read key (bad file format)");
+			status = ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+		}
+	}
+	for (size_t i = 0; i < EMUL_OTP_WORDS && status == ATSHA_ERR_OK; i++) {
+		if (!image_line(file, image->otp[i], ATSHA204_OTP_BYTE_LEN)) {
+			log_message("emulation: emul_image_load: read OTP record (bad file format)");
+			status = ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
 		}
+	}
+	if (status == ATSHA_ERR_OK && !image_line(file, image->sn, ATSHA204_SN_BYTE_LEN)) {
+		log_message("emulation: emul_image_load: read SN (bad file format)");
+		status = ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+	}
 
-	} else if (read_from == IO_MEM_OTP) {
-		if (handle->is_srv_emulation) {
-			log_message("emulation: emul_read: OTP zone not supporten in server emulation mode.");
-			return ATSHA_ERR_NOT_IMPLEMENTED;
-		} else {
-			rewind(handle->file);
-
-			//Skip SN and All key slotss
-			for (size_t i = 0; i < 16; i++) {
-				if (fgets(line, BUFFSIZE_LINE, handle->file) == NULL) {
-					log_message("emulation: emul_read: skip keys (bad file format)");
-					return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-				}
-			}
+	fclose(file);
 
-			for (size_t i = 0; i < raw_packet[POSITION_ADDRESS]; i++) {
-				if (fgets(line, BUFFSIZE_LINE, handle->file) == NULL) {
-					log_message("emulation: emul_read: skip OTP records (bad file format)");
-					return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-				}
-			}
+	//Serial number is stored in config zone with a hole
+	memset(image->config, 0, ATSHA204_CONFIG_ZONE_BYTE_LEN);
+	memcpy(image->config, image->sn, 4);
+	memcpy(image->config + 8, image->sn + 4, ATSHA204_SN_BYTE_LEN - 4);
 
-			//On next line is key that user want
-			if (fgets(line, BUFFSIZE_LINE, handle->file) == NULL) {
-				log_message("emulation: emul_read: read requested OTP record (bad file format)");
-				return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-			}
+	return status;
+}
 
-			char *line_end_p = (line_p + strlen(line_p));
+static void put_le16(unsigned char *data, uint16_t value) {
+	data[0] = value & 0xFF;
+	data[1] = value >> 8;
+}
 
-			unsigned char data[ATSHA204_OTP_BYTE_LEN];
-			size_t i = 0;
-			while (i < ATSHA204_OTP_BYTE_LEN) {
-				if (line_p[0] == ' ' || line_p[0] == '\t' || line_p[0] == ';' || line_p[0] == ',' || line_p[0] == ':') {
-					line_p++;
-					continue;
-				}
+static void put_le32(unsigned char *data, uint32_t value) {
+	put_le16(data, value & 0xFFFF);
+	put_le16(data + 2, value >> 16);
+}
 
-				data[i++] = get_number_from_hex_char(line_p[0], line_p[1]);
-				line_p += 2;
+static uint32_t get_le32(const unsigned char *data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
 
-				if (line_p >= line_end_p) {
-					log_message("emulation: emul_read: read requested OTP record (input too short)");
-					return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
-				}
-			}
+/*
+ * Header of binary image; it is compared as a whole when image is opened
+ */
+static void image_header(const struct emul_image *image, unsigned char *header) {
+	memset(header, 0, EMUL_IMAGE_HEADER_LEN);
+	memcpy(header, EMUL_IMAGE_MAGIC, EMUL_IMAGE_MAGIC_LEN);
+	put_le16(header + 8, EMUL_IMAGE_VERSION);
+	put_le16(header + 10, EMUL_IMAGE_HEADER_LEN);
+	put_le32(header + 12, EMUL_IMAGE_HEADER_LEN + offsetof(struct emul_image, slot));
+	put_le32(header + 16, EMUL_IMAGE_HEADER_LEN + offsetof(struct emul_image, otp));
+	put_le32(header + 20, EMUL_IMAGE_HEADER_LEN + offsetof(struct emul_image, config));
+	put_le32(header + 24, EMUL_IMAGE_HEADER_LEN + offsetof(struct emul_image, sn));
+	calculate_crc(sizeof(struct emul_image), (const unsigned char *)image, header + 28);
+}
 
-			(*answer) = generate_answer_packet(data, ATSHA204_OTP_BYTE_LEN);
-			if ((*answer) == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
-		}
-	} else {
-		log_message("emulation: emul_read: Unknown memory type to read.");
-		return ATSHA_ERR_NOT_IMPLEMENTED;
+int emul_image_store(const char *path, const struct emul_image *image) {
+	unsigned char header[EMUL_IMAGE_HEADER_LEN];
+	image_header(image, header);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		log_message("emulation: emul_image_store: Couldn't create image file");
+		return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+	}
+
+	bool written = fwrite(header, EMUL_IMAGE_HEADER_LEN, 1, file) == 1 && fwrite(image, sizeof(struct emul_image), 1, file) == 1;
+	if (fclose(file) != 0 || !written) {
+		log_message("emulation: emul_image_store: Couldn't write image file");
+		return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+	}
+
+	return ATSHA_ERR_OK;
+}
+
+/*
+ * Map binary image read-only and check its header and CRC
+ */
+static int image_map(int fd, const struct emul_image **image) {
+	const size_t file_len = EMUL_IMAGE_HEADER_LEN + sizeof(struct emul_image);
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size != file_len) {
+		log_message("emulation: emul_image_open: Bad size of image file");
+		return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+	}
+
+	unsigned char *map = mmap(NULL, file_len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		log_message("emulation: emul_image_open: Couldn't map image file");
+		return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+	}
+
+	const struct emul_image *mapped = (const struct emul_image *)(map + EMUL_IMAGE_HEADER_LEN);
+	unsigned char header[EMUL_IMAGE_HEADER_LEN];
+	image_header(mapped, header);
+	if (memcmp(map, header, EMUL_IMAGE_HEADER_LEN) != 0) {
+		log_message((get_le32(map + 8) & 0xFFFF) != EMUL_IMAGE_VERSION ? "emulation: emul_image_open: Unsupported version of image file" : "emulation: emul_image_open: Corrupted image file");
+		munmap(map, file_len);
+		return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+	}
+
+	*image = mapped;
+
+	return ATSHA_ERR_OK;
+}
+
+int emul_image_open(const char *path, const struct emul_image **image, bool *mapped) {
+	char magic[EMUL_IMAGE_MAGIC_LEN];
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		log_message("emulation: emul_image_open: Couldn't open configuration file");
+		return ATSHA_ERR_CONFIG_FILE_BAD_FORMAT;
+	}
+
+	//Binary image is recognized by its magic; anything else is text configuration
+	if (read(fd, magic, EMUL_IMAGE_MAGIC_LEN) == EMUL_IMAGE_MAGIC_LEN && memcmp(magic, EMUL_IMAGE_MAGIC, EMUL_IMAGE_MAGIC_LEN) == 0) {
+		int status = image_map(fd, image);
+		close(fd);
+		*mapped = (status == ATSHA_ERR_OK);
+		return status;
+	}
+	close(fd);
+
+	struct emul_image *loaded = (struct emul_image *)malloc(sizeof(struct emul_image));
+	if (loaded == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+
+	int status = emul_image_load(path, loaded);
+	if (status != ATSHA_ERR_OK) {
+		free(loaded);
+		return status;
 	}
 
+	*image = loaded;
+	*mapped = false;
+
 	return ATSHA_ERR_OK;
 }
 
-int emul_command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
-	(*answer) = NULL; //Important init operation!!
+void emul_image_close(const struct emul_image *image, bool mapped) {
+	if (image == NULL) return;
 
+	if (mapped) {
+		munmap((unsigned char *)image - EMUL_IMAGE_HEADER_LEN, EMUL_IMAGE_HEADER_LEN + sizeof(struct emul_image));
+	} else {
+		free((struct emul_image *)image);
+	}
+}
+
+int emul_command(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
 	int status;
 	switch (raw_packet[POSITION_OPCODE]) {
 		case ATSHA204_OPCODE_HMAC:
@@ -483,3 +524,33 @@ int emul_command(struct atsha_handle *handle, unsigned char *raw_packet, unsigne
 
 	return status;
 }
+
+static int emul_transport_wake(void *ctx, unsigned char *answer) {
+	(void) ctx;
+	(void) answer;
+	return ATSHA_ERR_OK; //Wake is dummy in implementation. Always is successful.
+}
+
+static int emul_transport_idle(void *ctx) {
+	(void) ctx;
+	return ATSHA_ERR_OK; //Idle is dummy in implementation. Always is successful.
+}
+
+static int emul_transport_command(void *ctx, const unsigned char *raw_packet, unsigned char *answer) {
+	return emul_command((struct atsha_handle *)ctx, raw_packet, answer);
+}
+
+static void emul_transport_close(void *ctx) {
+	struct atsha_handle *handle = (struct atsha_handle *)ctx;
+
+	emul_image_close(handle->image, handle->image_mapped);
+}
+
+const atsha_transport TRANSPORT_EMULATION = {
+	.flags = ATSHA_TRANSPORT_RELIABLE,
+	.backoff = 0,
+	.wake = emul_transport_wake,
+	.idle = emul_transport_idle,
+	.command = emul_transport_command,
+	.close = emul_transport_close
+};
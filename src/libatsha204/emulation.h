@@ -22,6 +22,93 @@
 
 #include <stdbool.h>
 
-int emul_command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer);
+#include "atsha204.h"
+#include "atsha204consts.h"
+
+#define EMUL_SLOTS 16
+#define EMUL_OTP_WORDS 16
+
+/**
+ * \brief Content of emulated device
+ *
+ * Text configuration file has one line per item: keys of all slots, OTP
+ * words and serial number. Bytes are written in hex and they may be
+ * separated by delimiters.
+ *
+ * Binary image file starts with EMUL_IMAGE_HEADER_LEN bytes of header
+ * followed by this structure. Header contains EMUL_IMAGE_MAGIC,
+ * version (2 bytes), header length (2 bytes), offsets of slots, OTP,
+ * config zone and serial number (4 bytes each) and CRC of the structure
+ * (2 bytes, the same CRC as in packets). Numbers are little-endian. Binary
+ * image is mapped read-only, so processes emulating the same device share
+ * its memory.
+ */
+struct emul_image {
+	unsigned char slot[EMUL_SLOTS][ATSHA204_SLOT_BYTE_LEN]; ///<Keys of data slots
+	unsigned char otp[EMUL_OTP_WORDS][ATSHA204_OTP_BYTE_LEN]; ///<Words of OTP zone
+	unsigned char config[ATSHA204_CONFIG_ZONE_BYTE_LEN]; ///<Config zone; only serial number is filled from text file
+	unsigned char sn[ATSHA204_SN_BYTE_LEN]; ///<Serial number of the chip
+};
+
+#define EMUL_IMAGE_MAGIC "ATSHAEMU"
+#define EMUL_IMAGE_MAGIC_LEN 8
+#define EMUL_IMAGE_VERSION 1
+#define EMUL_IMAGE_HEADER_LEN 32
+
+/**
+ * \brief Parse text configuration file of emulated device
+ * \param path Path to configuration file
+ * \param [out] image Content of the device
+ * \return status code
+ */
+int emul_image_load(const char *path, struct emul_image *image);
+/**
+ * \brief Store content of emulated device as binary image
+ * \return status code
+ */
+int emul_image_store(const char *path, const struct emul_image *image);
+/**
+ * \brief Open content of emulated device from binary image or text configuration file
+ * \param [out] image Content of the device; release it by emul_image_close()
+ * \param [out] mapped Is the image mapped from binary file?
+ * \return status code
+ */
+int emul_image_open(const char *path, const struct emul_image **image, bool *mapped);
+/**
+ * \brief Release content of emulated device
+ */
+void emul_image_close(const struct emul_image *image, bool mapped);
+
+/**
+ * \brief Compute HMAC challenge-response of emulated device without packets
+ *
+ * Key is read directly from the device image; TempKey of the handle isn't changed.
+ * \param challenge 32 bytes of challenge
+ * \param [out] response 32 bytes of digest
+ * \return status code
+ */
+int emul_challenge_response(const struct atsha_handle *handle, unsigned char slot_number, const unsigned char *challenge, bool use_sn_in_digest, unsigned char *response);
+/**
+ * \brief Compute MAC challenge-response of emulated device without packets
+ * \param challenge 32 bytes of challenge
+ * \param [out] response 32 bytes of digest
+ * \return status code
+ */
+int emul_challenge_response_mac(const struct atsha_handle *handle, unsigned char slot_number, const unsigned char *challenge, bool use_sn_in_digest, unsigned char *response);
+/**
+ * \brief Compute response of a device from its key and serial number
+ *
+ * It doesn't need any instance of library nor allocate memory.
+ * \param sn Serial number as in server-side emulation
+ * \param challenge 32 bytes of challenge
+ * \param mode ATSHA_CHALLENGE_HMAC or ATSHA_CHALLENGE_MAC
+ * \param [out] response 32 bytes of digest
+ * \return status code
+ */
+int emul_response(const unsigned char *key, const unsigned char *sn, unsigned char slot_number, const unsigned char *challenge, unsigned char mode, bool use_sn_in_digest, unsigned char *response);
+
+int emul_command(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer);
+
+extern const atsha_transport TRANSPORT_EMULATION;
 
 #endif //EMULATION_H
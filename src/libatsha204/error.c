@@ -48,6 +48,18 @@ const char *atsha_error_name(int err) {
 		case ATSHA_ERR_WAKE_NOT_CONFIRMED:
 			return "Is not confirmed if device is wake up or not.";
 
+		case ATSHA_ERR_DEVICE_LOCK:
+			return "Device is locked by other process for too long.";
+
+		case ATSHA_ERR_DEVICE_UNAVAILABLE:
+			return "Device didn't respond repeatedly. Communication is refused for a while.";
+
+		case ATSHA_ERR_TIMEOUT:
+			return "Deadline of the call expired.";
+
+		case ATSHA_ERR_RESPONSE_MISMATCH:
+			return "Response doesn't match the expected one.";
+
 		default:
 			return "Error code is not in the list";
 	}
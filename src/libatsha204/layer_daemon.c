@@ -0,0 +1,224 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "atsha204.h"
+#include "atsha204consts.h"
+#include "configuration.h"
+#include "api.h"
+#include "layer_daemon.h"
+
+static bool daemon_write(int dev, const unsigned char *buff, size_t len) {
+	while (len > 0) {
+		ssize_t cnt = write(dev, buff, len);
+		if (cnt == -1 && errno == EINTR) continue;
+		if (cnt <= 0) return false;
+		buff += cnt;
+		len -= cnt;
+	}
+
+	return true;
+}
+
+static bool daemon_read(int dev, unsigned char *buff, size_t len) {
+	while (len > 0) {
+		ssize_t cnt = read(dev, buff, len);
+		if (cnt == -1 && errno == EINTR) continue;
+		if (cnt <= 0) return false;
+		buff += cnt;
+		len -= cnt;
+	}
+
+	return true;
+}
+
+/*
+ * Send request without waiting for its response
+ */
+static int daemon_send(int dev, unsigned char type, const unsigned char *payload, unsigned char len) {
+	unsigned char buff[DAEMON_MSG_HEADER_LEN + ATSHA204_IO_BUFFER];
+
+	buff[0] = type;
+	buff[1] = len;
+	if (len > 0) memcpy(buff + DAEMON_MSG_HEADER_LEN, payload, len);
+	if (!daemon_write(dev, buff, DAEMON_MSG_HEADER_LEN + len)) {
+		log_message("daemon_layer: daemon_send: Socket write failed");
+		return ATSHA_ERR_COMMUNICATION;
+	}
+
+	return ATSHA_ERR_OK;
+}
+
+/*
+ * Read response of the oldest request without response yet
+ */
+static int daemon_recv(int dev, unsigned char *answer) {
+	unsigned char header[DAEMON_MSG_HEADER_LEN];
+
+	if (!daemon_read(dev, header, DAEMON_MSG_HEADER_LEN)) {
+		log_message("daemon_layer: daemon_recv: Socket read failed");
+		return ATSHA_ERR_COMMUNICATION;
+	}
+
+	int status = header[0];
+	unsigned char len = header[1];
+	if (len > ATSHA204_IO_BUFFER || (answer == NULL && len != 0)) {
+		log_message("daemon_layer: daemon_recv: Malformed response");
+		return ATSHA_ERR_COMMUNICATION;
+	}
+
+	if (len > 0 && !daemon_read(dev, answer, len)) {
+		log_message("daemon_layer: daemon_recv: Socket read failed");
+		return ATSHA_ERR_COMMUNICATION;
+	}
+
+	if (status == ATSHA_ERR_OK && answer != NULL && (len == 0 || answer[0] != len)) {
+		log_message("daemon_layer: daemon_recv: Malformed answer packet");
+		return ATSHA_ERR_COMMUNICATION;
+	}
+
+	return status;
+}
+
+/*
+ * Read responses of pipelined requests; status of the first failed one is returned
+ */
+static int daemon_drain(int dev, unsigned int *pending) {
+	int result = ATSHA_ERR_OK;
+
+	while (*pending > 0) {
+		int status = daemon_recv(dev, NULL);
+		(*pending)--;
+		if (status == ATSHA_ERR_COMMUNICATION) return status;
+		if (result == ATSHA_ERR_OK) result = status;
+	}
+
+	return result;
+}
+
+/*
+ * Send request whose response is read later with the next command answer
+ */
+static int daemon_pipeline(int dev, unsigned int *pending, unsigned char type) {
+	//Requests of the client mustn't fill buffer of the daemon
+	if (*pending >= DAEMON_PIPELINE_MAX) {
+		int status = daemon_drain(dev, pending);
+		if (status != ATSHA_ERR_OK) return status;
+	}
+
+	int status = daemon_send(dev, type, NULL, 0);
+	if (status != ATSHA_ERR_OK) return status;
+	(*pending)++;
+
+	return ATSHA_ERR_OK;
+}
+
+int daemon_connect(const char *path, bool quiet) {
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_message("daemon_layer: daemon_connect: Socket path is too long");
+		return -1;
+	}
+
+	int dev = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (dev == -1) {
+		log_message("daemon_layer: daemon_connect: Couldn't create socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (connect(dev, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		if (!quiet) log_message("daemon_layer: daemon_connect: Couldn't connect to daemon");
+		close(dev);
+		return -1;
+	}
+
+	return dev;
+}
+
+int daemon_wake(int dev, unsigned int *pending) {
+	return daemon_pipeline(dev, pending, DAEMON_MSG_WAKE);
+}
+
+int daemon_idle(int dev, unsigned int *pending) {
+	return daemon_pipeline(dev, pending, DAEMON_MSG_IDLE);
+}
+
+int daemon_command(int dev, unsigned int *pending, const unsigned char *raw_packet, unsigned char *answer) {
+	if (raw_packet[0] == 0 || raw_packet[0] > ATSHA204_IO_BUFFER) {
+		return ATSHA_ERR_INVALID_INPUT;
+	}
+
+	int status = daemon_send(dev, DAEMON_MSG_COMMAND, raw_packet, raw_packet[0]);
+	if (status != ATSHA_ERR_OK) return status;
+
+	//Responses of pipelined requests precede the answer
+	int pipelined = daemon_drain(dev, pending);
+	if (pipelined == ATSHA_ERR_COMMUNICATION) return pipelined;
+
+	status = daemon_recv(dev, answer);
+	if (status == ATSHA_ERR_OK && pipelined != ATSHA_ERR_OK) {
+		log_message("daemon_layer: daemon_command: Pipelined request failed");
+		return pipelined;
+	}
+
+	return status;
+}
+
+static int daemon_transport_wake(void *ctx, unsigned char *answer) {
+	struct atsha_handle *handle = (struct atsha_handle *)ctx;
+	(void) answer; //Daemon checks wake confirmation itself
+	return daemon_wake(handle->fd, &handle->daemon_pending);
+}
+
+static int daemon_transport_idle(void *ctx) {
+	struct atsha_handle *handle = (struct atsha_handle *)ctx;
+	return daemon_idle(handle->fd, &handle->daemon_pending);
+}
+
+static int daemon_transport_command(void *ctx, const unsigned char *raw_packet, unsigned char *answer) {
+	struct atsha_handle *handle = (struct atsha_handle *)ctx;
+	return daemon_command(handle->fd, &handle->daemon_pending, raw_packet, answer);
+}
+
+static void daemon_transport_close(void *ctx) {
+	close(((struct atsha_handle *)ctx)->fd);
+}
+
+//Daemon checks and repeats commands itself
+const atsha_transport TRANSPORT_DAEMON = {
+	.flags = ATSHA_TRANSPORT_RELIABLE,
+	.backoff = 0,
+	.wake = daemon_transport_wake,
+	.idle = daemon_transport_idle,
+	.command = daemon_transport_command,
+	.close = daemon_transport_close
+};
@@ -0,0 +1,52 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAYER_DAEMON_H
+#define LAYER_DAEMON_H
+
+#include <stdbool.h>
+
+#include "atsha204.h"
+
+/*
+ * Protocol between library and atsha204d daemon
+ *
+ * Request: type (1 byte), payload length (1 byte), payload
+ * Response: status code (1 byte), answer length (1 byte), answer
+ *
+ * WAKE starts transaction - the device is reserved for the client until
+ * IDLE. COMMAND carries raw command packet and its answer is raw answer
+ * packet. Responses are sent in order of requests, so requests could be
+ * pipelined. Client doesn't wait for responses of WAKE and IDLE; they are
+ * read together with answer of the next COMMAND.
+ */
+#define DAEMON_MSG_WAKE 1
+#define DAEMON_MSG_IDLE 2
+#define DAEMON_MSG_COMMAND 3
+#define DAEMON_MSG_HEADER_LEN 2
+#define DAEMON_PIPELINE_MAX 2 //Unread responses of one client; daemon buffers 4 requests
+
+int daemon_connect(const char *path, bool quiet);
+int daemon_wake(int dev, unsigned int *pending);
+int daemon_idle(int dev, unsigned int *pending);
+int daemon_command(int dev, unsigned int *pending, const unsigned char *raw_packet, unsigned char *answer);
+
+extern const atsha_transport TRANSPORT_DAEMON;
+
+#endif //LAYER_DAEMON_H
@@ -29,6 +29,7 @@
 #include "atsha204consts.h"
 #include "configuration.h"
 #include "communication.h"
+#include "operations.h"
 #include "tools.h"
 #include "api.h"
 
@@ -38,55 +39,56 @@ void i2c_wait() {
 	usleep(ATSHA204_I2C_CMD_TOUT);
 }
 
-static int i2c_read(struct atsha_handle *handle, unsigned char **answer) {
+static int i2c_read(struct atsha_handle *handle, size_t size, unsigned char *answer) {
 	unsigned char wr_addr[] = { ATSHA204_I2C_ADDRESS };
 	unsigned char *data;
 	int status;
 
 	wr_addr[0] |= 0x01;
 
-	for (int i = 0; i < ATSHA204_I2C_IO_ERR_RESPONSE_TRIES; i++) {
-		status = Start(handle->i2c);
-		if (status != MPSSE_OK) {
-			log_message("layer_i2c: i2c_read: Start");
-			return ATSHA_ERR_COMMUNICATION;
-		}
-
-		status = Write(handle->i2c, (char *)wr_addr, 1);
-		if (status != MPSSE_OK) {
-			log_message("layer_i2c: i2c_read: Write addr");
-			return ATSHA_ERR_COMMUNICATION;
-		}
-
-		data = (unsigned char *)Read(handle->i2c, BUFFSIZE_I2C);
-		if (data == NULL) {
-			log_message("layer_i2c: i2c_command: No data read");
-			return ATSHA_ERR_COMMUNICATION;
-		}
+	if (size > BUFFSIZE_I2C) {
+		return ATSHA_ERR_COMMUNICATION;
+	}
 
-		status = Stop(handle->i2c);
-		if (status != MPSSE_OK) {
-			log_message("layer_i2c: i2c_read: Stop");
-			return ATSHA_ERR_COMMUNICATION;
-		}
+	status = Start(handle->i2c);
+	if (status != MPSSE_OK) {
+		log_message("layer_i2c: i2c_read: Start");
+		return ATSHA_ERR_COMMUNICATION;
+	}
 
-		if (data[0] != ATSHA204_I2C_IO_ERR_RESPONSE) {
-			*answer = calloc(data[0], sizeof(char));
-			if (*answer == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	status = Write(handle->i2c, (char *)wr_addr, 1);
+	if (status != MPSSE_OK) {
+		log_message("layer_i2c: i2c_read: Write addr");
+		return ATSHA_ERR_COMMUNICATION;
+	}
 
-			memcpy(*answer, data, data[0]);
-			free(data);
+	data = (unsigned char *)Read(handle->i2c, size);
+	if (data == NULL) {
+		log_message("layer_i2c: i2c_command: No data read");
+		return ATSHA_ERR_COMMUNICATION;
+	}
 
-			return ATSHA_ERR_OK;
-		}
+	status = Stop(handle->i2c);
+	if (status != MPSSE_OK) {
+		free(data);
+		log_message("layer_i2c: i2c_read: Stop");
+		return ATSHA_ERR_COMMUNICATION;
+	}
 
-		i2c_wait();
+	//Device doesn't respond while it is busy
+	if (data[0] == ATSHA204_I2C_IO_ERR_RESPONSE || data[0] < ATSHA204_ANSWER_STATUS_LEN || data[0] > size) {
+		free(data);
+		return ATSHA_ERR_COMMUNICATION;
 	}
 
-	return ATSHA_ERR_COMMUNICATION;
+	//libmpsse always allocates read data
+	memcpy(answer, data, data[0]);
+	free(data);
+
+	return ATSHA_ERR_OK;
 }
 
-int i2c_wake(struct atsha_handle *handle, unsigned char **answer) {
+int i2c_wake(struct atsha_handle *handle, unsigned char *answer) {
 	unsigned char wr_wake[] = { 0x00 };
 	int status;
 
@@ -120,9 +122,7 @@ int i2c_wake(struct atsha_handle *handle, unsigned char **answer) {
 		return ATSHA_ERR_COMMUNICATION;
 	}
 
-	i2c_wait();
-
-	status = i2c_read(handle, answer);
+	status = poll_answer(handle, ATSHA204_WAKE_HIGH_DELAY, ATSHA204_I2C_CMD_TOUT, ATSHA204_ANSWER_STATUS_LEN, i2c_read, answer);
 	if (status != ATSHA_ERR_OK) {
 		return status;
 	}
@@ -164,7 +164,7 @@ int i2c_idle(struct atsha_handle *handle) {
 	return ATSHA_ERR_OK;
 }
 
-int i2c_command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
+int i2c_command(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
 	unsigned char wr_addr[] = { ATSHA204_I2C_ADDRESS };
 	unsigned char wr_cmd[] = { ATSHA204_I2C_WA_COMMAND };
 	int status;
@@ -199,9 +199,7 @@ int i2c_command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned
 		return ATSHA_ERR_COMMUNICATION;
 	}
 
-	i2c_wait();
-
-	status = i2c_read(handle, answer);
+	status = poll_command(handle, raw_packet, i2c_read, answer);
 	if (status != ATSHA_ERR_OK) {
 		return status;
 	}
@@ -304,3 +302,44 @@ printf("OK: %d\n", MPSSE_OK);
 }
 
 #endif
+
+static int i2c_transport_wake(void *ctx, unsigned char *answer) {
+	int status = i2c_wake((struct atsha_handle *)ctx, answer);
+
+	//Check bus consistency
+	if (status == ATSHA_ERR_OK && answer[0] == ATSHA204_I2C_IO_ERR_RESPONSE) {
+		log_message("layer_i2c: i2c_wake: I2C I/O error detected");
+		return ATSHA_ERR_COMMUNICATION;
+	}
+
+	return status;
+}
+
+static int i2c_transport_idle(void *ctx) {
+	return i2c_idle((struct atsha_handle *)ctx);
+}
+
+static int i2c_transport_command(void *ctx, const unsigned char *raw_packet, unsigned char *answer) {
+	int status = i2c_command((struct atsha_handle *)ctx, raw_packet, answer);
+
+	//Check bus consistency
+	if (status == ATSHA_ERR_OK && answer[0] == ATSHA204_I2C_IO_ERR_RESPONSE) {
+		log_message("layer_i2c: i2c_command: I2C I/O error detected");
+		return ATSHA_ERR_COMMUNICATION;
+	}
+
+	return status;
+}
+
+static void i2c_transport_close(void *ctx) {
+	Close(((struct atsha_handle *)ctx)->i2c); //Deinitialize libmpsse
+}
+
+const atsha_transport TRANSPORT_I2C = {
+	.flags = ATSHA_TRANSPORT_DIRECT,
+	.backoff = ATSHA204_I2C_CMD_TOUT,
+	.wake = i2c_transport_wake,
+	.idle = i2c_transport_idle,
+	.command = i2c_transport_command,
+	.close = i2c_transport_close
+};
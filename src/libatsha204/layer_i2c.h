@@ -22,9 +22,13 @@
 
 #include <stdbool.h>
 
+#include "atsha204.h"
+
 void i2c_wait();
-int i2c_wake(struct atsha_handle *handle, unsigned char **answer);
+int i2c_wake(struct atsha_handle *handle, unsigned char *answer);
 int i2c_idle(struct atsha_handle *handle);
-int i2c_command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer);
+int i2c_command(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer);
+
+extern const atsha_transport TRANSPORT_I2C;
 
 #endif //LAYER_I2C_H
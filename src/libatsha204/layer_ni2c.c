@@ -24,7 +24,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
-//#include <linux/i2c.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
@@ -33,40 +33,59 @@
 #include "atsha204consts.h"
 #include "configuration.h"
 #include "communication.h"
+#include "operations.h"
 #include "tools.h"
 #include "api.h"
 
 extern atsha_configuration g_config;
 
-void ni2c_wait() {
-	usleep(ATSHA204_I2C_CMD_TOUT);
+/*
+ * Every transfer is one I2C_RDWR transaction with exact length
+ */
+static int ni2c_transfer(struct atsha_handle *handle, unsigned short flags, unsigned char *data, size_t len) {
+	struct i2c_msg msg = {
+		.addr = ATSHA204_NI2C_ADDRESS,
+		.flags = flags,
+		.len = len,
+		.buf = data
+	};
+	struct i2c_rdwr_ioctl_data transaction = {
+		.msgs = &msg,
+		.nmsgs = 1
+	};
+
+	if (ioctl(handle->fd, I2C_RDWR, &transaction) < 0) {
+		return ATSHA_ERR_COMMUNICATION;
+	}
+
+	return ATSHA_ERR_OK;
 }
 
-static int ni2c_read(struct atsha_handle *handle, unsigned char **answer) {
-	unsigned char data[BUFFSIZE_NI2C];
+static int ni2c_read(struct atsha_handle *handle, size_t size, unsigned char *answer) {
+	if (size > BUFFSIZE_NI2C) {
+		return ATSHA_ERR_COMMUNICATION;
+	}
 
-	if (read(handle->fd, data, BUFFSIZE_NI2C) < 0) {
-		log_message("layer_ni2c: ni2c_read: Read packet failed");
+	//Device doesn't acknowledge its address while it is busy
+	if (ni2c_transfer(handle, I2C_M_RD, answer, size) != ATSHA_ERR_OK) {
 		return ATSHA_ERR_COMMUNICATION;
 	}
 
-	*answer = calloc(data[0], sizeof(char));
-	if (*answer == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
-	memcpy(*answer, data, data[0]);
+	if (answer[0] < ATSHA204_ANSWER_STATUS_LEN || answer[0] > size) {
+		return ATSHA_ERR_COMMUNICATION;
+	}
 
 	return ATSHA_ERR_OK;
 }
 
-int ni2c_wake(struct atsha_handle *handle, unsigned char **answer) {
+int ni2c_wake(struct atsha_handle *handle, unsigned char *answer) {
 	unsigned char wr_wake[] = { 0x00 };
 	int status;
 
 	//OK, I know, this is weird. But we really need to not check error status
-	write(handle->fd, wr_wake, 1);
+	ni2c_transfer(handle, 0, wr_wake, 1);
 
-	ni2c_wait();
-
-	status = ni2c_read(handle, answer);
+	status = poll_answer(handle, ATSHA204_WAKE_HIGH_DELAY, ATSHA204_I2C_CMD_TOUT, ATSHA204_ANSWER_STATUS_LEN, ni2c_read, answer);
 	if (status != ATSHA_ERR_OK) {
 		return status;
 	}
@@ -77,35 +96,52 @@ int ni2c_wake(struct atsha_handle *handle, unsigned char **answer) {
 int ni2c_idle(struct atsha_handle *handle) {
 	unsigned char wr_idle[] = { ATSHA204_I2C_WA_IDLE };
 
-	write(handle->fd, wr_idle, 1);
+	ni2c_transfer(handle, 0, wr_idle, 1);
 
 	return ATSHA_ERR_OK;
 }
 
-int ni2c_command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer) {
-	unsigned char *send_buffer = (unsigned char *) calloc(raw_packet[0] + 1, sizeof(unsigned char));
-	if (send_buffer == NULL) {
-		log_message("layer_ni2c: ni2c_command: Send buffer memory allocation error");
-		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
-	}
+int ni2c_command(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer) {
+	unsigned char send_buffer[BUFFSIZE_NI2C + 1];
 	send_buffer[0] = ATSHA204_I2C_WA_COMMAND;
 	memcpy((send_buffer + 1), raw_packet, raw_packet[0]);
 
-	if (write(handle->fd, send_buffer, raw_packet[0] + 1) < 0) {
-		free(send_buffer);
+	if (ni2c_transfer(handle, 0, send_buffer, raw_packet[0] + 1) != ATSHA_ERR_OK) {
 		log_message("layer_ni2c: ni2c_command: Send command packet");
 		return ATSHA_ERR_COMMUNICATION;
 	}
 
-	free(send_buffer);
-
-	ni2c_wait();
-
+	//Command and answer couldn't be combined - device is busy during execution
 	int status;
-	status = ni2c_read(handle, answer);
+	status = poll_command(handle, raw_packet, ni2c_read, answer);
 	if (status != ATSHA_ERR_OK) {
 		return status;
 	}
 
 	return ATSHA_ERR_OK;
 }
+
+static int ni2c_transport_wake(void *ctx, unsigned char *answer) {
+	return ni2c_wake((struct atsha_handle *)ctx, answer);
+}
+
+static int ni2c_transport_idle(void *ctx) {
+	return ni2c_idle((struct atsha_handle *)ctx);
+}
+
+static int ni2c_transport_command(void *ctx, const unsigned char *raw_packet, unsigned char *answer) {
+	return ni2c_command((struct atsha_handle *)ctx, raw_packet, answer);
+}
+
+static void ni2c_transport_close(void *ctx) {
+	close(((struct atsha_handle *)ctx)->fd);
+}
+
+const atsha_transport TRANSPORT_NI2C = {
+	.flags = ATSHA_TRANSPORT_DIRECT,
+	.backoff = ATSHA204_I2C_CMD_TOUT,
+	.wake = ni2c_transport_wake,
+	.idle = ni2c_transport_idle,
+	.command = ni2c_transport_command,
+	.close = ni2c_transport_close
+};
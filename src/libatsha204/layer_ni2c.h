@@ -22,9 +22,12 @@
 
 #include <stdbool.h>
 
-void ni2c_wait();
-int ni2c_wake(struct atsha_handle *handle, unsigned char **answer);
+#include "atsha204.h"
+
+int ni2c_wake(struct atsha_handle *handle, unsigned char *answer);
 int ni2c_idle(struct atsha_handle *handle);
-int ni2c_command(struct atsha_handle *handle, unsigned char *raw_packet, unsigned char **answer);
+int ni2c_command(struct atsha_handle *handle, const unsigned char *raw_packet, unsigned char *answer);
+
+extern const atsha_transport TRANSPORT_NI2C;
 
 #endif //LAYER_I2C_H
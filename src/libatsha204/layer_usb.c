@@ -40,24 +40,20 @@ static const int USB_PACKET_SKIP_PREFIX = 3;
  * This function gets received message and return raw packet.
  * Function passes char by char and each pair is converting to one real byte
  */
-static unsigned char *usb_get_raw_packet(char* data) {
-	int high_cnt = 0, low_cnt = 1;
-	unsigned char packet_size = get_number_from_hex_char(data[USB_PACKET_SKIP_PREFIX + high_cnt], data[USB_PACKET_SKIP_PREFIX + low_cnt]);
+static int usb_get_raw_packet(char* data, unsigned char *packet) {
+	const char *pos;
+	unsigned char packet_size;
 
-	if (packet_size == 0) {
-		return NULL;
+	if (!hex_decode(data + USB_PACKET_SKIP_PREFIX, &packet_size, 1, &pos) || packet_size == 0 || packet_size > ATSHA204_IO_BUFFER) {
+		return ATSHA_ERR_COMMUNICATION;
 	}
 
-	unsigned char *packet = (unsigned char *)calloc(packet_size, sizeof(unsigned char));
-	if (packet == NULL) return NULL;
 	packet[0] = packet_size;
-	for (size_t i = 1; i < packet_size; i++) {
-		high_cnt += 2;
-		low_cnt += 2;
-		packet[i] = get_number_from_hex_char(data[USB_PACKET_SKIP_PREFIX + high_cnt], data[USB_PACKET_SKIP_PREFIX + low_cnt]);
+	if (!hex_decode(pos, packet + 1, packet_size - 1, &pos)) {
+		return ATSHA_ERR_COMMUNICATION;
 	}
 
-	return packet;
+	return ATSHA_ERR_OK;
 }
 
 static bool usb_check_nl(char *buff, size_t check_len) {
@@ -85,7 +81,7 @@ static int usb_read(int dev, char *buff) {
 	return ATSHA_ERR_OK;
 }
 
-int usb_wake(int dev, unsigned char **answer) {
+int usb_wake(int dev, unsigned char *answer) {
 	char buff[BUFFSIZE_USB];
 	clear_buffer((unsigned char *)buff, BUFFSIZE_USB);
 	size_t len, cnt;
@@ -113,12 +109,7 @@ int usb_wake(int dev, unsigned char **answer) {
 	}
 
 	//"Parse" packet from recieved message
-	*answer = usb_get_raw_packet(buff);
-	if (*answer == NULL) {
-		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
-	}
-
-	return ATSHA_ERR_OK;
+	return usb_get_raw_packet(buff, answer);
 }
 
 int usb_idle(int dev) {
@@ -150,7 +141,7 @@ int usb_idle(int dev) {
 	return ATSHA_ERR_OK;
 }
 
-int usb_command(int dev, unsigned char *raw_packet, unsigned char **answer) {
+int usb_command(int dev, const unsigned char *raw_packet, unsigned char *answer) {
 	char buff[BUFFSIZE_USB];
 	clear_buffer((unsigned char *)buff, BUFFSIZE_USB);
 	size_t len, cnt;
@@ -159,10 +150,8 @@ int usb_command(int dev, unsigned char *raw_packet, unsigned char **answer) {
 	//Create messge
 	strcpy(buff, "sha:talk(");
 	int offset = 9;
-	for (unsigned char i = 0; i < raw_packet[0]; i++) {
-		sprintf((buff + offset), "%02x", raw_packet[i]);
-		offset += 2;
-	}
+	hex_encode(raw_packet, raw_packet[0], buff + offset);
+	offset += 2 * raw_packet[0];
 	strcpy((buff+offset), ")\n");
 
 	//Send message
@@ -184,10 +173,31 @@ int usb_command(int dev, unsigned char *raw_packet, unsigned char **answer) {
 	}
 
 	//"Parse" packet from recieved message
-	*answer = usb_get_raw_packet(buff);
-	if (answer == NULL) {
-		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
-	}
+	return usb_get_raw_packet(buff, answer);
+}
 
-	return ATSHA_ERR_OK;
+static int usb_transport_wake(void *ctx, unsigned char *answer) {
+	return usb_wake(((struct atsha_handle *)ctx)->fd, answer);
+}
+
+static int usb_transport_idle(void *ctx) {
+	return usb_idle(((struct atsha_handle *)ctx)->fd);
+}
+
+static int usb_transport_command(void *ctx, const unsigned char *raw_packet, unsigned char *answer) {
+	return usb_command(((struct atsha_handle *)ctx)->fd, raw_packet, answer);
+}
+
+static void usb_transport_close(void *ctx) {
+	close(((struct atsha_handle *)ctx)->fd);
 }
+
+//Bus of USB dongle recovers slowly
+const atsha_transport TRANSPORT_USB = {
+	.flags = ATSHA_TRANSPORT_DIRECT,
+	.backoff = TRY_SEND_RECV_ON_COMM_ERROR_TOUT,
+	.wake = usb_transport_wake,
+	.idle = usb_transport_idle,
+	.command = usb_transport_command,
+	.close = usb_transport_close
+};
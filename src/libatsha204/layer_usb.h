@@ -22,8 +22,12 @@
 
 #include <stdbool.h>
 
-int usb_wake(int dev, unsigned char **answer);
+#include "atsha204.h"
+
+int usb_wake(int dev, unsigned char *answer);
 int usb_idle(int dev);
-int usb_command(int dev, unsigned char *raw_packet, unsigned char **answer);
+int usb_command(int dev, const unsigned char *raw_packet, unsigned char *answer);
+
+extern const atsha_transport TRANSPORT_USB;
 
 #endif //LAYER_USB_H
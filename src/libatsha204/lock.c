@@ -0,0 +1,224 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE //F_OFD_SETLK
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "configuration.h"
+#include "api.h"
+#include "tools.h"
+#include "breaker.h"
+#include "lock.h"
+
+/*
+ * Content of lock file; zero-filled file is valid unlocked state
+ *
+ * Tickets only order waiters. The device is owned by the one who holds OFD
+ * write lock of the first byte of lock file; kernel releases it when its
+ * owner dies, so dead or foreign (other PID namespace) processes can't
+ * confuse ownership.
+ */
+struct lock_shared {
+	uint32_t next; ///<Next ticket to take
+	uint32_t serving; ///<Ticket whose owner is allowed to take the device
+	uint32_t abandoned[LOCK_SLOTS]; ///<Ticket + 1 of waiters that gave up (indexed by ticket modulo LOCK_SLOTS)
+	struct breaker breaker; ///<Circuit breaker shared by all users of the device
+};
+
+struct device_lock {
+	int fd;
+	struct lock_shared *shared;
+	bool held;
+	uint32_t ticket;
+};
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout) {
+	//Lock file is shared mapping - private futex can't be used
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static void wake_all(struct device_lock *lock) {
+	futex(&lock->shared->serving, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/*
+ * Move serving ticket from given one to the next one
+ */
+static void skip(struct device_lock *lock, uint32_t ticket) {
+	if (__atomic_compare_exchange_n(&lock->shared->serving, &ticket, ticket + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		wake_all(lock);
+	}
+}
+
+/*
+ * Set, remove or test (F_OFD_GETLK) kernel lock of the device
+ */
+static int device_flock(struct device_lock *lock, int cmd, short type) {
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = 0,
+		.l_len = 1,
+		.l_pid = 0
+	};
+
+	if (fcntl(lock->fd, cmd, &fl) == -1) return -1;
+
+	return (cmd == F_OFD_GETLK) ? fl.l_type : 0;
+}
+
+/*
+ * Is the device owned by anybody else?
+ */
+static bool device_busy(struct device_lock *lock) {
+	//Lock that can't be tested is considered held; waiting is safe
+	return device_flock(lock, F_OFD_GETLK, F_WRLCK) != F_UNLCK;
+}
+
+struct device_lock *lock_open(const char *path) {
+	int fd = open(path, O_RDWR | O_CREAT, 0600 /* S_IRUSR | S_IWUSR, but these are not available on OpenWRT */);
+	if (fd == -1) {
+		log_message("lock: open: open lock file failed");
+		return NULL;
+	}
+
+	//Lock file of older versions is empty; grow it to zero-filled state
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (st.st_size < (off_t)sizeof(struct lock_shared) && ftruncate(fd, sizeof(struct lock_shared)) == -1)) {
+		log_message("lock: open: couldn't resize lock file");
+		close(fd);
+		return NULL;
+	}
+
+	void *shared = mmap(NULL, sizeof(struct lock_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED) {
+		log_message("lock: open: couldn't map lock file");
+		close(fd);
+		return NULL;
+	}
+
+	struct device_lock *lock = (struct device_lock *)calloc(1, sizeof(struct device_lock));
+	if (lock == NULL) {
+		munmap(shared, sizeof(struct lock_shared));
+		close(fd);
+		return NULL;
+	}
+
+	lock->fd = fd;
+	lock->shared = (struct lock_shared *)shared;
+	lock->held = false;
+
+	return lock;
+}
+
+bool lock_acquire(struct device_lock *lock, uint64_t timeout, uint64_t *waited) {
+	struct lock_shared *shared = lock->shared;
+	uint64_t start = monotonic_time_us();
+	uint64_t deadline = start + timeout;
+
+	uint32_t ticket = __atomic_fetch_add(&shared->next, 1, __ATOMIC_ACQ_REL);
+
+	//Serving ticket that doesn't move while the device is free belongs to
+	//somebody who died or is too slow to take its turn
+	uint32_t stalled = ticket;
+	uint64_t stalled_since = start;
+
+	while (true) {
+		uint32_t serving = __atomic_load_n(&shared->serving, __ATOMIC_ACQUIRE);
+		uint64_t now = monotonic_time_us();
+
+		//Our turn, or our ticket was skipped and we compete for the device without order
+		if ((int32_t)(serving - ticket) >= 0 && device_flock(lock, F_OFD_SETLK, F_WRLCK) == 0) {
+			lock->held = true;
+			lock->ticket = ticket;
+			*waited = now - start;
+			return true;
+		}
+
+		if ((int32_t)(serving - ticket) < 0) {
+			if (__atomic_load_n(&shared->abandoned[serving % LOCK_SLOTS], __ATOMIC_ACQUIRE) == serving + 1) {
+				skip(lock, serving);
+				continue;
+			}
+			if (serving != stalled || device_busy(lock)) {
+				stalled = serving;
+				stalled_since = now;
+			} else if ((now - stalled_since) > LOCK_CHECK_PERIOD) {
+				skip(lock, serving);
+				continue;
+			}
+		}
+
+		if (now >= deadline) break;
+
+		uint64_t sleep = deadline - now;
+		if (sleep > LOCK_CHECK_PERIOD) sleep = LOCK_CHECK_PERIOD;
+		struct timespec tout = { .tv_sec = sleep / 1000000, .tv_nsec = (sleep % 1000000) * 1000 };
+		futex(&shared->serving, FUTEX_WAIT, serving, &tout);
+	}
+
+	//Give up; if it's our turn in the meantime pass it to the next one
+	__atomic_store_n(&shared->abandoned[ticket % LOCK_SLOTS], ticket + 1, __ATOMIC_RELEASE);
+	skip(lock, ticket);
+
+	*waited = monotonic_time_us() - start;
+	return false;
+}
+
+void lock_release(struct device_lock *lock) {
+	if (!lock->held) return;
+
+	device_flock(lock, F_OFD_SETLK, F_UNLCK);
+	lock->held = false;
+
+	//Waiters of skipped ticket compete for the device too
+	if (__atomic_load_n(&lock->shared->serving, __ATOMIC_ACQUIRE) == lock->ticket) {
+		skip(lock, lock->ticket);
+	} else {
+		wake_all(lock);
+	}
+}
+
+struct breaker *lock_breaker(struct device_lock *lock) {
+	return &lock->shared->breaker;
+}
+
+bool lock_held(const struct device_lock *lock) {
+	return lock->held;
+}
+
+void lock_close(struct device_lock *lock) {
+	if (lock == NULL) return;
+
+	lock_release(lock);
+	munmap(lock->shared, sizeof(struct lock_shared));
+	close(lock->fd);
+	free(lock);
+}
@@ -0,0 +1,69 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * \file lock.h
+ * \brief Fair lock of the device shared by all processes
+ *
+ * Processes take tickets from a counter in memory-mapped lock file and
+ * get the device in order of arrival. Waiters sleep on futex and don't
+ * poll. The device itself is owned through OFD lock of lock file, which
+ * kernel releases when the owner dies. Tickets only keep the order; a
+ * ticket of waiter that gave up or that doesn't move while the device is
+ * free is skipped and its owner takes the device whenever it's free.
+ */
+
+struct device_lock;
+
+/**
+ * \brief Open or create lock file and map its content
+ * \return lock instance or NULL on failure
+ */
+struct device_lock *lock_open(const char *path);
+/**
+ * \brief Wait for the device
+ * \param timeout the longest wait in microseconds (monotonic clock)
+ * \param [out] waited time spent by waiting in microseconds
+ * \return true if the lock was acquired
+ */
+bool lock_acquire(struct device_lock *lock, uint64_t timeout, uint64_t *waited);
+/**
+ * \brief Pass the device to next waiting process
+ */
+void lock_release(struct device_lock *lock);
+/**
+ * \brief Circuit breaker of the device stored in lock file
+ */
+struct breaker *lock_breaker(struct device_lock *lock);
+/**
+ * \brief Is the lock held by this instance?
+ */
+bool lock_held(const struct device_lock *lock);
+/**
+ * \brief Release the lock if it's held and close lock file
+ */
+void lock_close(struct device_lock *lock);
+
+#endif //LOCK_H
@@ -36,6 +36,37 @@ static const unsigned char SLOT_ADDRESSES[] = {
 	0x40, 0x48, 0x50, 0x58, 0x60, 0x68, 0x70, 0x78
 };
 
+/*
+ * Execution times of implemented commands
+ */
+static const struct {
+	unsigned char opcode;
+	unsigned int typical;
+	unsigned int max;
+} EXEC_TIMES[] = {
+	{ ATSHA204_OPCODE_DEV_REV, ATSHA204_EXEC_TYP_DEV_REV, ATSHA204_EXEC_MAX_DEV_REV },
+	{ ATSHA204_OPCODE_RANDOM, ATSHA204_EXEC_TYP_RANDOM, ATSHA204_EXEC_MAX_RANDOM },
+	{ ATSHA204_OPCODE_READ, ATSHA204_EXEC_TYP_READ, ATSHA204_EXEC_MAX_READ },
+	{ ATSHA204_OPCODE_WRITE, ATSHA204_EXEC_TYP_WRITE, ATSHA204_EXEC_MAX_WRITE },
+	{ ATSHA204_OPCODE_NONCE, ATSHA204_EXEC_TYP_NONCE, ATSHA204_EXEC_MAX_NONCE },
+	{ ATSHA204_OPCODE_HMAC, ATSHA204_EXEC_TYP_HMAC, ATSHA204_EXEC_MAX_HMAC },
+	{ ATSHA204_OPCODE_MAC, ATSHA204_EXEC_TYP_MAC, ATSHA204_EXEC_MAX_MAC },
+	{ ATSHA204_OPCODE_LOCK, ATSHA204_EXEC_TYP_LOCK, ATSHA204_EXEC_MAX_LOCK }
+};
+
+/*
+ * Precomputed packets of commands without variable parameters
+ */
+static const unsigned char PACKET_DEV_REV[] = {
+	0x07, ATSHA204_OPCODE_DEV_REV, 0x00, 0x00, 0x00, 0x03, 0x5D
+};
+static const unsigned char PACKET_RANDOM[] = { //mode 0x00
+	0x07, ATSHA204_OPCODE_RANDOM, 0x00, 0x00, 0x00, 0x24, 0xCD
+};
+static const unsigned char PACKET_SERIAL_NUMBER[] = { //32 bytes from config zone address 0
+	0x07, ATSHA204_OPCODE_READ, 0x80, 0x00, 0x00, 0x09, 0xAD
+};
+
 //internal function
 static int read_long_data(unsigned char *packet, unsigned char *data) {
 	int size = packet[0] - 3; //-3 == -1 count and -2 crc
@@ -58,8 +89,8 @@ static int just_check_status(unsigned char *packet) {
 	return ATSHA_ERR_BAD_COMMUNICATION_STATUS;
 }
 
-unsigned char *op_dev_rev() {
-	return generate_command_packet(ATSHA204_OPCODE_DEV_REV, 0, 0, NULL, 0);
+const unsigned char *op_dev_rev() {
+	return PACKET_DEV_REV;
 }
 
 uint32_t op_dev_rev_recv(unsigned char *packet) {
@@ -74,13 +105,12 @@ uint32_t op_dev_rev_recv(unsigned char *packet) {
 	return res;
 }
 
-unsigned char *op_random() {
+const unsigned char *op_random() {
 	/**
 	 * Mode 0x00 has better security
 	 * Mode 0x01 recycles seed stored in EEPROM
 	 */
-	unsigned char USE_MODE = 0x00;
-	return generate_command_packet(ATSHA204_OPCODE_RANDOM, USE_MODE, 0, NULL, 0);
+	return PACKET_RANDOM;
 }
 
 int op_random_recv(unsigned char *packet, unsigned char *data) {
@@ -105,32 +135,75 @@ unsigned char get_slot_address(unsigned char slot_number) {
 	return address;
 }
 
-unsigned char *op_raw_read(unsigned char zone_config, unsigned char address) {
-	return generate_command_packet(ATSHA204_OPCODE_READ, zone_config, (uint16_t)address, NULL, 0);
+void op_exec_time(unsigned char opcode, unsigned int *typical, unsigned int *max) {
+	for (size_t i = 0; i < (sizeof(EXEC_TIMES) / sizeof(EXEC_TIMES[0])); i++) {
+		if (EXEC_TIMES[i].opcode == opcode) {
+			*typical = EXEC_TIMES[i].typical;
+			*max = EXEC_TIMES[i].max;
+			return;
+		}
+	}
+
+	//Unknown command - be conservative
+	*typical = ATSHA204_I2C_CMD_TOUT;
+	*max = ATSHA204_I2C_CMD_TOUT;
+}
+
+size_t op_answer_size(const unsigned char *packet) {
+	unsigned char opcode = packet[1];
+	unsigned char param1 = packet[2];
+
+	switch (opcode) {
+		case ATSHA204_OPCODE_DEV_REV:
+			return ATSHA204_ANSWER_SHORT_LEN;
+		case ATSHA204_OPCODE_READ:
+			if ((param1 & IO_RW_32_BYTES) == 0) {
+				return ATSHA204_ANSWER_SHORT_LEN;
+			}
+			return ATSHA204_ANSWER_LONG_LEN;
+		case ATSHA204_OPCODE_NONCE:
+			if (param1 == 0x03) { //pass-trough mode returns just status
+				return ATSHA204_ANSWER_STATUS_LEN;
+			}
+			return ATSHA204_ANSWER_LONG_LEN;
+		case ATSHA204_OPCODE_RANDOM:
+		case ATSHA204_OPCODE_HMAC:
+		case ATSHA204_OPCODE_MAC:
+			return ATSHA204_ANSWER_LONG_LEN;
+		case ATSHA204_OPCODE_WRITE:
+		case ATSHA204_OPCODE_LOCK:
+			return ATSHA204_ANSWER_STATUS_LEN;
+		default:
+			return ATSHA204_IO_BUFFER;
+	}
+}
+
+const unsigned char *op_raw_read(unsigned char *buffer, unsigned char zone_config, unsigned char address) {
+	return generate_command_packet(buffer, ATSHA204_OPCODE_READ, zone_config, (uint16_t)address, NULL, 0);
 }
 
 int op_raw_read_recv(unsigned char *packet, unsigned char *data) {
 	return read_long_data(packet, data);
 }
 
-unsigned char *op_raw_write(unsigned char zone_config, unsigned char address, size_t cnt, unsigned char *data) {
-	return generate_command_packet(ATSHA204_OPCODE_WRITE, zone_config, (uint16_t)address, data, cnt);
+const unsigned char *op_raw_write(unsigned char *buffer, unsigned char zone_config, unsigned char address, size_t cnt, const unsigned char *data) {
+	return generate_command_packet(buffer, ATSHA204_OPCODE_WRITE, zone_config, (uint16_t)address, data, cnt);
 }
 
 int op_raw_write_recv(unsigned char *packet) {
 	return just_check_status(packet);
 }
 
-unsigned char *op_nonce(size_t cnt, unsigned char *data) {
+const unsigned char *op_nonce(unsigned char *buffer, size_t cnt, const unsigned char *data) {
 	unsigned char USE_MODE = 0x03; //pass-trough mode
-	return generate_command_packet(ATSHA204_OPCODE_NONCE, USE_MODE, 0, data, cnt);
+	return generate_command_packet(buffer, ATSHA204_OPCODE_NONCE, USE_MODE, 0, data, cnt);
 }
 
 int op_nonce_recv(unsigned char *packet) {
 	return just_check_status(packet);
 }
 
-unsigned char *op_hmac(unsigned char address, bool use_sn_in_digest) {
+unsigned char op_hmac_mode(bool use_sn_in_digest) {
 	unsigned char USE_MODE = 0x04; //0x04 3rd bit must match TempKey.SourceFlag
 	if (use_sn_in_digest) {
 		if (USE_OUR_SN) {
@@ -140,14 +213,18 @@ unsigned char *op_hmac(unsigned char address, bool use_sn_in_digest) {
 		}
 	}
 
-	return generate_command_packet(ATSHA204_OPCODE_HMAC, USE_MODE, (uint16_t)address, NULL, 0);
+	return USE_MODE;
+}
+
+const unsigned char *op_hmac(unsigned char *buffer, unsigned char address, bool use_sn_in_digest) {
+	return generate_command_packet(buffer, ATSHA204_OPCODE_HMAC, op_hmac_mode(use_sn_in_digest), (uint16_t)address, NULL, 0);
 }
 
 int op_hmac_recv(unsigned char *packet, unsigned char *data) {
 	return read_long_data(packet, data);
 }
 
-unsigned char *op_mac(unsigned char address, size_t cnt, unsigned char *data, bool use_sn_in_digest) {
+unsigned char op_mac_mode(bool use_sn_in_digest) {
 	unsigned char USE_MODE = 0x00; //use key slot; read message from input
 	if (use_sn_in_digest) {
 		if (USE_OUR_SN) {
@@ -157,15 +234,19 @@ unsigned char *op_mac(unsigned char address, size_t cnt, unsigned char *data, bo
 		}
 	}
 
-	return generate_command_packet(ATSHA204_OPCODE_MAC, USE_MODE, (uint16_t)address, data, cnt);
+	return USE_MODE;
+}
+
+const unsigned char *op_mac(unsigned char *buffer, unsigned char address, size_t cnt, const unsigned char *data, bool use_sn_in_digest) {
+	return generate_command_packet(buffer, ATSHA204_OPCODE_MAC, op_mac_mode(use_sn_in_digest), (uint16_t)address, data, cnt);
 }
 
 int op_mac_recv(unsigned char *packet, unsigned char *data) {
 	return read_long_data(packet, data);
 }
 
-unsigned char *op_serial_number() {
-	return generate_command_packet(ATSHA204_OPCODE_READ, get_zone_config(IO_MEM_CONFIG, IO_RW_NON_ENC, IO_RW_32_BYTES), 0x0000, NULL, 0);
+const unsigned char *op_serial_number() {
+	return PACKET_SERIAL_NUMBER;
 }
 
 int op_serial_number_recv(unsigned char *packet, unsigned char *data) {
@@ -184,12 +265,12 @@ int op_serial_number_recv(unsigned char *packet, unsigned char *data) {
 	return size;
 }
 
-unsigned char *op_lock(unsigned char lock_config, const unsigned char *crc) {
+const unsigned char *op_lock(unsigned char *buffer, unsigned char lock_config, const unsigned char *crc) {
 	uint16_t crc_int = 0; //clear
 	crc_int |= crc[1]; crc_int <<= (1 * 8);
 	crc_int |= crc[0];
 
-	return generate_command_packet(ATSHA204_OPCODE_LOCK, lock_config, crc_int, NULL, 0);
+	return generate_command_packet(buffer, ATSHA204_OPCODE_LOCK, lock_config, crc_int, NULL, 0);
 }
 
 int op_lock_recv(unsigned char *packet) {
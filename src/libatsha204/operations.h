@@ -57,12 +57,27 @@ unsigned char get_lock_config(unsigned char lock_what);
  * \return slot address according to its ID
  */
 unsigned char get_slot_address(unsigned char slot_number);
+/**
+ * \brief Get execution time of the command
+ * \note Times are documented in original ATSHA204 Datasheet (Table 8-6)
+ * \param opcode opcode of the command
+ * \param [out] typical typical execution time in microseconds
+ * \param [out] max maximal execution time in microseconds
+ */
+void op_exec_time(unsigned char opcode, unsigned int *typical, unsigned int *max);
+/**
+ * \brief Get size of the answer that the chip returns for the command
+ * \note Status packets (e.g. errors) are always shorter than returned size
+ * \param packet raw packet for the chip
+ * \return maximal size of the answer packet in bytes
+ */
+size_t op_answer_size(const unsigned char *packet);
 /**
  * \brief Generate packet for DevRev command
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
- * \return raw packet for the chip
+ * \return precomputed raw packet for the chip
  */
-unsigned char *op_dev_rev();
+const unsigned char *op_dev_rev();
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -74,9 +89,9 @@ uint32_t op_dev_rev_recv(unsigned char *packet);
 /**
  * \brief Generate packet for Random command
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
- * \return raw packet for the chip
+ * \return precomputed raw packet for the chip
  */
-unsigned char *op_random();
+const unsigned char *op_random();
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -89,11 +104,12 @@ int op_random_recv(unsigned char *packet, unsigned char *data);
 /**
  * \brief Generate packet for Read command
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
+ * \param [out] buffer buffer with at least ATSHA204_IO_BUFFER bytes for the packet
  * \param zone_config configuration of the command generated by get_zone_config()
  * \param address memory address for I/O operation
  * \return raw packet for the chip
  */
-unsigned char *op_raw_read(unsigned char zone_config, unsigned char address);
+const unsigned char *op_raw_read(unsigned char *buffer, unsigned char zone_config, unsigned char address);
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -105,13 +121,14 @@ int op_raw_read_recv(unsigned char *packet, unsigned char *data);
 /**
  * \brief Generate packet for Write command
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
+ * \param [out] buffer buffer with at least ATSHA204_IO_BUFFER bytes for the packet
  * \param zone_config configuration of the command generated by get_zone_config()
  * \param address memory address for I/O operation
  * \param cnt size of data
  * \param data data to write
  * \return raw packet for the chip
  */
-unsigned char *op_raw_write(unsigned char zone_config, unsigned char address, size_t cnt, unsigned char *data);
+const unsigned char *op_raw_write(unsigned char *buffer, unsigned char zone_config, unsigned char address, size_t cnt, const unsigned char *data);
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -122,11 +139,12 @@ int op_raw_write_recv(unsigned char *packet);
 /**
  * \brief Generate packet for Nonce command
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
+ * \param [out] buffer buffer with at least ATSHA204_IO_BUFFER bytes for the packet
  * \param cnt size of data
  * \param data data to write
  * \return raw packet for the chip
  */
-unsigned char *op_nonce(size_t cnt, unsigned char *data);
+const unsigned char *op_nonce(unsigned char *buffer, size_t cnt, const unsigned char *data);
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -134,14 +152,20 @@ unsigned char *op_nonce(size_t cnt, unsigned char *data);
  * \return status code
  */
 int op_nonce_recv(unsigned char *packet);
+/**
+ * \brief Mode (param1) of HMAC command
+ * \param use_sn_in_digest combine key and challenge with serial number
+ */
+unsigned char op_hmac_mode(bool use_sn_in_digest);
 /**
  * \brief Generate packet for HMAC command
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
+ * \param [out] buffer buffer with at least ATSHA204_IO_BUFFER bytes for the packet
  * \param address slot number with key specified for HMAC digest
  * \param use_sn_in_digest combine key and challenge with serial number
  * \return raw packet for the chip
  */
-unsigned char *op_hmac(unsigned char address, bool use_sn_in_digest);
+const unsigned char *op_hmac(unsigned char *buffer, unsigned char address, bool use_sn_in_digest);
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -150,16 +174,22 @@ unsigned char *op_hmac(unsigned char address, bool use_sn_in_digest);
  * \return status code
  */
 int op_hmac_recv(unsigned char *packet, unsigned char *data);
+/**
+ * \brief Mode (param1) of MAC command
+ * \param use_sn_in_digest combine key and challenge with serial number
+ */
+unsigned char op_mac_mode(bool use_sn_in_digest);
 /**
  * \brief Generate packet for MAC command
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
+ * \param [out] buffer buffer with at least ATSHA204_IO_BUFFER bytes for the packet
  * \param address slot number with key specified for MAC digest
  * \param cnt size of challenge
  * \param data data of challenge to write
  * \param use_sn_in_digest combine key and challenge with serial number
  * \return raw packet for the chip
  */
-unsigned char *op_mac(unsigned char address, size_t cnt, unsigned char *data, bool use_sn_in_digest);
+const unsigned char *op_mac(unsigned char *buffer, unsigned char address, size_t cnt, const unsigned char *data, bool use_sn_in_digest);
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -170,9 +200,9 @@ unsigned char *op_mac(unsigned char address, size_t cnt, unsigned char *data, bo
 int op_mac_recv(unsigned char *packet, unsigned char *data);
 /**
  * \brief Generate packet for abstract operation that can read serial number from config memory
- * \return raw packet for the chip
+ * \return precomputed raw packet for the chip
  */
-unsigned char *op_serial_number();
+const unsigned char *op_serial_number();
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -184,11 +214,12 @@ int op_serial_number_recv(unsigned char *packet, unsigned char *data);
 /**
  * \brief Generate packet for Lock command
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
+ * \param [out] buffer buffer with at least ATSHA204_IO_BUFFER bytes for the packet
  * \param lock_config configuration of the command generated by get_lock_config()
  * \param crc CRC checksum of expected data in memory
  * \return raw packet for the chip
  */
-unsigned char *op_lock(unsigned char lock_config, const unsigned char *crc);
+const unsigned char *op_lock(unsigned char *buffer, unsigned char lock_config, const unsigned char *crc);
 /**
  * \brief Parse answer from the chip
  * \note The meaning of packet format is documented in original ATSHA204 Datasheet
@@ -0,0 +1,200 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "atsha204.h"
+#include "configuration.h"
+#include "api.h"
+#include "timing.h"
+
+static size_t entry_index(const struct timing_profile *profile, unsigned char opcode) {
+	size_t i;
+	for (i = 0; i < TIMING_OPCODES; i++) {
+		if (profile->entry[i].opcode == opcode) break;
+	}
+
+	return i;
+}
+
+static struct timing_entry *entry_get(struct timing_profile *profile, unsigned char opcode) {
+	size_t i = entry_index(profile, opcode);
+	if (i < TIMING_OPCODES) return &profile->entry[i];
+
+	//Take the first empty entry
+	i = entry_index(profile, 0);
+	if (i == TIMING_OPCODES) return NULL;
+
+	profile->entry[i].opcode = opcode;
+	profile->entry[i].samples = 0;
+
+	return &profile->entry[i];
+}
+
+unsigned int timing_wait(const struct timing_profile *profile, unsigned char opcode, unsigned int typical, unsigned int max) {
+	size_t i = entry_index(profile, opcode);
+	if (i == TIMING_OPCODES || profile->entry[i].samples < TIMING_MIN_SAMPLES) return typical;
+	const struct timing_entry *entry = &profile->entry[i];
+
+	//Slightly shorter wait than median; the device answers at the first poll about half of the time
+	unsigned int wait = entry->median - (entry->median * TIMING_WAIT_MARGIN / 100);
+	if (wait > max) wait = max;
+
+	return wait;
+}
+
+void timing_record(struct timing_profile *profile, unsigned char opcode, unsigned int busy, unsigned int ready, unsigned int max) {
+	if (opcode == 0) return;
+	struct timing_entry *entry = entry_get(profile, opcode);
+	if (entry == NULL) return;
+
+	if (ready > max) ready = max;
+	if (busy > ready) busy = ready;
+	//Answer without any busy poll is bounded from above only
+	uint32_t sample = (busy == 0) ? ready : (busy + ready) / 2;
+
+	profile->changed = true;
+	if (entry->samples == 0) {
+		entry->samples = 1;
+		entry->ewma = sample;
+		entry->median = sample;
+		return;
+	}
+	if (entry->samples < UINT32_MAX) entry->samples++;
+
+	entry->ewma = (uint32_t)((int64_t)entry->ewma + ((int64_t)sample - (int64_t)entry->ewma) / TIMING_EWMA_WEIGHT);
+
+	//Move median estimate towards the side where the sample lies
+	uint32_t step = entry->ewma / TIMING_MEDIAN_STEP;
+	if (step == 0) step = 1;
+	bool above;
+	if (ready <= entry->median) {
+		above = false;
+	} else if (busy >= entry->median) {
+		above = true;
+	} else {
+		above = (sample > entry->median);
+	}
+
+	if (above) {
+		entry->median = (entry->median + step > max) ? max : entry->median + step;
+	} else {
+		entry->median = (entry->median > step) ? entry->median - step : 1;
+	}
+}
+
+#ifdef TIMING_PROFILE_FILE
+/*
+ * Format of the file is:
+ * <opcode> <samples> <moving average> <median> <device path>
+ */
+void timing_load(struct timing_profile *profile, const char *device) {
+	char line[BUFFSIZE_LINE];
+	unsigned int opcode, ewma, median;
+	unsigned long samples;
+	int path_pos;
+
+	FILE *file = fopen(TIMING_PROFILE_FILE, "r");
+	if (file == NULL) return;
+
+	while (fgets(line, BUFFSIZE_LINE, file) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+
+		if (sscanf(line, "%u %lu %u %u %n", &opcode, &samples, &ewma, &median, &path_pos) != 4) continue;
+		if (opcode == 0 || opcode > 0xFF || median == 0 || strcmp(line + path_pos, device) != 0) continue;
+
+		struct timing_entry *entry = entry_get(profile, (unsigned char)opcode);
+		if (entry == NULL) continue;
+		entry->samples = (samples > UINT32_MAX) ? UINT32_MAX : (uint32_t)samples;
+		entry->ewma = ewma;
+		entry->median = median;
+	}
+
+	fclose(file);
+	profile->changed = false;
+}
+
+/*
+ * Replace profile file atomically; records of other devices are kept
+ */
+void timing_store(struct timing_profile *profile, const char *device) {
+	if (!profile->changed) return;
+
+	char tmp_path[BUFFSIZE_LINE];
+	snprintf(tmp_path, BUFFSIZE_LINE, "%s.XXXXXX", TIMING_PROFILE_FILE);
+
+	int fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		log_message("timing: timing_store: couldn't create profile file");
+		return;
+	}
+	fchmod(fd, 0644);
+
+	FILE *file = fdopen(fd, "w");
+	if (file == NULL) {
+		close(fd);
+		unlink(tmp_path);
+		log_message("timing: timing_store: couldn't open profile file");
+		return;
+	}
+
+	FILE *old = fopen(TIMING_PROFILE_FILE, "r");
+	if (old != NULL) {
+		char line[BUFFSIZE_LINE];
+		int path_pos;
+		unsigned int number;
+		while (fgets(line, BUFFSIZE_LINE, old) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			if (sscanf(line, "%u %u %u %u %n", &number, &number, &number, &number, &path_pos) != 4) continue;
+			if (strcmp(line + path_pos, device) == 0) continue;
+			fprintf(file, "%s\n", line);
+		}
+		fclose(old);
+	}
+
+	for (size_t i = 0; i < TIMING_OPCODES; i++) {
+		const struct timing_entry *entry = &profile->entry[i];
+		if (entry->opcode == 0 || entry->samples == 0) continue;
+		fprintf(file, "%u %lu %u %u %s\n", (unsigned int)entry->opcode, (unsigned long)entry->samples, (unsigned int)entry->ewma, (unsigned int)entry->median, device);
+	}
+
+	if (fclose(file) != 0 || rename(tmp_path, TIMING_PROFILE_FILE) != 0) {
+		unlink(tmp_path);
+		log_message("timing: timing_store: couldn't write profile file");
+		return;
+	}
+	profile->changed = false;
+}
+#else
+void timing_load(struct timing_profile *profile, const char *device) {
+	(void) profile;
+	(void) device;
+}
+
+void timing_store(struct timing_profile *profile, const char *device) {
+	(void) profile;
+	(void) device;
+}
+#endif
@@ -0,0 +1,89 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "configuration.h"
+
+/**
+ * \file timing.h
+ * \brief Learned execution times of commands
+ *
+ * Execution time of commands differs by revision of the chip, temperature
+ * and bus adapter. Each instance records when the answer of a command
+ * became available and waits a bit shorter than the median before it
+ * starts to poll the device. The median is tracked by stochastic
+ * approximation; its step is derived from moving average of the latency.
+ */
+
+/**
+ * \brief Learned execution time of one command
+ */
+struct timing_entry {
+	unsigned char opcode; ///<Opcode of the command; 0 if the entry is empty
+	uint32_t samples; ///<Number of recorded executions
+	uint32_t ewma; ///<Moving average of execution time in microseconds
+	uint32_t median; ///<Estimate of median execution time in microseconds
+};
+
+/**
+ * \brief Learned execution times of all commands of the device
+ */
+struct timing_profile {
+	struct timing_entry entry[TIMING_OPCODES]; ///<Entries of known commands
+	bool changed; ///<Are there samples not stored in profile file yet?
+};
+
+/**
+ * \brief Initial wait before the device is polled for an answer
+ * \param opcode Opcode of the command
+ * \param typical Typical execution time from datasheet; used until enough executions are recorded
+ * \param max Maximal execution time from datasheet
+ * \return time in microseconds
+ */
+unsigned int timing_wait(const struct timing_profile *profile, unsigned char opcode, unsigned int typical, unsigned int max);
+/**
+ * \brief Record execution of a command
+ *
+ * The answer became available after the last poll that found the device
+ * busy and before the first successful one.
+ * \param busy Time of the last poll that found the device busy; 0 if there is no such poll
+ * \param ready Time of the successful poll
+ * \param max Maximal execution time from datasheet
+ */
+void timing_record(struct timing_profile *profile, unsigned char opcode, unsigned int busy, unsigned int ready, unsigned int max);
+/**
+ * \brief Load profile of the device from profile file
+ *
+ * It does nothing unless TIMING_PROFILE_FILE is defined in build time.
+ * \param device Path of device file; key in profile file
+ */
+void timing_load(struct timing_profile *profile, const char *device);
+/**
+ * \brief Store changed profile of the device to profile file
+ *
+ * It does nothing unless TIMING_PROFILE_FILE is defined in build time.
+ * \param device Path of device file; key in profile file
+ */
+void timing_store(struct timing_profile *profile, const char *device);
+
+#endif //TIMING_H
@@ -21,20 +21,70 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "tools.h"
 
 static const uint16_t POLYNOM = 0x8005; //TODO: Move this constant to more reasonable place
 
-/**
- * This function gets two chars, that are representing hex string, and
- * return real byte value.
+/*
+ * Slice-by-4 tables of CRC; crc_table[k] advances CRC over byte followed by k zero bytes
+ */
+static uint16_t crc_table[4][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Classes of characters in hexadecimal text; digits carry their value in low bits
  */
-unsigned char get_number_from_hex_char(char high, char low) {
-	char str[3];
-	str[0] = high; str[1] = low; str[2] = '\0';
+#define HEX_DIGIT 0x10
+#define HEX_DELIMITER 0x20
+#define HEX_LINE_END 0x40
+static const unsigned char HEX_CLASS[256] = {
+	['0'] = HEX_DIGIT | 0x0, ['1'] = HEX_DIGIT | 0x1, ['2'] = HEX_DIGIT | 0x2, ['3'] = HEX_DIGIT | 0x3,
+	['4'] = HEX_DIGIT | 0x4, ['5'] = HEX_DIGIT | 0x5, ['6'] = HEX_DIGIT | 0x6, ['7'] = HEX_DIGIT | 0x7,
+	['8'] = HEX_DIGIT | 0x8, ['9'] = HEX_DIGIT | 0x9,
+	['a'] = HEX_DIGIT | 0xA, ['b'] = HEX_DIGIT | 0xB, ['c'] = HEX_DIGIT | 0xC,
+	['d'] = HEX_DIGIT | 0xD, ['e'] = HEX_DIGIT | 0xE, ['f'] = HEX_DIGIT | 0xF,
+	['A'] = HEX_DIGIT | 0xA, ['B'] = HEX_DIGIT | 0xB, ['C'] = HEX_DIGIT | 0xC,
+	['D'] = HEX_DIGIT | 0xD, ['E'] = HEX_DIGIT | 0xE, ['F'] = HEX_DIGIT | 0xF,
+	[' '] = HEX_DELIMITER, ['\t'] = HEX_DELIMITER, [';'] = HEX_DELIMITER, [','] = HEX_DELIMITER, [':'] = HEX_DELIMITER,
+	['\r'] = HEX_LINE_END, ['\n'] = HEX_LINE_END
+};
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+bool hex_decode(const char *text, unsigned char *data, size_t len, const char **end) {
+	const unsigned char *pos = (const unsigned char *)text;
+
+	for (size_t i = 0; i < len; i++) {
+		while (HEX_CLASS[*pos] & HEX_DELIMITER) pos++;
+
+		unsigned char high = HEX_CLASS[pos[0]];
+		if (!(high & HEX_DIGIT)) return false;
+		unsigned char low = HEX_CLASS[pos[1]];
+		if (!(low & HEX_DIGIT)) return false;
+
+		data[i] = ((high & 0x0F) << 4) | (low & 0x0F);
+		pos += 2;
+	}
+
+	if (end != NULL) {
+		*end = (const char *)pos;
+		return true;
+	}
 
-	return (unsigned char)strtol(str, NULL, 16);
+	//Nothing but delimiters may follow
+	while (HEX_CLASS[*pos] & (HEX_DELIMITER | HEX_LINE_END)) pos++;
+
+	return *pos == '\0';
+}
+
+void hex_encode(const unsigned char *data, size_t len, char *text) {
+	for (size_t i = 0; i < len; i++) {
+		text[2 * i] = HEX_DIGITS[data[i] >> 4];
+		text[2 * i + 1] = HEX_DIGITS[data[i] & 0x0F];
+	}
+	text[2 * len] = '\0';
 }
 
 uint32_t uint32_from_4_bytes(const unsigned char *data) {
@@ -48,7 +98,25 @@ uint32_t uint32_from_4_bytes(const unsigned char *data) {
 	return res;
 }
 
-bool check_packet(unsigned char *packet) {
+uint64_t monotonic_time_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+void realtime_deadline(uint64_t timeout, struct timespec *deadline) {
+	clock_gettime(CLOCK_REALTIME, deadline);
+
+	deadline->tv_sec += timeout / 1000000;
+	deadline->tv_nsec += (timeout % 1000000) * 1000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+bool check_packet(const unsigned char *packet) {
 	unsigned char packet_size;
 	unsigned char crc[2];
 
@@ -63,7 +131,7 @@ bool check_packet(unsigned char *packet) {
 	return true;
 }
 
-unsigned char *generate_command_packet(unsigned char opcode, unsigned char param1, uint16_t param2, unsigned char *data, unsigned char data_count) {
+const unsigned char *generate_command_packet(unsigned char *packet, unsigned char opcode, unsigned char param1, uint16_t param2, const unsigned char *data, unsigned char data_count) {
 	unsigned char packet_size =
 		1 + //count item
 		1 + //opcode
@@ -73,17 +141,13 @@ unsigned char *generate_command_packet(unsigned char opcode, unsigned char param
 		2; //CRC
 
 	unsigned char crc[2];
-	unsigned char *packet = calloc(packet_size, sizeof(unsigned char));
-	if (packet == NULL) {
-		return NULL;
-	}
 
 	packet[0] = packet_size;
 	packet[1] = opcode;
 	packet[2] = param1;
 	packet[3] = (param2 & 0x00FF);
 	packet[4] = ((param2 & 0xFF00) >> 8);
-	memcpy((packet + 5), data, data_count);
+	if (data_count > 0) memcpy((packet + 5), data, data_count);
 	calculate_crc(packet_size - 2, packet, crc); //skip crc slot
 	packet[5 + data_count] = crc[0];
 	packet[5 + data_count + 1] = crc[1];
@@ -91,28 +155,22 @@ unsigned char *generate_command_packet(unsigned char opcode, unsigned char param
 	return packet;
 }
 
-unsigned char *generate_answer_packet(unsigned char *data, unsigned char data_count) {
+void generate_answer_packet(unsigned char *packet, const unsigned char *data, unsigned char data_count) {
 	unsigned char packet_size =
 		1 + //count item
 		data_count + //data count
 		2; //CRC
 
 	unsigned char crc[2];
-	unsigned char *packet = calloc(packet_size, sizeof(unsigned char));
-	if (packet == NULL) {
-		return NULL;
-	}
 
 	packet[0] = packet_size;
 	memcpy((packet + 1), data, data_count);
 	calculate_crc(packet_size - 2, packet, crc); //skip crc slot
 	packet[1 + data_count] = crc[0];
 	packet[1 + data_count + 1] = crc[1];
-
-	return packet;
 }
 
-bool check_crc(unsigned char length, unsigned char *data, unsigned char *crc) {
+bool check_crc(unsigned char length, const unsigned char *data, const unsigned char *crc) {
 	unsigned char rcrc[2];
 
 	calculate_crc(length, data, rcrc);
@@ -123,22 +181,56 @@ bool check_crc(unsigned char length, unsigned char *data, unsigned char *crc) {
 	return true;
 }
 
-void calculate_crc(uint16_t length, unsigned char *data, unsigned char *crc) {
-	uint16_t counter;
+static uint16_t mirror16(uint16_t value) {
+	uint16_t result = 0;
+	for (size_t i = 0; i < 16; i++) {
+		result = (result << 1) | (value & 1);
+		value >>= 1;
+	}
+
+	return result;
+}
+
+/*
+ * Device shifts data bits LSB first into register that is shifted towards
+ * MSB. It is common reflected CRC in mirrored register, so tables use
+ * mirrored polynomial and only the result is mirrored back.
+ */
+static void crc_table_init(void) {
+	uint16_t polynom = mirror16(POLYNOM);
+
+	for (size_t i = 0; i < 256; i++) {
+		uint16_t crc_register = i;
+		for (size_t bit = 0; bit < 8; bit++) {
+			crc_register = (crc_register & 1) ? ((crc_register >> 1) ^ polynom) : (crc_register >> 1);
+		}
+		crc_table[0][i] = crc_register;
+	}
+
+	for (size_t slice = 1; slice < 4; slice++) {
+		for (size_t i = 0; i < 256; i++) {
+			uint16_t prev = crc_table[slice - 1][i];
+			crc_table[slice][i] = (prev >> 8) ^ crc_table[0][prev & 0xFF];
+		}
+	}
+}
+
+void calculate_crc(uint16_t length, const unsigned char *data, unsigned char *crc) {
+	uint16_t counter = 0;
 	uint16_t crc_register = 0;
-	uint16_t polynom = POLYNOM;
-	unsigned char shift_register;
-	unsigned char data_bit, crc_bit;
-
-	for (counter = 0; counter < length; counter++) {
-	  for (shift_register = 0x01; shift_register > 0x00; shift_register <<= 1) {
-		 data_bit = (data[counter] & shift_register) ? 1 : 0;
-		 crc_bit = crc_register >> 15;
-		 crc_register <<= 1;
-		 if (data_bit != crc_bit)
-			crc_register ^= polynom;
-	  }
+
+	pthread_once(&crc_table_once, crc_table_init);
+
+	//Four bytes per step; CRC overlaps the first two of them
+	for (; length - counter >= 4; counter += 4) {
+		uint16_t low = crc_register ^ (data[counter] | (data[counter + 1] << 8));
+		crc_register = crc_table[3][low & 0xFF] ^ crc_table[2][low >> 8] ^ crc_table[1][data[counter + 2]] ^ crc_table[0][data[counter + 3]];
 	}
+	for (; counter < length; counter++) {
+		crc_register = (crc_register >> 8) ^ crc_table[0][(crc_register ^ data[counter]) & 0xFF];
+	}
+
+	crc_register = mirror16(crc_register);
 	crc[0] = (unsigned char) (crc_register & 0x00FF);
 	crc[1] = (unsigned char) (crc_register >> 8);
 }
@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
 /**
  * \file tools.h
@@ -34,15 +35,28 @@
  * \param[in] data pointer to data for which CRC should be calculated
  * \param[out] crc pointer to 16-bit CRC
  */
-void calculate_crc(uint16_t length, unsigned char *data, unsigned char *crc);
+void calculate_crc(uint16_t length, const unsigned char *data, unsigned char *crc);
 
 /**
- * \brief convert string that represents hexadecimal number to hexadecimal number
+ * \brief Decode bytes written as pairs of hexadecimal digits
  *
- * \param high 4 most significant bytes of number
- * \param low 4 less significant bytes of number
+ * Bytes may be separated by delimiters (space, tab, ';', ',' and ':').
+ * Digits of one byte can't be separated and both cases of letters are
+ * accepted.
+ * \param text String with hexadecimal digits
+ * \param [out] data Buffer for at least len bytes
+ * \param len Number of bytes to decode
+ * \param [out] end Position after the last decoded byte; if it is NULL, only delimiters and line end may follow
+ * \return false if text is malformed or shorter than len bytes
  */
-unsigned char get_number_from_hex_char(char high, char low);
+bool hex_decode(const char *text, unsigned char *data, size_t len, const char **end);
+
+/**
+ * \brief Write bytes as pairs of lower-case hexadecimal digits
+ *
+ * \param [out] text Buffer for at least 2 * len + 1 chars; output is terminated by '\0'
+ */
+void hex_encode(const unsigned char *data, size_t len, char *text);
 
 /**
  * \brief Get unsigned 32bit integer from 4 bytes in memory
@@ -51,6 +65,21 @@ unsigned char get_number_from_hex_char(char high, char low);
  */
 uint32_t uint32_from_4_bytes(const unsigned char *data);
 
+/**
+ * \brief Get time from monotonic clock
+ *
+ * \return time in microseconds
+ */
+uint64_t monotonic_time_us();
+/**
+ * \brief Absolute realtime clock value after given time
+ *
+ * Functions like pthread_mutex_timedlock() and sem_timedwait() need it.
+ * \param timeout time from now in microseconds
+ * \param [out] deadline absolute time
+ */
+void realtime_deadline(uint64_t timeout, struct timespec *deadline);
+
 /**
  * \brief check memory block CRC against another CRC
  *
@@ -58,28 +87,31 @@ uint32_t uint32_from_4_bytes(const unsigned char *data);
  * \param data memory block
  * \param another CRC
  */
-bool check_crc(unsigned char length, unsigned char *data, unsigned char *crc);
+bool check_crc(unsigned char length, const unsigned char *data, const unsigned char *crc);
 
 /**
  * \brief Check if packet's CRC matches
  *
  * \param packet Raw packet
  */
-bool check_packet(unsigned char *packet);
+bool check_packet(const unsigned char *packet);
 
 /**
  * \brief Packet generator
  *
  * This generator creates command packet. It is part of logic of middle layer.
+ * \param [out] packet buffer with at least ATSHA204_IO_BUFFER bytes
+ * \return filled packet
  */
-unsigned char *generate_command_packet(unsigned char opcode, unsigned char param1, uint16_t param2, unsigned char *data, unsigned char data_count);
+const unsigned char *generate_command_packet(unsigned char *packet, unsigned char opcode, unsigned char param1, uint16_t param2, const unsigned char *data, unsigned char data_count);
 
 /**
  * \brief Answer packet generator
  *
  * This generator creates packet with answer. It is part of emulation logic
+ * \param [out] packet buffer with at least ATSHA204_IO_BUFFER bytes
  */
-unsigned char *generate_answer_packet(unsigned char *data, unsigned char data_count);
+void generate_answer_packet(unsigned char *packet, const unsigned char *data, unsigned char data_count);
 
 /**
  * \brief Debug method
@@ -0,0 +1,247 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "atsha204.h"
+#include "api.h"
+#include "tools.h"
+#include "worker.h"
+
+/*
+ * One request; it's shared by waiting caller and worker, the last one frees it
+ *
+ * Caller could give up waiting at its deadline, so items are copied to the
+ * request and worker never touches memory of the caller.
+ */
+struct worker_request {
+	struct worker_request *next;
+	int refs;
+	bool abandoned; ///<Caller doesn't wait anymore
+	int status;
+	sem_t done;
+	size_t count;
+	atsha_challenge_item items[];
+};
+struct atsha_worker {
+	struct atsha_handle *handle;
+	worker_run_batch run;
+	pthread_t thread;
+	struct worker_request *queue; //Lock-free stack; producers push, worker takes all at once
+	sem_t signal;
+	bool stop;
+	atsha_challenge_item *batch;
+	size_t batch_size;
+};
+
+static void request_release(struct worker_request *request) {
+	if (__atomic_sub_fetch(&request->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+	sem_destroy(&request->done);
+	free(request);
+}
+
+static void request_finish(struct worker_request *request) {
+	request->status = ATSHA_ERR_OK;
+	for (size_t i = 0; i < request->count; i++) {
+		if (request->items[i].status != ATSHA_ERR_OK) {
+			request->status = request->items[i].status;
+			break;
+		}
+	}
+
+	sem_post(&request->done);
+	request_release(request);
+}
+
+/*
+ * Process requests in one batch; batch buffer grows as needed
+ */
+static void process(struct atsha_worker *worker, struct worker_request *requests) {
+	//Requests of callers that gave up aren't sent to the device
+	struct worker_request **link = &requests;
+	while (*link != NULL) {
+		struct worker_request *request = *link;
+		if (__atomic_load_n(&request->abandoned, __ATOMIC_ACQUIRE)) {
+			*link = request->next;
+			request_release(request);
+		} else {
+			link = &request->next;
+		}
+	}
+
+	size_t count = 0;
+	for (struct worker_request *request = requests; request != NULL; request = request->next) {
+		count += request->count;
+	}
+
+	if (count > worker->batch_size) {
+		atsha_challenge_item *batch = (atsha_challenge_item *)realloc(worker->batch, count * sizeof(atsha_challenge_item));
+		if (batch != NULL) {
+			worker->batch = batch;
+			worker->batch_size = count;
+		}
+	}
+
+	if (count > worker->batch_size) {
+		//Fallback without memory - one batch per request
+		while (requests != NULL) {
+			struct worker_request *next = requests->next;
+			worker->run(worker->handle, requests->items, requests->count);
+			request_finish(requests);
+			requests = next;
+		}
+		return;
+	}
+
+	size_t pos = 0;
+	for (struct worker_request *request = requests; request != NULL; request = request->next) {
+		memcpy(worker->batch + pos, request->items, request->count * sizeof(atsha_challenge_item));
+		pos += request->count;
+	}
+
+	worker->run(worker->handle, worker->batch, count);
+
+	pos = 0;
+	while (requests != NULL) {
+		//Request could be released by its owner right after finish
+		struct worker_request *next = requests->next;
+		memcpy(requests->items, worker->batch + pos, requests->count * sizeof(atsha_challenge_item));
+		pos += requests->count;
+		request_finish(requests);
+		requests = next;
+	}
+}
+
+static void *worker_loop(void *arg) {
+	struct atsha_worker *worker = (struct atsha_worker *)arg;
+
+	while (true) {
+		while (sem_wait(&worker->signal) == -1 && errno == EINTR);
+
+		struct worker_request *stack = __atomic_exchange_n(&worker->queue, NULL, __ATOMIC_ACQUIRE);
+		if (stack == NULL) {
+			if (__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) break;
+			continue;
+		}
+
+		//Stack has the newest request on the top; restore order of arrival
+		struct worker_request *requests = NULL;
+		while (stack != NULL) {
+			struct worker_request *next = stack->next;
+			stack->next = requests;
+			requests = stack;
+			stack = next;
+		}
+
+		process(worker, requests);
+	}
+
+	return NULL;
+}
+
+struct atsha_worker *worker_start(struct atsha_handle *handle, worker_run_batch run) {
+	struct atsha_worker *worker = (struct atsha_worker *)calloc(1, sizeof(struct atsha_worker));
+	if (worker == NULL) return NULL;
+
+	worker->handle = handle;
+	worker->run = run;
+	worker->queue = NULL;
+	worker->stop = false;
+	worker->batch = NULL;
+	worker->batch_size = 0;
+
+	if (sem_init(&worker->signal, 0, 0) == -1) {
+		free(worker);
+		return NULL;
+	}
+
+	if (pthread_create(&worker->thread, NULL, worker_loop, worker) != 0) {
+		log_message("worker: start: couldn't create thread");
+		sem_destroy(&worker->signal);
+		free(worker);
+		return NULL;
+	}
+
+	return worker;
+}
+
+void worker_stop(struct atsha_worker *worker) {
+	if (worker == NULL) return;
+
+	__atomic_store_n(&worker->stop, true, __ATOMIC_RELEASE);
+	sem_post(&worker->signal);
+	pthread_join(worker->thread, NULL);
+
+	sem_destroy(&worker->signal);
+	free(worker->batch);
+	free(worker);
+}
+
+int worker_submit(struct atsha_worker *worker, atsha_challenge_item *items, size_t count, uint64_t timeout) {
+	if (count == 0) return ATSHA_ERR_OK;
+
+	struct worker_request *request = (struct worker_request *)malloc(sizeof(struct worker_request) + count * sizeof(atsha_challenge_item));
+	if (request == NULL) return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+
+	memcpy(request->items, items, count * sizeof(atsha_challenge_item));
+	request->count = count;
+	request->refs = 2; //caller and worker
+	request->abandoned = false;
+	request->status = ATSHA_ERR_OK;
+	if (sem_init(&request->done, 0, 0) == -1) {
+		free(request);
+		return ATSHA_ERR_MEMORY_ALLOCATION_ERROR;
+	}
+
+	struct worker_request *head = __atomic_load_n(&worker->queue, __ATOMIC_RELAXED);
+	do {
+		request->next = head;
+	} while (!__atomic_compare_exchange_n(&worker->queue, &head, request, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	sem_post(&worker->signal);
+
+	int ret;
+	if (timeout == UINT64_MAX) {
+		while ((ret = sem_wait(&request->done)) == -1 && errno == EINTR);
+	} else {
+		struct timespec deadline;
+		realtime_deadline(timeout, &deadline);
+		while ((ret = sem_timedwait(&request->done, &deadline)) == -1 && errno == EINTR);
+	}
+
+	int status;
+	if (ret == 0) {
+		memcpy(items, request->items, count * sizeof(atsha_challenge_item));
+		status = request->status;
+	} else {
+		log_message("worker: submit: Deadline of the call expired before worker processed the request");
+		__atomic_store_n(&request->abandoned, true, __ATOMIC_RELEASE);
+		status = ATSHA_ERR_TIMEOUT;
+	}
+	request_release(request);
+
+	return status;
+}
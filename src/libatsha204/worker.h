@@ -0,0 +1,61 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "atsha204.h"
+
+/**
+ * \file worker.h
+ * \brief Thread that owns the bus and batches challenge-response requests
+ */
+
+struct atsha_worker;
+
+/**
+ * \brief Function that processes whole batch of challenge-response items
+ */
+typedef int (*worker_run_batch)(struct atsha_handle *handle, atsha_challenge_item *items, size_t count);
+
+/**
+ * \brief Start worker thread for library instance
+ * \param run Function that communicates with the device
+ * \return worker instance or NULL on failure
+ */
+struct atsha_worker *worker_start(struct atsha_handle *handle, worker_run_batch run);
+/**
+ * \brief Process all queued requests and stop worker thread
+ */
+void worker_stop(struct atsha_worker *worker);
+/**
+ * \brief Queue items and wait until worker processes them
+ *
+ * Items queued by different threads at the same time are processed
+ * together in one wake period.
+ * \param timeout the longest wait in microseconds; UINT64_MAX waits until items are processed
+ * \return ATSHA_ERR_OK if all items succeeded, status code of first failed item otherwise;
+ * ATSHA_ERR_TIMEOUT if the wait expired (items are left untouched then)
+ */
+int worker_submit(struct atsha_worker *worker, atsha_challenge_item *items, size_t count, uint64_t timeout);
+
+#endif //WORKER_H
@@ -21,6 +21,12 @@
 #include <dlfcn.h>
 #include <atsha204.h>
 
+#include "../libatsha204/atsha204consts.h"
+#include "../libatsha204/configuration.h"
+
+//Length of serial number returned by get_serial()
+#define SERIAL_BYTE_LEN (USE_OUR_SN ? 2*ATSHA204_OTP_BYTE_LEN : ATSHA204_SN_BYTE_LEN)
+
 /*
  * As linking to other libraries from python extensions is tricky,
  * we do fully dynamic loading of the library with dlopen.
@@ -35,6 +41,10 @@ static PyObject *atsha_emulate_hmac(PyObject *self, PyObject *args) {
 		return NULL;
 	}
 
+	if (SERIAL_BYTE_LEN != size_serial) {
+		PyErr_Format(PyExc_ValueError, "serial length should be %d!", SERIAL_BYTE_LEN);
+		return NULL;
+	}
 	if (32 != size_key) {
 		PyErr_SetString(PyExc_ValueError, "key length should be 32!");
 		return NULL;
@@ -44,21 +54,51 @@ static PyObject *atsha_emulate_hmac(PyObject *self, PyObject *args) {
 		return NULL;
 	}
 
-	struct atsha_handle *crypto = atsha_open_server_emulation(slot_id, serial, key);
-	if (NULL == crypto) {
-        PyErr_SetString(PyExc_RuntimeError, "failed to initialize crypto library");
-        return NULL;
-    }
-	atsha_big_int challenge_s, response_s;
-	challenge_s.bytes = 32;
-	memcpy(challenge_s.data, challenge, 32);
-	int result = atsha_challenge_response(crypto, challenge_s, &response_s);
+	//Serial number is combined with challenge as by atsha_challenge_response()
+	unsigned char response[32];
+	int result = atsha_server_response(slot_id, serial, key, challenge, ATSHA_CHALLENGE_HMAC, DEFAULT_USE_SN_IN_DIGEST, response);
 	if (ATSHA_ERR_OK != result) {
 		PyErr_SetString(PyExc_ValueError, atsha_error_name(result));
 		return NULL;
 	}
-	atsha_close(crypto);
-	return Py_BuildValue("s#", response_s.data, (int) response_s.bytes);
+	return Py_BuildValue("s#", response, 32);
+}
+
+static PyObject *atsha_verify_hmac(PyObject *self, PyObject *args) {
+	(void) self;
+	int size_serial, size_key, size_challenge, size_response;
+	unsigned char slot_id;
+	const uint8_t *serial, *key, *challenge, *response;
+	if (!PyArg_ParseTuple(args, "bs#s#s#s#", &slot_id, &serial, &size_serial, &key, &size_key, &challenge, &size_challenge, &response, &size_response)) {
+		return NULL;
+	}
+
+	if (SERIAL_BYTE_LEN != size_serial) {
+		PyErr_Format(PyExc_ValueError, "serial length should be %d!", SERIAL_BYTE_LEN);
+		return NULL;
+	}
+	if (32 != size_key) {
+		PyErr_SetString(PyExc_ValueError, "key length should be 32!");
+		return NULL;
+	}
+	if (32 != size_challenge) {
+		PyErr_SetString(PyExc_ValueError, "challenge length should be 32!");
+		return NULL;
+	}
+	if (32 != size_response) {
+		PyErr_SetString(PyExc_ValueError, "response length should be 32!");
+		return NULL;
+	}
+
+	int result = atsha_server_verify(slot_id, serial, key, challenge, ATSHA_CHALLENGE_HMAC, DEFAULT_USE_SN_IN_DIGEST, response);
+	if (ATSHA_ERR_RESPONSE_MISMATCH == result) {
+		Py_RETURN_FALSE;
+	}
+	if (ATSHA_ERR_OK != result) {
+		PyErr_SetString(PyExc_ValueError, atsha_error_name(result));
+		return NULL;
+	}
+	Py_RETURN_TRUE;
 }
 
 static PyObject *atsha_do_hmac(PyObject *self, PyObject *args) {
@@ -119,7 +159,16 @@ static PyMethodDef atsha_methods[] = {
 		atsha_emulate_hmac,
 		METH_VARARGS,
 		"Emulates computation of hmac from atsh204 cryptographic chip.\n"
-		"hmac(slot_id, serial, key, challenge) where len(key)=32 and len(challenge)=32"
+		"hmac(slot_id, serial, key, challenge) where serial is as returned by\n"
+		"get_serial(), len(key)=32 and len(challenge)=32"
+	},
+	{
+		"verify_hmac",
+		atsha_verify_hmac,
+		METH_VARARGS,
+		"Verifies hmac computed by atsh204 cryptographic chip in constant time.\n"
+		"verify_hmac(slot_id, serial, key, challenge, response) where serial is as\n"
+		"returned by get_serial(), len(key)=32, len(challenge)=32 and len(response)=32"
 	},
 	{
 		"hmac",
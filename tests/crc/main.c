@@ -0,0 +1,106 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../../src/libatsha204/tools.h"
+
+#define TEST_MAX_LEN 1024
+#define TEST_ROUNDS 100000
+#define BENCH_PACKET_LEN 82 //the longest packet without CRC
+#define BENCH_ROUNDS 1000000
+
+/*
+ * Original bit-by-bit implementation; the table-driven one has to match it exactly
+ */
+static void reference_crc(uint16_t length, const unsigned char *data, unsigned char *crc) {
+	uint16_t crc_register = 0;
+
+	for (uint16_t counter = 0; counter < length; counter++) {
+		for (unsigned char shift_register = 0x01; shift_register > 0x00; shift_register <<= 1) {
+			unsigned char data_bit = (data[counter] & shift_register) ? 1 : 0;
+			unsigned char crc_bit = crc_register >> 15;
+			crc_register <<= 1;
+			if (data_bit != crc_bit) crc_register ^= 0x8005;
+		}
+	}
+	crc[0] = (unsigned char) (crc_register & 0x00FF);
+	crc[1] = (unsigned char) (crc_register >> 8);
+}
+
+static double now_s(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double bench(void (*crc_function)(uint16_t, const unsigned char *, unsigned char *), const unsigned char *data) {
+	unsigned char crc[2];
+	unsigned int sum = 0;
+
+	double start = now_s();
+	for (size_t i = 0; i < BENCH_ROUNDS; i++) {
+		crc_function(BENCH_PACKET_LEN, data, crc);
+		sum += crc[0];
+	}
+	double elapsed = now_s() - start;
+	if (sum == 1) printf(" "); //Keep the loop
+
+	return elapsed * 1e9 / BENCH_ROUNDS;
+}
+
+int main(void) {
+	unsigned char data[TEST_MAX_LEN];
+	unsigned char crc[2], expected[2];
+
+	srand(1);
+
+	//Known answer: precomputed packet of DevRev command
+	const unsigned char dev_rev[] = { 0x07, 0x30, 0x00, 0x00, 0x00 };
+	calculate_crc(sizeof(dev_rev), dev_rev, crc);
+	if (crc[0] != 0x03 || crc[1] != 0x5D) {
+		printf("FAIL: DevRev packet CRC %02X %02X\n", crc[0], crc[1]);
+		return 1;
+	}
+
+	for (size_t round = 0; round < TEST_ROUNDS; round++) {
+		uint16_t length = rand() % ((round < TEST_ROUNDS / 2) ? 100 : TEST_MAX_LEN);
+		for (size_t i = 0; i < length; i++) {
+			data[i] = rand();
+		}
+
+		calculate_crc(length, data, crc);
+		reference_crc(length, data, expected);
+		if (crc[0] != expected[0] || crc[1] != expected[1]) {
+			printf("FAIL: length %u: %02X %02X instead of %02X %02X\n", length, crc[0], crc[1], expected[0], expected[1]);
+			return 1;
+		}
+	}
+	printf("OK: %d random buffers match bit-by-bit implementation\n", TEST_ROUNDS);
+
+	printf("bit-by-bit: %6.1f ns per %d-byte packet\n", bench(reference_crc, data), BENCH_PACKET_LEN);
+	printf("table:      %6.1f ns per %d-byte packet\n", bench(calculate_crc, data), BENCH_PACKET_LEN);
+
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * libatsha204 is small library and set of tools for Amel ATSHA204 crypto chip
+ *
+ * Copyright (C) 2013 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "../../src/libatsha204/atsha204.h"
+#include "../../src/libatsha204/configuration.h"
+
+#define TEST_ROUNDS 1000
+#define BENCH_ROUNDS 100000
+
+void testing_log_callback(const char *msg) {
+	fprintf(stderr, "Log: %s\n", msg);
+}
+
+typedef int (*challenge_response_function)(struct atsha_handle *, unsigned char, atsha_big_int, atsha_big_int *, bool);
+
+static double now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static void random_challenge(atsha_big_int *challenge) {
+	challenge->bytes = 32;
+	for (size_t i = 0; i < challenge->bytes; i++) {
+		challenge->data[i] = rand() & 0xFF;
+	}
+}
+
+/*
+ * Direct computation has to give the same digests as packets handled by emulation
+ */
+static bool compare(struct atsha_handle *handle, const char *name, challenge_response_function function) {
+	atsha_big_int challenge, direct, packet;
+
+	for (int round = 0; round < TEST_ROUNDS; round++) {
+		unsigned char slot_number = round % 16;
+		bool use_sn = round % 2;
+		random_challenge(&challenge);
+
+		atsha_set_emulation_packets(handle, false);
+		if (function(handle, slot_number, challenge, &direct, use_sn) != ATSHA_ERR_OK) return false;
+		atsha_set_emulation_packets(handle, true);
+		if (function(handle, slot_number, challenge, &packet, use_sn) != ATSHA_ERR_OK) return false;
+
+		if (direct.bytes != 32 || packet.bytes != 32 || memcmp(direct.data, packet.data, 32) != 0) {
+			printf("FAIL: %s: slot %u differs\n", name, slot_number);
+			return false;
+		}
+	}
+	printf("OK: %s: %d challenges match packet mode\n", name, TEST_ROUNDS);
+
+	return true;
+}
+
+static double bench(struct atsha_handle *handle, challenge_response_function function, bool packets) {
+	atsha_big_int challenge, response;
+	random_challenge(&challenge);
+
+	atsha_set_emulation_packets(handle, packets);
+	double start = now_ns();
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		challenge.data[0] = round & 0xFF;
+		function(handle, 0, challenge, &response, true);
+	}
+
+	return (now_ns() - start) / BENCH_ROUNDS;
+}
+
+/*
+ * Stateless server-side computation has to match server-side emulation instance
+ */
+static bool compare_server() {
+	unsigned char serial_number[9], key[32], response[32];
+	atsha_big_int challenge, expected;
+
+	for (int round = 0; round < TEST_ROUNDS; round++) {
+		unsigned char slot_id = round % 16;
+		for (size_t i = 0; i < sizeof(serial_number); i++) serial_number[i] = rand() & 0xFF;
+		for (size_t i = 0; i < sizeof(key); i++) key[i] = rand() & 0xFF;
+		random_challenge(&challenge);
+
+		struct atsha_handle *handle = atsha_open_server_emulation(slot_id, serial_number, key);
+		if (handle == NULL) return false;
+		int status = atsha_low_challenge_response(handle, slot_id, challenge, &expected, round % 2);
+		atsha_close(handle);
+		if (status != ATSHA_ERR_OK) return false;
+
+		if (atsha_server_response(slot_id, serial_number, key, challenge.data, ATSHA_CHALLENGE_HMAC, round % 2, response) != ATSHA_ERR_OK || memcmp(response, expected.data, 32) != 0) {
+			printf("FAIL: server response: slot %u differs\n", slot_id);
+			return false;
+		}
+		if (atsha_server_verify(slot_id, serial_number, key, challenge.data, ATSHA_CHALLENGE_HMAC, round % 2, expected.data) != ATSHA_ERR_OK) {
+			printf("FAIL: server verify: correct response refused\n");
+			return false;
+		}
+		expected.data[round % 32] ^= 0x01;
+		if (atsha_server_verify(slot_id, serial_number, key, challenge.data, ATSHA_CHALLENGE_HMAC, round % 2, expected.data) != ATSHA_ERR_RESPONSE_MISMATCH) {
+			printf("FAIL: server verify: wrong response accepted\n");
+			return false;
+		}
+	}
+	if (atsha_server_response(0, key, key, key, 2, false, response) != ATSHA_ERR_INVALID_INPUT) {
+		printf("FAIL: server response: unknown mode accepted\n");
+		return false;
+	}
+	printf("OK: server: %d responses match server-side emulation\n", TEST_ROUNDS);
+
+	return true;
+}
+
+/*
+ * Message of HMAC/MAC command as described in datasheet; HMAC digests
+ * zeros instead of the key
+ */
+static size_t reference_message(unsigned char slot_id, const unsigned char *serial_number, const unsigned char *key, const unsigned char *challenge, unsigned char mode, bool use_sn, unsigned char *message) {
+	unsigned char sn_bit = USE_OUR_SN ? 0x20 : 0x40;
+
+	memset(message, 0, 88);
+	if (mode == ATSHA_CHALLENGE_MAC) memcpy(message, key, 32);
+	memcpy(message + 32, challenge, 32);
+	message[64] = (mode == ATSHA_CHALLENGE_HMAC) ? 0x11 : 0x08; //opcode
+	message[65] = ((mode == ATSHA_CHALLENGE_HMAC) ? 0x04 : 0x00) | (use_sn ? sn_bit : 0x00);
+	message[66] = slot_id;
+	if (use_sn && USE_OUR_SN) memcpy(message + 68, serial_number, 8);
+	message[79] = 0xEE;
+	if (use_sn && !USE_OUR_SN) {
+		memcpy(message + 80, serial_number + 4, 4);
+		message[86] = serial_number[2];
+		message[87] = serial_number[3];
+	}
+	message[84] = 0x01;
+	message[85] = 0x23;
+
+	return 88;
+}
+
+/*
+ * Digests of the library have to match generic HMAC() and SHA256 of OpenSSL
+ */
+static bool compare_reference() {
+	unsigned char serial_number[9], key[32], challenge[32], response[32];
+	unsigned char message[88], expected[32];
+	unsigned int expected_len;
+
+	for (int round = 0; round < TEST_ROUNDS; round++) {
+		unsigned char slot_id = round % 16;
+		unsigned char mode = (round / 2) % 2 ? ATSHA_CHALLENGE_MAC : ATSHA_CHALLENGE_HMAC;
+		bool use_sn = round % 2;
+		for (size_t i = 0; i < sizeof(serial_number); i++) serial_number[i] = rand() & 0xFF;
+		for (size_t i = 0; i < sizeof(key); i++) key[i] = rand() & 0xFF;
+		for (size_t i = 0; i < sizeof(challenge); i++) challenge[i] = rand() & 0xFF;
+
+		size_t message_len = reference_message(slot_id, serial_number, key, challenge, mode, use_sn, message);
+		bool ok;
+		if (mode == ATSHA_CHALLENGE_HMAC) {
+			ok = HMAC(EVP_sha256(), key, sizeof(key), message, message_len, expected, &expected_len) != NULL;
+		} else {
+			ok = EVP_Digest(message, message_len, expected, &expected_len, EVP_sha256(), NULL);
+		}
+		if (!ok || expected_len != 32) {
+			printf("FAIL: reference: OpenSSL failed\n");
+			return false;
+		}
+
+		if (atsha_server_response(slot_id, serial_number, key, challenge, mode, use_sn, response) != ATSHA_ERR_OK || memcmp(response, expected, 32) != 0) {
+			printf("FAIL: reference: %s of slot %u differs\n", (mode == ATSHA_CHALLENGE_HMAC) ? "HMAC" : "MAC", slot_id);
+			return false;
+		}
+	}
+	printf("OK: reference: %d responses match OpenSSL HMAC() and SHA256\n", TEST_ROUNDS);
+
+	return true;
+}
+
+/*
+ * Serial number returned by atsha_serial_number() is enough for server side;
+ * it's only 8 bytes long with our serial number
+ */
+static bool compare_serial_length() {
+	size_t serial_len = USE_OUR_SN ? 8 : 9;
+	unsigned char full_serial[9], key[32], challenge[32], expected[32], response[32];
+
+	for (int round = 0; round < TEST_ROUNDS; round++) {
+		unsigned char slot_id = round % 16;
+		for (size_t i = 0; i < sizeof(full_serial); i++) full_serial[i] = rand() & 0xFF;
+		for (size_t i = 0; i < sizeof(key); i++) key[i] = rand() & 0xFF;
+		for (size_t i = 0; i < sizeof(challenge); i++) challenge[i] = rand() & 0xFF;
+
+		//Exact allocation lets memory checkers catch reads behind the serial number
+		unsigned char *serial_number = malloc(serial_len);
+		if (serial_number == NULL) return false;
+		memcpy(serial_number, full_serial, serial_len);
+
+		bool ok = atsha_server_response(slot_id, full_serial, key, challenge, ATSHA_CHALLENGE_HMAC, true, expected) == ATSHA_ERR_OK;
+		ok = ok && atsha_server_response(slot_id, serial_number, key, challenge, ATSHA_CHALLENGE_HMAC, true, response) == ATSHA_ERR_OK;
+		ok = ok && memcmp(expected, response, 32) == 0;
+
+		struct atsha_handle *handle = atsha_open_server_emulation(slot_id, serial_number, key);
+		free(serial_number);
+		if (handle == NULL) return false;
+		atsha_big_int challenge_s, response_s;
+		challenge_s.bytes = 32;
+		memcpy(challenge_s.data, challenge, 32);
+		ok = ok && atsha_low_challenge_response(handle, slot_id, challenge_s, &response_s, true) == ATSHA_ERR_OK;
+		ok = ok && memcmp(expected, response_s.data, 32) == 0;
+		atsha_close(handle);
+
+		if (!ok) {
+			printf("FAIL: serial: %zu bytes serial number of slot %u gives different response\n", serial_len, slot_id);
+			return false;
+		}
+	}
+	printf("OK: serial: %zu bytes serial numbers match full ones\n", serial_len);
+
+	return true;
+}
+
+static double bench_server(bool stateless) {
+	unsigned char serial_number[9] = { 0 }, key[32] = { 0 }, response[32];
+	atsha_big_int challenge, expected;
+	random_challenge(&challenge);
+
+	double start = now_ns();
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		challenge.data[0] = round & 0xFF;
+		if (stateless) {
+			atsha_server_response(1, serial_number, key, challenge.data, ATSHA_CHALLENGE_HMAC, true, response);
+		} else {
+			struct atsha_handle *handle = atsha_open_server_emulation(1, serial_number, key);
+			atsha_challenge_response(handle, challenge, &expected);
+			atsha_close(handle);
+		}
+	}
+
+	return (now_ns() - start) / BENCH_ROUNDS;
+}
+
+int main(int argc, char **argv) {
+	const char *path = (argc > 1) ? argv[1] : "atsha204.sw";
+
+	atsha_set_log_callback(testing_log_callback);
+
+	struct atsha_handle *handle = atsha_open_emulation(path);
+	if (handle == NULL) {
+		fprintf(stderr, "Couldn't open configuration %s\n", path);
+		return 1;
+	}
+
+	srand(42);
+	bool ok = compare(handle, "HMAC", atsha_low_challenge_response);
+	ok = compare(handle, "MAC", atsha_low_challenge_response_mac) && ok;
+	ok = compare_server() && ok;
+	ok = compare_reference() && ok;
+	ok = compare_serial_length() && ok;
+
+	printf("HMAC packets: %7.1f ns per challenge\n", bench(handle, atsha_low_challenge_response, true));
+	printf("HMAC direct:  %7.1f ns per challenge\n", bench(handle, atsha_low_challenge_response, false));
+	printf("MAC packets:  %7.1f ns per challenge\n", bench(handle, atsha_low_challenge_response_mac, true));
+	printf("MAC direct:   %7.1f ns per challenge\n", bench(handle, atsha_low_challenge_response_mac, false));
+	printf("server instance:  %7.1f ns per response\n", bench_server(false));
+	printf("server stateless: %7.1f ns per response\n", bench_server(true));
+
+	atsha_close(handle);
+
+	return ok ? 0 : 1;
+}